@@ -0,0 +1,203 @@
+#ifndef KNU_BUFFER_POOL
+#define KNU_BUFFER_POOL
+
+// Process wide pool of large scratch blocks for the loaders. Requests are rounded up to
+// size classes, four per power of two from 4 KB on, and released blocks wait in a few
+// slots per class for the next request of that size instead of going back to the system,
+// so loading model after model reuses the same memory. Slots are taken and filled with
+// single atomic operations; no locks are involved. Small requests and blocks beyond the
+// retained limit go straight to operator new and delete.
+
+#include <atomic>
+#include <vector>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+
+namespace knu
+{
+    struct Buffer_Pool_Stats
+    {
+        std::uint64_t system_allocations;   // blocks that came from operator new
+        std::uint64_t reuses;               // requests served from a slot
+        std::uint64_t system_frees;         // blocks given back to operator delete
+        size_t retained_bytes;              // waiting in slots now
+    };
+
+    class Buffer_Pool
+    {
+        static const size_t MIN_POOLED = 4096;     // requests up to this are not pooled
+        static const int OCTAVES = 24;             // classes up to 64 GB
+        static const int CLASSES = OCTAVES * 4;
+        static const int SLOTS = 8;
+        static const int UNPOOLED = -1;
+
+        // In front of every block; keeps the payload aligned like operator new
+        struct alignas(std::max_align_t) Header
+        {
+            int size_class;
+        };
+
+        std::atomic<void *> slots[CLASSES][SLOTS];
+        std::atomic<size_t> retained, limit;
+        std::atomic<std::uint64_t> system_allocations, reuses, system_frees;
+
+        // Smallest class holding bytes, or UNPOOLED
+        static int class_of(size_t bytes)
+        {
+            if(bytes <= MIN_POOLED)
+                return UNPOOLED;
+
+            size_t b = bytes - 1;
+            int high = 0;
+            while(b >> (high + 1))
+                ++high;
+
+            int c = (high - 12) * 4 + int((b >> (high - 2)) & 3);
+            return c < CLASSES ? c : UNPOOLED;
+        }
+
+        // 5, 6, 7 or 8 quarters of a power of two
+        static size_t class_size(int c)
+        {
+            return (size_t(5) + size_t(c & 3)) << ((c >> 2) + 10);
+        }
+
+        Buffer_Pool():retained(0), limit(size_t(512) << 20), system_allocations(0), reuses(0), system_frees(0)
+        {
+            for(auto &row : slots)
+                for(auto &slot : row)
+                    slot.store(nullptr, std::memory_order_relaxed);
+        }
+
+    public:
+        // No copy constructor or assignment
+        Buffer_Pool(const Buffer_Pool &) = delete;
+        Buffer_Pool &operator=(const Buffer_Pool &) = delete;
+
+        // Never destroyed, so blocks released by other static objects at exit stay valid
+        static Buffer_Pool &shared()
+        {
+            static Buffer_Pool *pool = new Buffer_Pool();
+            return *pool;
+        }
+
+        // At least bytes, aligned for any type; throws std::bad_alloc
+        void *acquire(size_t bytes)
+        {
+            int c = class_of(bytes + sizeof(Header));
+            if(c != UNPOOLED)
+            {
+                size_t size = class_size(c);
+                for(auto &slot : slots[c])
+                {
+                    void *block = slot.load(std::memory_order_relaxed);
+                    if(block && slot.compare_exchange_strong(block, nullptr, std::memory_order_acquire))
+                    {
+                        retained.fetch_sub(size, std::memory_order_relaxed);
+                        reuses.fetch_add(1, std::memory_order_relaxed);
+                        return static_cast<Header *>(block) + 1;
+                    }
+                }
+            }
+
+            auto header = static_cast<Header *>(::operator new(c != UNPOOLED ? class_size(c) : bytes + sizeof(Header)));
+            header->size_class = c;
+            system_allocations.fetch_add(1, std::memory_order_relaxed);
+            return header + 1;
+        }
+
+        void release(void *p)
+        {
+            if(!p)
+                return;
+
+            auto header = static_cast<Header *>(p) - 1;
+            int c = header->size_class;
+            if(c != UNPOOLED)
+            {
+                size_t size = class_size(c);
+                if(retained.fetch_add(size, std::memory_order_relaxed) + size <= limit.load(std::memory_order_relaxed))
+                {
+                    for(auto &slot : slots[c])
+                    {
+                        void *empty = nullptr;
+                        if(slot.compare_exchange_strong(empty, header, std::memory_order_release, std::memory_order_relaxed))
+                            return;
+                    }
+                }
+                retained.fetch_sub(size, std::memory_order_relaxed);
+            }
+
+            ::operator delete(header);
+            system_frees.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Bytes the slots may hold at once; 0 turns pooling off
+        void set_limit(size_t bytes)
+        {
+            limit = bytes;
+            if(retained > bytes)
+                trim();
+        }
+
+        // Gives every waiting block back to the system
+        void trim()
+        {
+            for(int c = 0; c < CLASSES; ++c)
+            {
+                for(auto &slot : slots[c])
+                {
+                    if(void *block = slot.exchange(nullptr, std::memory_order_acquire))
+                    {
+                        retained.fetch_sub(class_size(c), std::memory_order_relaxed);
+                        ::operator delete(block);
+                        system_frees.fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+            }
+        }
+
+        Buffer_Pool_Stats stats() const
+        {
+            return Buffer_Pool_Stats{system_allocations.load(), reuses.load(), system_frees.load(), retained.load()};
+        }
+    };
+
+    // Allocator drawing from Buffer_Pool::shared(), for the loaders' transient arrays
+    template<typename T>
+    struct Pool_Allocator
+    {
+        typedef T value_type;
+
+        Pool_Allocator() {}
+        template<typename U> Pool_Allocator(const Pool_Allocator<U> &) {}
+
+        T *allocate(size_t n)
+        {
+            return static_cast<T *>(Buffer_Pool::shared().acquire(n * sizeof(T)));
+        }
+
+        void deallocate(T *p, size_t)
+        {
+            Buffer_Pool::shared().release(p);
+        }
+
+        template<typename U> bool operator==(const Pool_Allocator<U> &) const { return true; }
+        template<typename U> bool operator!=(const Pool_Allocator<U> &) const { return false; }
+    };
+
+    template<typename T>
+    using Pool_Vector = std::vector<T, Pool_Allocator<T>>;
+
+    // For std::unique_ptr of pooled memory
+    struct Pool_Deleter
+    {
+        void operator()(void *p) const
+        {
+            Buffer_Pool::shared().release(p);
+        }
+    };
+}
+
+#endif  // KNU_BUFFER_POOL
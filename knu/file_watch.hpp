@@ -0,0 +1,158 @@
+#ifndef KNU_FILE_WATCH
+#define KNU_FILE_WATCH
+
+// Reports files that were written or replaced since the last look. On Linux it is driven
+// by inotify on the files' directories, so saves that write a new file and rename it over
+// the old one are seen too; elsewhere the modification time and size are compared.
+// changed() never blocks and is meant to be called once a frame.
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cstddef>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <cerrno>
+#include <unordered_map>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+
+namespace knu
+{
+    class File_Watch
+    {
+        struct Watched
+        {
+            std::string path, directory, name;
+            long long time, size;   // last seen, without inotify
+        };
+
+        std::vector<Watched> files;
+#ifdef __linux__
+        int fd;
+        std::unordered_map<int, std::string> directories;   // watch descriptor -> directory
+#endif
+
+        static void split(const std::string &path, std::string &directory, std::string &name)
+        {
+            auto slash = path.find_last_of("/\\");
+            directory = slash == std::string::npos ? std::string(".") : path.substr(0, slash ? slash : 1);
+            name = slash == std::string::npos ? path : path.substr(slash + 1);
+        }
+
+#ifndef __linux__
+        static void stamp(const std::string &path, long long &time, long long &size)
+        {
+            struct stat s;
+            if(stat(path.c_str(), &s) != 0)
+            {
+                time = size = -1;
+                return;
+            }
+            time = (long long)s.st_mtime;
+            size = (long long)s.st_size;
+        }
+#endif
+
+    public:
+#ifdef __linux__
+        File_Watch():fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC))
+        {
+            if(fd < 0)
+                throw std::runtime_error("File_Watch() - unable to start inotify");
+        }
+
+        ~File_Watch()
+        {
+            close(fd);
+        }
+#else
+        File_Watch() {}
+#endif
+
+        // No copy constructor or assignment
+        File_Watch(const File_Watch &) = delete;
+        File_Watch &operator=(const File_Watch &) = delete;
+
+        // The path is reported by changed() exactly as given here
+        void add(const std::string &path)
+        {
+            for(const auto &f : files)
+                if(f.path == path)
+                    return;
+
+            Watched w = {path, std::string(), std::string(), 0, 0};
+            split(path, w.directory, w.name);
+
+#ifdef __linux__
+            int wd = inotify_add_watch(fd, w.directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+            if(wd < 0)
+                throw std::runtime_error("File_Watch::add() - unable to watch " + w.directory);
+            directories[wd] = w.directory;
+#else
+            stamp(path, w.time, w.size);
+#endif
+            files.push_back(w);
+        }
+
+        // Watched paths written or replaced since the last call, each once
+        std::vector<std::string> changed()
+        {
+            std::vector<std::string> result;
+            auto report = [&result](const std::string &path)
+            {
+                if(std::find(result.begin(), result.end(), path) == result.end())
+                    result.push_back(path);
+            };
+
+#ifdef __linux__
+            alignas(inotify_event) char buffer[4096];
+            while(true)
+            {
+                auto length = read(fd, buffer, sizeof(buffer));
+                if(length <= 0)
+                {
+                    if(length < 0 && errno == EINTR)
+                        continue;
+                    break;      // EAGAIN: nothing more for now
+                }
+
+                for(char *p = buffer; p < buffer + length; )
+                {
+                    auto event = reinterpret_cast<const inotify_event *>(p);
+                    p += sizeof(inotify_event) + event->len;
+
+                    auto directory = directories.find(event->wd);
+                    if(!event->len || directory == directories.end())
+                        continue;
+
+                    for(const auto &f : files)
+                        if(f.name == event->name && f.directory == directory->second)
+                            report(f.path);
+                }
+            }
+#else
+            for(auto &f : files)
+            {
+                long long time, size;
+                stamp(f.path, time, size);
+                if(time == f.time && size == f.size)
+                    continue;
+
+                f.time = time;
+                f.size = size;
+                if(time >= 0)
+                    report(f.path);
+            }
+#endif
+            return result;
+        }
+    };
+}
+
+#endif  // KNU_FILE_WATCH
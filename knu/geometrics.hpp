@@ -11,6 +11,9 @@
 
 #include <knu/mathlibrary5.hpp>
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
 
 using namespace knu::math;
 using namespace knu::math::utility;
@@ -109,6 +112,12 @@ public:
     origRad()
     {}
     
+    Sphere(Vector3f center, float radius):c(center),
+    origCen(center),
+    r(radius),
+    origRad(radius)
+    {}
+    
     void create_from_points(const std::vector<Vector3f> &pts)
     {
         Vector3f min(1.0f, 1.0f, 1.0f), max(-1.0f, -1.0f, -1.0f);
@@ -173,4 +182,476 @@ public:
     }
 
 };
+
+class Aabb
+{
+    Vector3f lo;
+    Vector3f hi;
+    
+public:
+    Aabb():lo(), hi() {}
+    
+    Aabb(Vector3f min_point, Vector3f max_point):lo(min_point), hi(max_point) {}
+    
+    void create_from_points(const std::vector<Vector3f> &pts)
+    {
+        if(pts.empty())
+            return;
+        
+        lo = hi = pts.front();
+        for(const auto &p : pts)
+            grow(p);
+    }
+    
+    inline void grow(const Vector3f &p)
+    {
+        lo.set(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+        hi.set(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+    }
+    
+    inline void grow(const Aabb &b)
+    {
+        grow(b.lo);
+        grow(b.hi);
+    }
+    
+    inline Vector3f min_point() const { return lo; }
+    inline Vector3f max_point() const { return hi; }
+    inline Vector3f center() const { return (lo + hi) * 0.5f; }
+    inline Vector3f extent() const { return hi - lo; }
+    
+    inline bool intersects(const Aabb &b) const
+    {
+        return lo.x <= b.hi.x && hi.x >= b.lo.x &&
+               lo.y <= b.hi.y && hi.y >= b.lo.y &&
+               lo.z <= b.hi.z && hi.z >= b.lo.z;
+    }
+};
+
+// Continuous (swept) sphere tests.
+// A sphere moving from c0 to c1 over one step is tested against a target. On a hit,
+// t is the normalized time of impact in [0, 1] along c0 -> c1. Spheres already touching
+// the target at the start of the step report t = 0.
+
+// Smallest root of a*x^2 + b*x + c = 0 that lies in [0, max_root]
+inline bool lowest_root(float a, float b, float c, float max_root, float &root)
+{
+    float det = b * b - 4.0f * a * c;
+    
+    if(det < 0.0f || std::fabs(a) < 1e-12f)
+        return false;
+    
+    float sqrt_det = std::sqrt(det);
+    float r1 = (-b - sqrt_det) / (2.0f * a);
+    float r2 = (-b + sqrt_det) / (2.0f * a);
+    
+    if(r1 > r2)
+        std::swap(r1, r2);
+    
+    if(r1 > 0.0f && r1 < max_root)
+    {
+        root = r1;
+        return true;
+    }
+    
+    if(r2 > 0.0f && r2 < max_root)
+    {
+        root = r2;
+        return true;
+    }
+    
+    return false;
+}
+
+inline bool sweep_sphere_sphere(const Vector3f &a0, const Vector3f &a1, float ar,
+                                const Vector3f &b0, const Vector3f &b1, float br, float &t)
+{
+    // work in b's frame so only a moves
+    auto d = a0 - b0;
+    auto v = (a1 - a0) - (b1 - b0);
+    float rs = ar + br;
+    float c = d.dot(d) - rs * rs;
+    
+    if(c <= 0.0f)
+    {
+        t = 0.0f;
+        return true;
+    }
+    
+    float a = v.dot(v);
+    float b = d.dot(v);
+    
+    // not moving relative to each other, or moving apart
+    if(a < 1e-12f || b >= 0.0f)
+        return false;
+    
+    float det = b * b - a * c;
+    if(det < 0.0f)
+        return false;
+    
+    t = (-b - std::sqrt(det)) / a;
+    return t <= 1.0f;
+}
+
+inline bool sweep_sphere_sphere(const Sphere &a, const Vector3f &a_end, const Sphere &b, const Vector3f &b_end, float &t)
+{
+    return sweep_sphere_sphere(a.center(), a_end, a.radius(), b.center(), b_end, b.radius(), t);
+}
+
+inline bool sweep_sphere_plane(const Vector3f &c0, const Vector3f &c1, float r, const Plane &p, float &t)
+{
+    auto n = p.normal();
+    float d = n.dot(p.point());
+    float dist0 = n.dot(c0) - d;
+    float dist1 = n.dot(c1) - d;
+    
+    if(std::fabs(dist0) <= r)
+    {
+        t = 0.0f;
+        return true;
+    }
+    
+    // both ends on the same side and clear of the plane
+    if(dist0 > r && dist1 > r)
+        return false;
+    if(dist0 < -r && dist1 < -r)
+        return false;
+    
+    float touch = dist0 > 0.0f ? r : -r;
+    t = (dist0 - touch) / (dist0 - dist1);
+    return true;
+}
+
+inline bool sweep_sphere_plane(const Sphere &s, const Vector3f &end, const Plane &p, float &t)
+{
+    return sweep_sphere_plane(s.center(), end, s.radius(), p, t);
+}
+
+inline bool sweep_sphere_triangle(const Vector3f &c0, const Vector3f &c1, float r,
+                                  const Vector3f &p0, const Vector3f &p1, const Vector3f &p2, float &t)
+{
+    auto vel = c1 - c0;
+    auto n = (p1 - p0).cross(p2 - p0);
+    
+    if(n.is_zero())
+        return false;
+    
+    n.normalize();
+    
+    // face the normal towards the start position so one side handles both windings
+    float dist = n.dot(c0 - p0);
+    if(dist < 0.0f)
+    {
+        n = -n;
+        dist = -dist;
+    }
+    
+    float n_dot_vel = n.dot(vel);
+    float t0, t1;
+    bool embedded = false;
+    
+    if(std::fabs(n_dot_vel) < 1e-12f)
+    {
+        if(dist >= r)
+            return false;
+        
+        embedded = true;
+        t0 = 0.0f;
+        t1 = 1.0f;
+    }
+    else
+    {
+        t0 = (r - dist) / n_dot_vel;
+        t1 = (-r - dist) / n_dot_vel;
+        
+        if(t0 > t1)
+            std::swap(t0, t1);
+        
+        if(t0 > 1.0f || t1 < 0.0f)
+            return false;
+        
+        t0 = clamp(t0, 0.0f, 1.0f);
+    }
+    
+    // first contact against the inside of the triangle. An embedded sphere touches it
+    // at the start of the step if its center projects inside.
+    auto q = embedded ? c0 - n * dist : c0 + vel * t0 - n * r;
+    auto e0 = p1 - p0, e1 = p2 - p0, w = q - p0;
+    float d00 = e0.dot(e0), d01 = e0.dot(e1), d11 = e1.dot(e1);
+    float d20 = w.dot(e0), d21 = w.dot(e1);
+    float denom = d00 * d11 - d01 * d01;
+    float bv = (d11 * d20 - d01 * d21) / denom;
+    float bu = (d00 * d21 - d01 * d20) / denom;
+    
+    if(bv >= 0.0f && bu >= 0.0f && (bu + bv) <= 1.0f)
+    {
+        t = t0;
+        return true;
+    }
+    
+    // otherwise the sphere can only touch a vertex or an edge
+    bool found = false;
+    float nearest = 1.0f;
+    float vel_sq = vel.length_squared();
+    float root;
+    
+    const Vector3f pts[3] = {p0, p1, p2};
+    
+    for(const auto &pt : pts)
+    {
+        float b = 2.0f * vel.dot(c0 - pt);
+        float c = (pt - c0).length_squared() - r * r;
+        
+        if(c <= 0.0f)
+        {
+            t = 0.0f;
+            return true;
+        }
+        
+        if(lowest_root(vel_sq, b, c, nearest, root))
+        {
+            nearest = root;
+            found = true;
+        }
+    }
+    
+    for(int i = 0; i < 3; ++i)
+    {
+        auto edge = pts[(i + 1) % 3] - pts[i];
+        auto base_to_vertex = pts[i] - c0;
+        float edge_sq = edge.length_squared();
+        float edge_dot_vel = edge.dot(vel);
+        float edge_dot_btv = edge.dot(base_to_vertex);
+        
+        // already touching the edge at the start of the step
+        if(edge_sq > 0.0f)
+        {
+            float f0 = clamp(-edge_dot_btv / edge_sq, 0.0f, 1.0f);
+            if((base_to_vertex + edge * f0).length_squared() <= r * r)
+            {
+                t = 0.0f;
+                return true;
+            }
+        }
+        
+        float a = edge_sq * -vel_sq + edge_dot_vel * edge_dot_vel;
+        float b = edge_sq * (2.0f * vel.dot(base_to_vertex)) - 2.0f * edge_dot_vel * edge_dot_btv;
+        float c = edge_sq * (r * r - base_to_vertex.length_squared()) + edge_dot_btv * edge_dot_btv;
+        
+        if(lowest_root(a, b, c, nearest, root))
+        {
+            float f = (edge_dot_vel * root - edge_dot_btv) / edge_sq;
+            if(f >= 0.0f && f <= 1.0f)
+            {
+                nearest = root;
+                found = true;
+            }
+        }
+    }
+    
+    if(found)
+        t = nearest;
+    
+    return found;
+}
+
+// Batch sweeps over structure of arrays. Start and end positions of every body are stored
+// component-wise so the inner loops stream through contiguous floats.
+struct SweptSpheres
+{
+    std::vector<float> x0, y0, z0;      // start of the step
+    std::vector<float> x1, y1, z1;      // end of the step
+    std::vector<float> r;
+    
+    size_t size() const { return r.size(); }
+    
+    void reserve(size_t count)
+    {
+        x0.reserve(count); y0.reserve(count); z0.reserve(count);
+        x1.reserve(count); y1.reserve(count); z1.reserve(count);
+        r.reserve(count);
+    }
+    
+    void add(const Vector3f &start, const Vector3f &end, float radius)
+    {
+        x0.push_back(start.x); y0.push_back(start.y); z0.push_back(start.z);
+        x1.push_back(end.x); y1.push_back(end.y); z1.push_back(end.z);
+        r.push_back(radius);
+    }
+    
+    Vector3f start(size_t i) const { return Vector3f(x0[i], y0[i], z0[i]); }
+    Vector3f end(size_t i) const { return Vector3f(x1[i], y1[i], z1[i]); }
+};
+
+struct SweptContact
+{
+    unsigned int a;     // index into the swept set
+    unsigned int b;     // other body or triangle index
+    float t;            // time of impact in [0, 1]
+};
+
+// Writes the time of impact per sphere into toi, or a value > 1 for spheres that miss the plane
+inline void sweep_spheres_plane(const SweptSpheres &s, const Plane &p, std::vector<float> &toi)
+{
+    auto n = p.normal();
+    float d = n.dot(p.point());
+    size_t count = s.size();
+    toi.resize(count);
+    
+    for(size_t i = 0; i < count; ++i)
+    {
+        float dist0 = n.x * s.x0[i] + n.y * s.y0[i] + n.z * s.z0[i] - d;
+        float dist1 = n.x * s.x1[i] + n.y * s.y1[i] + n.z * s.z1[i] - d;
+        float r = s.r[i];
+        float t = 2.0f;
+        
+        if(std::fabs(dist0) <= r)
+            t = 0.0f;
+        else if(!((dist0 > r && dist1 > r) || (dist0 < -r && dist1 < -r)))
+            t = (dist0 - (dist0 > 0.0f ? r : -r)) / (dist0 - dist1);
+        
+        toi[i] = t;
+    }
+}
+
+// Swept bounds of each body along x; the pair and triangle sweeps below use these to
+// sort-and-sweep before running the exact tests.
+struct SweptInterval
+{
+    float lo, hi;
+    unsigned int index;
+};
+
+inline std::vector<SweptInterval> swept_intervals_x(const SweptSpheres &s)
+{
+    std::vector<SweptInterval> intervals(s.size());
+    
+    for(size_t i = 0; i < s.size(); ++i)
+    {
+        intervals[i].lo = std::min(s.x0[i], s.x1[i]) - s.r[i];
+        intervals[i].hi = std::max(s.x0[i], s.x1[i]) + s.r[i];
+        intervals[i].index = (unsigned int)i;
+    }
+    
+    std::sort(std::begin(intervals), std::end(intervals), [](const SweptInterval &a, const SweptInterval &b)
+    {
+        return a.lo < b.lo;
+    });
+    
+    return intervals;
+}
+
+inline bool swept_boxes_overlap(const SweptSpheres &s, unsigned int a, unsigned int b)
+{
+    float ra = s.r[a], rb = s.r[b];
+    
+    if(std::min(s.y0[a], s.y1[a]) - ra > std::max(s.y0[b], s.y1[b]) + rb) return false;
+    if(std::min(s.y0[b], s.y1[b]) - rb > std::max(s.y0[a], s.y1[a]) + ra) return false;
+    if(std::min(s.z0[a], s.z1[a]) - ra > std::max(s.z0[b], s.z1[b]) + rb) return false;
+    if(std::min(s.z0[b], s.z1[b]) - rb > std::max(s.z0[a], s.z1[a]) + ra) return false;
+    
+    return true;
+}
+
+// Every pair of moving spheres that touch during the step, sorted by time of impact
+inline std::vector<SweptContact> sweep_spheres_pairs(const SweptSpheres &s)
+{
+    std::vector<SweptContact> contacts;
+    auto intervals = swept_intervals_x(s);
+    
+    for(size_t i = 0; i < intervals.size(); ++i)
+    {
+        for(size_t j = i + 1; j < intervals.size() && intervals[j].lo <= intervals[i].hi; ++j)
+        {
+            unsigned int a = intervals[i].index;
+            unsigned int b = intervals[j].index;
+            
+            if(!swept_boxes_overlap(s, a, b))
+                continue;
+            
+            float t;
+            if(sweep_sphere_sphere(s.start(a), s.end(a), s.r[a], s.start(b), s.end(b), s.r[b], t))
+                contacts.push_back(SweptContact{std::min(a, b), std::max(a, b), t});
+        }
+    }
+    
+    std::sort(std::begin(contacts), std::end(contacts), [](const SweptContact &a, const SweptContact &b)
+    {
+        return a.t < b.t;
+    });
+    
+    return contacts;
+}
+
+// Earliest triangle hit per sphere against a static triangle soup (3 points per triangle).
+// Spheres and triangles are sorted together on x and swept like the pairs above; pairs that
+// overlap there are culled on y and z before the exact test.
+inline std::vector<SweptContact> sweep_spheres_triangles(const SweptSpheres &s, const std::vector<Vector3f> &tris)
+{
+    std::vector<SweptContact> contacts;
+    size_t tri_count = tris.size() / 3;
+    size_t sphere_count = s.size();
+    
+    struct TriBounds { Vector3f lo, hi; };
+    std::vector<TriBounds> bounds(tri_count);
+    
+    for(size_t i = 0; i < tri_count; ++i)
+    {
+        const auto &a = tris[i * 3], &b = tris[i * 3 + 1], &c = tris[i * 3 + 2];
+        bounds[i].lo = Vector3f(std::min({a.x, b.x, c.x}), std::min({a.y, b.y, c.y}), std::min({a.z, b.z, c.z}));
+        bounds[i].hi = Vector3f(std::max({a.x, b.x, c.x}), std::max({a.y, b.y, c.y}), std::max({a.z, b.z, c.z}));
+    }
+    
+    // triangles follow the spheres in the index space of the intervals
+    auto intervals = swept_intervals_x(s);
+    intervals.reserve(sphere_count + tri_count);
+    for(size_t k = 0; k < tri_count; ++k)
+        intervals.push_back(SweptInterval{bounds[k].lo.x, bounds[k].hi.x, (unsigned int)(sphere_count + k)});
+    
+    std::sort(std::begin(intervals), std::end(intervals), [](const SweptInterval &a, const SweptInterval &b)
+    {
+        return a.lo < b.lo;
+    });
+    
+    std::vector<SweptContact> best(sphere_count);
+    for(size_t i = 0; i < sphere_count; ++i)
+        best[i] = SweptContact{(unsigned int)i, 0, 2.0f};
+    
+    for(size_t i = 0; i < intervals.size(); ++i)
+    {
+        for(size_t j = i + 1; j < intervals.size() && intervals[j].lo <= intervals[i].hi; ++j)
+        {
+            bool first_is_tri = intervals[i].index >= sphere_count;
+            if(first_is_tri == (intervals[j].index >= sphere_count))
+                continue;
+            
+            unsigned int sphere = first_is_tri ? intervals[j].index : intervals[i].index;
+            unsigned int k = (first_is_tri ? intervals[i].index : intervals[j].index) - (unsigned int)sphere_count;
+            
+            float r = s.r[sphere];
+            const auto &tb = bounds[k];
+            if(tb.lo.y > std::max(s.y0[sphere], s.y1[sphere]) + r || tb.hi.y < std::min(s.y0[sphere], s.y1[sphere]) - r ||
+               tb.lo.z > std::max(s.z0[sphere], s.z1[sphere]) + r || tb.hi.z < std::min(s.z0[sphere], s.z1[sphere]) - r)
+                continue;
+            
+            // equal times go to the lower triangle index, whatever order the sweep met them in
+            float t;
+            auto &b = best[sphere];
+            if(sweep_sphere_triangle(s.start(sphere), s.end(sphere), r, tris[k * 3], tris[k * 3 + 1], tris[k * 3 + 2], t) &&
+               (t < b.t || (t == b.t && k < b.b)))
+            {
+                b.b = k;
+                b.t = t;
+            }
+        }
+    }
+    
+    for(const auto &b : best)
+    {
+        if(b.t <= 1.0f)
+            contacts.push_back(b);
+    }
+    
+    return contacts;
+}
 #endif
@@ -7,6 +7,7 @@
 
 //#define STBI_HEADER_FILE_ONLY
 #include <knu/stb_image.h>
+#include <knu/buffer_pool.hpp>
 
 #ifdef __APPLE__
 #include <OpenGL/gl3.h>
@@ -64,9 +65,9 @@ namespace knu
 			if (i.bytesPerPixel == 4)
 			{
 				i.format = GL_RGBA8;
-				std::vector<RGBA> pixelData((RGBA*)data.get(), ((RGBA*)data.get() + (w * h)));
-				std::vector<RGBA> flippedData(w * h);
-				std::vector<RGBA>::iterator iter = flippedData.begin();
+				Pool_Vector<RGBA> pixelData((RGBA*)data.get(), ((RGBA*)data.get() + (w * h)));
+				Pool_Vector<RGBA> flippedData(w * h);
+				auto iter = flippedData.begin();
 
 				for (int yPos = (h - 1) * w; yPos >= 0; yPos -= w)
 				{
@@ -83,9 +84,9 @@ namespace knu
 			if (i.bytesPerPixel == 3)
 			{
 				i.format = GL_RGB8;
-				std::vector<RGB> pixelData((RGB*)data.get(), ((RGB*)data.get() + (w * h)));
-				std::vector<RGB> flippedData(w * h);
-				std::vector<RGB>::iterator iter = flippedData.begin();
+				Pool_Vector<RGB> pixelData((RGB*)data.get(), ((RGB*)data.get() + (w * h)));
+				Pool_Vector<RGB> flippedData(w * h);
+				auto iter = flippedData.begin();
 
 				for (int yPos = (h - 1) * w; yPos >= 0; yPos -= w)
 				{
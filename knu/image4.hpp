@@ -10,6 +10,7 @@
 #define knu_image4_hpp
 
 #include <memory>
+#include <knu/buffer_pool.hpp>
 
 #ifdef __APPLE__
 #include <SDL2/SDL.h>
@@ -43,7 +44,7 @@ namespace knu
             unsigned int format;
             unsigned int internalFormat;
             int imageSize;
-            std::unique_ptr<unsigned char[]> imageData;
+            std::unique_ptr<unsigned char[], Pool_Deleter> imageData;     // only kept until uploaded, so pooled
             
         public:
             void load_image(std::string name_)
@@ -106,7 +107,7 @@ namespace knu
                 
                 
                 imageSize = width * height * bytesPerPixel;
-                std::unique_ptr<unsigned char[]> data(new unsigned char[imageSize]);
+                std::unique_ptr<unsigned char[], Pool_Deleter> data(static_cast<unsigned char *>(Buffer_Pool::shared().acquire(imageSize)));
                 memcpy(data.get(), surface->pixels, imageSize);
                 
                 imageData = std::move(data);
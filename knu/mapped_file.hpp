@@ -0,0 +1,153 @@
+#ifndef KNU_MAPPED_FILE
+#define KNU_MAPPED_FILE
+
+// Read only memory mapping of a whole file.
+
+#include <string>
+#include <stdexcept>
+#include <cstddef>
+#include <utility>
+
+#ifdef WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace knu
+{
+    class Mapped_File
+    {
+        const char *ptr;
+        size_t length;
+#ifdef WIN32
+        HANDLE file;
+        HANDLE mapping;
+#endif
+
+        void close()
+        {
+#ifdef WIN32
+            if(ptr)
+                UnmapViewOfFile(ptr);
+            if(mapping)
+                CloseHandle(mapping);
+            if(file != INVALID_HANDLE_VALUE)
+                CloseHandle(file);
+            mapping = nullptr;
+            file = INVALID_HANDLE_VALUE;
+#else
+            if(ptr)
+                munmap(const_cast<char *>(ptr), length);
+#endif
+            ptr = nullptr;
+            length = 0;
+        }
+
+    public:
+#ifdef WIN32
+        Mapped_File():ptr(nullptr), length(0), file(INVALID_HANDLE_VALUE), mapping(nullptr) {}
+#else
+        Mapped_File():ptr(nullptr), length(0) {}
+#endif
+
+        explicit Mapped_File(const std::string &path):Mapped_File()
+        {
+            open(path);
+        }
+
+        ~Mapped_File()
+        {
+            close();
+        }
+
+        // No copy constructor or assignment
+        Mapped_File(const Mapped_File &) = delete;
+        Mapped_File &operator=(const Mapped_File &) = delete;
+
+        Mapped_File(Mapped_File &&m):Mapped_File()
+        {
+            *this = std::move(m);
+        }
+
+        Mapped_File &operator=(Mapped_File &&m)
+        {
+            if(this != &m)
+            {
+                close();
+                std::swap(ptr, m.ptr);
+                std::swap(length, m.length);
+#ifdef WIN32
+                std::swap(file, m.file);
+                std::swap(mapping, m.mapping);
+#endif
+            }
+            return *this;
+        }
+
+        void open(const std::string &path)
+        {
+            close();
+#ifdef WIN32
+            file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            if(file == INVALID_HANDLE_VALUE)
+                throw std::runtime_error("Could not open file at " + path);
+
+            LARGE_INTEGER size;
+            GetFileSizeEx(file, &size);
+            length = (size_t)size.QuadPart;
+
+            if(length)
+            {
+                mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+                if(!mapping)
+                    throw std::runtime_error("Could not map file at " + path);
+
+                ptr = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                if(!ptr)
+                    throw std::runtime_error("Could not map file at " + path);
+            }
+#else
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if(fd < 0)
+                throw std::runtime_error("Could not open file at " + path);
+
+            struct stat st;
+            if(fstat(fd, &st) != 0)
+            {
+                ::close(fd);
+                throw std::runtime_error("Could not stat file at " + path);
+            }
+
+            length = (size_t)st.st_size;
+
+            if(length)
+            {
+                void *p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if(p == MAP_FAILED)
+                {
+                    ::close(fd);
+                    length = 0;
+                    throw std::runtime_error("Could not map file at " + path);
+                }
+
+                madvise(p, length, MADV_SEQUENTIAL);
+                ptr = (const char *)p;
+            }
+
+            ::close(fd);
+#endif
+        }
+
+        const char *data() const { return ptr; }
+        const char *begin() const { return ptr; }
+        const char *end() const { return ptr + length; }
+        size_t size() const { return length; }
+        bool empty() const { return length == 0; }
+    };
+}
+
+#endif  // KNU_MAPPED_FILE
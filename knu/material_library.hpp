@@ -0,0 +1,204 @@
+#ifndef KNU_MATERIAL_LIBRARY
+#define KNU_MATERIAL_LIBRARY
+
+// Process wide store of .mtl materials. Each file is parsed once and its materials are
+// shared by every model that uses it; materials and texture names get interned ids, small
+// integers that are equal for equal entries, for sorting draws and binding textures.
+// Ids stay valid for the life of the process. Reading a changed file again updates its
+// materials in place under the same ids, so it must not race with code holding references
+// to them; materials no longer in the file are dropped from its names.
+
+#include <knu/obj.hpp>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <stdexcept>
+#include <cstdint>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+namespace knu
+{
+    // Material_Id, Texture_Id, NO_MATERIAL and NO_TEXTURE are in obj.hpp
+
+    class Material_Library
+    {
+        struct File
+        {
+            std::uint64_t size;
+            std::int64_t mtime;
+            std::unordered_map<std::string, Material_Id> ids;
+        };
+
+        struct Entry
+        {
+            Obj_Material material;
+            Texture_Id diffuse_texture, ambient_texture;
+        };
+
+        mutable std::mutex lock;
+        std::unordered_map<std::string, File> files;
+        std::deque<Entry> entries;
+        std::deque<std::string> textures;
+        std::unordered_map<std::string, Texture_Id> texture_ids;
+
+        static bool stamp(const std::string &path, std::uint64_t &size, std::int64_t &mtime)
+        {
+            struct stat s;
+            if(stat(path.c_str(), &s) != 0)
+                return false;
+            size = std::uint64_t(s.st_size);
+            mtime = std::int64_t(s.st_mtime);
+            return true;
+        }
+
+        // Called with the lock held
+        Texture_Id intern(const std::string &name)
+        {
+            if(name.empty())
+                return NO_TEXTURE;
+
+            auto it = texture_ids.find(name);
+            if(it != texture_ids.end())
+                return it->second;
+
+            auto id = Texture_Id(textures.size());
+            textures.push_back(name);
+            texture_ids[name] = id;
+            return id;
+        }
+
+        const Entry &entry(Material_Id id) const
+        {
+            if(id >= entries.size())
+                throw std::runtime_error("Material_Library - unknown material id");
+            return entries[id];
+        }
+
+        // Makes sure path's entries are current and returns them, with the lock held
+        const File &refresh(const std::string &path, bool reparse, std::unique_lock<std::mutex> &guard)
+        {
+            std::uint64_t size = 0;
+            std::int64_t mtime = 0;
+            bool found = stamp(path, size, mtime);
+
+            guard.lock();
+            auto it = files.find(path);
+            if(it != files.end() && !reparse && found && it->second.size == size && it->second.mtime == mtime)
+                return it->second;
+            guard.unlock();
+
+            // parsed outside the lock, so models using other files are not held up
+            auto materials = read_obj_materials(path);
+
+            guard.lock();
+            auto &file = files[path];
+            file.size = size;
+            file.mtime = mtime;
+
+            // names still in the file keep their ids
+            std::unordered_map<std::string, Material_Id> ids;
+            for(auto &kv : materials)
+            {
+                Entry e = {kv.second, intern(kv.second.mat_diffuse_texture_name), intern(kv.second.mat_ambient_texture_name)};
+
+                auto id = file.ids.find(kv.first);
+                if(id != file.ids.end())
+                {
+                    entries[id->second] = std::move(e);
+                    ids[kv.first] = id->second;
+                }
+                else
+                {
+                    ids[kv.first] = Material_Id(entries.size());
+                    entries.push_back(std::move(e));
+                }
+            }
+            file.ids.swap(ids);
+            return file;
+        }
+
+        Material_Library() {}
+
+    public:
+        // No copy constructor or assignment
+        Material_Library(const Material_Library &) = delete;
+        Material_Library &operator=(const Material_Library &) = delete;
+
+        static Material_Library &shared()
+        {
+            static Material_Library library;
+            return library;
+        }
+
+        // Ids of the materials in path by name. The file is parsed the first time, and again
+        // only when its size or modification time changed or reparse is set.
+        std::unordered_map<std::string, Material_Id> load(const std::string &path, bool reparse = false)
+        {
+            std::unique_lock<std::mutex> guard(lock, std::defer_lock);
+            return refresh(path, reparse, guard).ids;
+        }
+
+        // NO_MATERIAL when path has no material of that name
+        Material_Id find(const std::string &path, const std::string &name)
+        {
+            std::unique_lock<std::mutex> guard(lock, std::defer_lock);
+            const auto &ids = refresh(path, false, guard).ids;
+            auto it = ids.find(name);
+            return it != ids.end() ? it->second : NO_MATERIAL;
+        }
+
+        // Copies of path's materials
+        std::vector<Obj_Material> materials(const std::string &path)
+        {
+            std::unique_lock<std::mutex> guard(lock, std::defer_lock);
+            std::vector<Obj_Material> result;
+            for(const auto &kv : refresh(path, false, guard).ids)
+                result.push_back(entries[kv.second].material);
+            return result;
+        }
+
+        // The reference stays valid; its contents change if the file is read again
+        const Obj_Material &material(Material_Id id) const
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            return entry(id).material;
+        }
+
+        Texture_Id diffuse_texture(Material_Id id) const
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            return entry(id).diffuse_texture;
+        }
+
+        Texture_Id ambient_texture(Material_Id id) const
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            return entry(id).ambient_texture;
+        }
+
+        const std::string &texture_name(Texture_Id id) const
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if(id >= textures.size())
+                throw std::runtime_error("Material_Library - unknown texture id");
+            return textures[id];
+        }
+
+        size_t material_count() const
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            return entries.size();
+        }
+
+        size_t texture_count() const
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            return textures.size();
+        }
+    };
+}
+
+#endif  // KNU_MATERIAL_LIBRARY
@@ -0,0 +1,496 @@
+#ifndef KNU_MESH_BVH
+#define KNU_MESH_BVH
+
+// Bounding volume hierarchies over Obj meshes and ray picking against them.
+// An Obj builds its hierarchy the first time it is picked and keeps it in Obj::bvh;
+// the hierarchy is immutable afterwards, so any number of threads can pick concurrently.
+
+#include <knu/mathlibrary5.hpp>
+#include <knu/geometrics.hpp>
+#include <knu/obj.hpp>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+
+namespace knu
+{
+    struct Bvh_Hit
+    {
+        unsigned int triangle;  // index of the triangle in the source mesh
+        float t;                // ray parameter of the hit
+        float u, v;             // barycentrics of corners 1 and 2; corner 0 weighs 1 - u - v
+    };
+
+    class Mesh_Bvh
+    {
+        struct Node
+        {
+            float lo[3], hi[3];
+            unsigned int start;     // first triangle for leaves, left child for interior nodes
+            unsigned int count;     // triangles in a leaf, 0 for interior nodes
+        };
+
+        struct Build_Item
+        {
+            float lo[3], hi[3], c[3];
+        };
+
+        std::vector<Node> nodes;
+        std::vector<knu::math::v3f> corners;    // triangle corners in leaf order
+        std::vector<unsigned int> source;       // leaf order -> source triangle
+
+        static const unsigned int leaf_size = 4;
+        static const int bin_count = 12;
+        static const unsigned int max_depth = 60;   // deeper ranges become leaves; bounds the traversal stack
+
+    private:
+        void bounds(Node &n, const std::vector<Build_Item> &items, unsigned int begin, unsigned int end) const
+        {
+            for(int a = 0; a < 3; ++a)
+            {
+                n.lo[a] = std::numeric_limits<float>::max();
+                n.hi[a] = -std::numeric_limits<float>::max();
+            }
+
+            for(unsigned int i = begin; i < end; ++i)
+            {
+                const auto &it = items[source[i]];
+                for(int a = 0; a < 3; ++a)
+                {
+                    n.lo[a] = std::min(n.lo[a], it.lo[a]);
+                    n.hi[a] = std::max(n.hi[a], it.hi[a]);
+                }
+            }
+        }
+
+        static float area(const float lo[3], const float hi[3])
+        {
+            float dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+            return dx * dy + dy * dz + dz * dx;
+        }
+
+        // Binned SAH split; returns the partition point or begin when the range should stay a leaf
+        unsigned int split(const std::vector<Build_Item> &items, unsigned int begin, unsigned int end)
+        {
+            float clo[3], chi[3];
+            for(int a = 0; a < 3; ++a)
+            {
+                clo[a] = std::numeric_limits<float>::max();
+                chi[a] = -std::numeric_limits<float>::max();
+            }
+
+            for(unsigned int i = begin; i < end; ++i)
+            {
+                for(int a = 0; a < 3; ++a)
+                {
+                    clo[a] = std::min(clo[a], items[source[i]].c[a]);
+                    chi[a] = std::max(chi[a], items[source[i]].c[a]);
+                }
+            }
+
+            int axis = 0;
+            for(int a = 1; a < 3; ++a)
+                if(chi[a] - clo[a] > chi[axis] - clo[axis])
+                    axis = a;
+
+            float extent = chi[axis] - clo[axis];
+            if(extent <= 0.0f)
+                return (end - begin) > leaf_size ? begin + (end - begin) / 2 : begin;
+
+            struct Bin
+            {
+                float lo[3], hi[3];
+                unsigned int count;
+            } bins[bin_count];
+
+            for(auto &b : bins)
+            {
+                b.count = 0;
+                for(int a = 0; a < 3; ++a)
+                {
+                    b.lo[a] = std::numeric_limits<float>::max();
+                    b.hi[a] = -std::numeric_limits<float>::max();
+                }
+            }
+
+            // subnormal extents overflow the scale
+            float scale = bin_count / extent;
+            if(!std::isfinite(scale))
+                return (end - begin) > leaf_size ? begin + (end - begin) / 2 : begin;
+
+            auto bin_of = [&](unsigned int tri)
+            {
+                float b = (items[tri].c[axis] - clo[axis]) * scale;
+                return (int)std::max(0.0f, std::min(float(bin_count - 1), b));
+            };
+
+            for(unsigned int i = begin; i < end; ++i)
+            {
+                auto &b = bins[bin_of(source[i])];
+                ++b.count;
+                for(int a = 0; a < 3; ++a)
+                {
+                    b.lo[a] = std::min(b.lo[a], items[source[i]].lo[a]);
+                    b.hi[a] = std::max(b.hi[a], items[source[i]].hi[a]);
+                }
+            }
+
+            // sweep from the right, then from the left, to cost every plane between bins
+            float right_area[bin_count];
+            unsigned int right_count[bin_count];
+            float lo[3], hi[3];
+            unsigned int count = 0;
+
+            for(int a = 0; a < 3; ++a)
+            {
+                lo[a] = std::numeric_limits<float>::max();
+                hi[a] = -std::numeric_limits<float>::max();
+            }
+
+            for(int b = bin_count - 1; b > 0; --b)
+            {
+                count += bins[b].count;
+                for(int a = 0; a < 3; ++a)
+                {
+                    lo[a] = std::min(lo[a], bins[b].lo[a]);
+                    hi[a] = std::max(hi[a], bins[b].hi[a]);
+                }
+                right_count[b] = count;
+                right_area[b] = count ? area(lo, hi) : 0.0f;
+            }
+
+            for(int a = 0; a < 3; ++a)
+            {
+                lo[a] = std::numeric_limits<float>::max();
+                hi[a] = -std::numeric_limits<float>::max();
+            }
+
+            count = 0;
+            float best_cost = std::numeric_limits<float>::max();
+            int best_plane = -1;
+
+            for(int b = 0; b < bin_count - 1; ++b)
+            {
+                count += bins[b].count;
+                for(int a = 0; a < 3; ++a)
+                {
+                    lo[a] = std::min(lo[a], bins[b].lo[a]);
+                    hi[a] = std::max(hi[a], bins[b].hi[a]);
+                }
+
+                if(!count || !right_count[b + 1])
+                    continue;
+
+                float cost = count * area(lo, hi) + right_count[b + 1] * right_area[b + 1];
+                if(cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_plane = b;
+                }
+            }
+
+            Node whole;
+            bounds(whole, items, begin, end);
+            float leaf_cost = (end - begin) * area(whole.lo, whole.hi);
+
+            if(best_plane < 0 || ((end - begin) <= leaf_size && best_cost >= leaf_cost))
+                return (end - begin) > leaf_size ? begin + (end - begin) / 2 : begin;
+
+            auto mid = std::partition(source.begin() + begin, source.begin() + end, [&](unsigned int tri)
+            {
+                return bin_of(tri) <= best_plane;
+            });
+
+            return (unsigned int)(mid - source.begin());
+        }
+
+        void build(const std::vector<knu::math::v3f> &v)
+        {
+            auto tri_count = (unsigned int)(v.size() / 3);
+            if(!tri_count)
+                return;
+
+            std::vector<Build_Item> items(tri_count);
+            source.resize(tri_count);
+
+            for(unsigned int i = 0; i < tri_count; ++i)
+            {
+                const auto &a = v[i * 3], &b = v[i * 3 + 1], &c = v[i * 3 + 2];
+                auto &it = items[i];
+                it.lo[0] = std::min({a.x, b.x, c.x}); it.hi[0] = std::max({a.x, b.x, c.x});
+                it.lo[1] = std::min({a.y, b.y, c.y}); it.hi[1] = std::max({a.y, b.y, c.y});
+                it.lo[2] = std::min({a.z, b.z, c.z}); it.hi[2] = std::max({a.z, b.z, c.z});
+                for(int k = 0; k < 3; ++k)
+                    it.c[k] = (it.lo[k] + it.hi[k]) * 0.5f;
+                source[i] = i;
+            }
+
+            nodes.reserve(tri_count * 2 / leaf_size + 1);
+            nodes.push_back(Node());
+
+            struct Range { unsigned int node, begin, end, depth; };
+            std::vector<Range> stack;
+            stack.push_back(Range{0, 0, tri_count, 0});
+
+            while(!stack.empty())
+            {
+                auto r = stack.back();
+                stack.pop_back();
+
+                bounds(nodes[r.node], items, r.begin, r.end);
+                unsigned int mid = r.depth < max_depth ? split(items, r.begin, r.end) : r.begin;
+
+                if(mid == r.begin || mid == r.end)
+                {
+                    nodes[r.node].start = r.begin;
+                    nodes[r.node].count = r.end - r.begin;
+                    continue;
+                }
+
+                auto left = (unsigned int)nodes.size();
+                nodes[r.node].start = left;
+                nodes[r.node].count = 0;
+                nodes.push_back(Node());
+                nodes.push_back(Node());
+                stack.push_back(Range{left, r.begin, mid, r.depth + 1});
+                stack.push_back(Range{left + 1, mid, r.end, r.depth + 1});
+            }
+
+            corners.resize(tri_count * 3);
+            for(unsigned int i = 0; i < tri_count; ++i)
+            {
+                corners[i * 3] = v[source[i] * 3];
+                corners[i * 3 + 1] = v[source[i] * 3 + 1];
+                corners[i * 3 + 2] = v[source[i] * 3 + 2];
+            }
+        }
+
+        static bool slab(const Node &n, const float o[3], const float inv[3], float t_max, float &t_enter)
+        {
+            float t0 = 0.0f, t1 = t_max;
+            for(int a = 0; a < 3; ++a)
+            {
+                float near_t = (n.lo[a] - o[a]) * inv[a];
+                float far_t = (n.hi[a] - o[a]) * inv[a];
+                if(near_t > far_t)
+                    std::swap(near_t, far_t);
+                t0 = near_t > t0 ? near_t : t0;
+                t1 = far_t < t1 ? far_t : t1;
+                if(t0 > t1)
+                    return false;
+            }
+            t_enter = t0;
+            return true;
+        }
+
+    public:
+        Mesh_Bvh() {}
+
+        // v holds a non indexed triangle list, three corners per triangle (as in knu::Mesh::v)
+        explicit Mesh_Bvh(const std::vector<knu::math::v3f> &v)
+        {
+            build(v);
+        }
+
+        bool empty() const { return nodes.empty(); }
+
+        // Hits with t in [0, t_max) along origin + dir * t. With any_hit the first hit found is
+        // returned instead of the nearest.
+        bool intersect(const knu::math::v3f &origin, const knu::math::v3f &dir, float t_max, Bvh_Hit &hit, bool any_hit = false) const
+        {
+            if(nodes.empty())
+                return false;
+
+            const float o[3] = {origin.x, origin.y, origin.z};
+            const float d[3] = {dir.x, dir.y, dir.z};
+            float inv[3];
+            for(int a = 0; a < 3; ++a)
+                inv[a] = d[a] != 0.0f ? 1.0f / d[a] : std::numeric_limits<float>::max();
+
+            bool found = false;
+            float nearest = t_max;
+            unsigned int stack[max_depth + 2];
+            int top = 0;
+            stack[top++] = 0;
+
+            while(top)
+            {
+                const auto &n = nodes[stack[--top]];
+                float t_enter;
+                if(!slab(n, o, inv, nearest, t_enter))
+                    continue;
+
+                if(n.count)
+                {
+                    for(unsigned int i = n.start; i < n.start + n.count; ++i)
+                    {
+                        // Moller-Trumbore
+                        const auto &p0 = corners[i * 3];
+                        auto e1 = corners[i * 3 + 1] - p0;
+                        auto e2 = corners[i * 3 + 2] - p0;
+                        auto p = dir.cross(e2);
+                        float det = e1.dot(p);
+                        if(std::fabs(det) < 1e-12f)
+                            continue;
+
+                        float inv_det = 1.0f / det;
+                        auto s = origin - p0;
+                        float u = s.dot(p) * inv_det;
+                        if(u < 0.0f || u > 1.0f)
+                            continue;
+
+                        auto q = s.cross(e1);
+                        float v = dir.dot(q) * inv_det;
+                        if(v < 0.0f || u + v > 1.0f)
+                            continue;
+
+                        float t = e2.dot(q) * inv_det;
+                        if(t < 0.0f || t >= nearest)
+                            continue;
+
+                        nearest = t;
+                        hit.triangle = source[i];
+                        hit.t = t;
+                        hit.u = u;
+                        hit.v = v;
+                        found = true;
+
+                        if(any_hit)
+                            return true;
+                    }
+                }
+                else
+                {
+                    // visit the nearer child first
+                    float tl, tr;
+                    bool hl = slab(nodes[n.start], o, inv, nearest, tl);
+                    bool hr = slab(nodes[n.start + 1], o, inv, nearest, tr);
+
+                    if(hl && hr)
+                    {
+                        if(tl <= tr)
+                        {
+                            stack[top++] = n.start + 1;
+                            stack[top++] = n.start;
+                        }
+                        else
+                        {
+                            stack[top++] = n.start;
+                            stack[top++] = n.start + 1;
+                        }
+                    }
+                    else if(hl)
+                        stack[top++] = n.start;
+                    else if(hr)
+                        stack[top++] = n.start + 1;
+                }
+            }
+
+            return found;
+        }
+    };
+
+    class Obj_Bvh
+    {
+    public:
+        explicit Obj_Bvh(const Obj &o)
+        {
+            meshes.reserve(o.meshes.size());
+            for(const auto &m : o.meshes)
+                meshes.push_back(Mesh_Bvh(m.expand(m.v)));
+        }
+
+        std::vector<Mesh_Bvh> meshes;   // one per Obj::meshes entry
+    };
+
+    // The hierarchy cached on o, built on first use. Concurrent first calls may each build one;
+    // only the first to finish is kept. Reset o.bvh after editing o.meshes.
+    inline std::shared_ptr<const Obj_Bvh> obj_bvh(const Obj &o)
+    {
+        auto b = std::atomic_load(&o.bvh);
+        if(b)
+            return b;
+
+        std::shared_ptr<const Obj_Bvh> built = std::make_shared<const Obj_Bvh>(o);
+        if(std::atomic_compare_exchange_strong(&o.bvh, &b, built))
+            return built;
+
+        return b;
+    }
+
+    struct Pick_Hit
+    {
+        int model;              // index into the models passed to pick, -1 for a miss
+        unsigned int mesh;
+        unsigned int triangle;
+        float u, v;             // barycentrics of corners 1 and 2
+        float distance;         // world space distance from the ray origin
+
+        Pick_Hit():model(-1), mesh(0), triangle(0), u(0.0f), v(0.0f), distance(0.0f) {}
+        explicit operator bool() const { return model >= 0; }
+    };
+
+    namespace detail
+    {
+        inline Pick_Hit pick(const Ray<knu::math::v3f> &ray, const std::vector<const Obj *> &models,
+                             const std::vector<knu::math::m4f> &transforms, bool any_hit)
+        {
+            if(models.size() != transforms.size())
+                throw std::runtime_error("pick() - every model needs a transform");
+
+            Pick_Hit result;
+            float nearest = std::numeric_limits<float>::max();     // in units of the world ray parameter
+            float world_length = ray.length();
+
+            for(size_t i = 0; i < models.size(); ++i)
+            {
+                auto bvh = obj_bvh(*models[i]);
+                auto to_object = transforms[i].get_inverse();
+
+                // affine transforms keep the ray parameter, so hits compare across models
+                auto origin = (knu::math::v4f(ray.begin(), 1.0f) * to_object).get_vec3();
+                auto dir = (knu::math::v4f(ray.direction(), 0.0f) * to_object).get_vec3();
+
+                for(size_t m = 0; m < bvh->meshes.size(); ++m)
+                {
+                    Bvh_Hit hit;
+                    if(bvh->meshes[m].intersect(origin, dir, nearest, hit, any_hit))
+                    {
+                        nearest = hit.t;
+                        result.model = (int)i;
+                        result.mesh = (unsigned int)m;
+                        result.triangle = hit.triangle;
+                        result.u = hit.u;
+                        result.v = hit.v;
+                        result.distance = hit.t * world_length;
+
+                        if(any_hit)
+                            return result;
+                    }
+                }
+            }
+
+            return result;
+        }
+    }
+
+    // Nearest triangle hit along ray.begin() + ray.direction() * t, t >= 0.
+    // transforms[i] takes models[i] from object to world space.
+    inline Pick_Hit pick(const Ray<knu::math::v3f> &ray, const std::vector<const Obj *> &models,
+                         const std::vector<knu::math::m4f> &transforms)
+    {
+        return detail::pick(ray, models, transforms, false);
+    }
+
+    // Returns on the first hit found, for occlusion style queries
+    inline Pick_Hit pick_any(const Ray<knu::math::v3f> &ray, const std::vector<const Obj *> &models,
+                             const std::vector<knu::math::m4f> &transforms)
+    {
+        return detail::pick(ray, models, transforms, true);
+    }
+}
+
+#endif  // KNU_MESH_BVH
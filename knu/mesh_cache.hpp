@@ -0,0 +1,856 @@
+#ifndef KNU_MESH_CACHE
+#define KNU_MESH_CACHE
+
+// Binary cache of a loaded Obj, written next to the .obj after the first parse.
+// The file is memory mapped on load; vertex blocks are stored in the planar layout
+// Model_Obj uploads (positions, then texture coordinates, then normals), so they can go
+// to the GL buffer straight out of the mapping. A cache is only used when the source
+// paths, sizes, modification times, content hash and load options all match. Levels of
+// detail are stored after their mesh's indices, with the same index size, followed by the
+// meshlet table. Caches written with Obj_Options::compress_cache keep vertices and indices
+// packed (mesh_codec.hpp) and are decoded into pooled memory when opened.
+
+#include <knu/obj.hpp>
+#include <knu/mapped_file.hpp>
+#include <knu/mesh_codec.hpp>
+#include <knu/buffer_pool.hpp>
+#include <knu/parallel.hpp>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
+#include <fstream>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <atomic>
+#include <sys/stat.h>
+
+namespace knu
+{
+    const std::uint32_t MESH_CACHE_VERSION = 5;
+
+    namespace detail
+    {
+        const char MESH_CACHE_MAGIC[8] = {'K', 'N', 'U', 'M', 'E', 'S', 'H', 0};
+        const std::uint32_t MESH_CACHE_BYTE_ORDER = 0x01020304;
+        const std::uint32_t MESH_CACHE_PACKED = 4;      // in the flags
+
+        struct Mesh_Cache_String
+        {
+            std::uint64_t offset, length;       // into the string block
+        };
+
+        struct Mesh_Cache_Header
+        {
+            char magic[8];
+            std::uint32_t version;
+            std::uint32_t byte_order;
+            std::uint32_t flags;
+            std::uint32_t format;
+            std::uint32_t format_size;
+            std::uint32_t mesh_count;
+            std::uint32_t material_count;
+            std::uint32_t options_key;
+            std::uint64_t obj_size, mtl_size;
+            std::int64_t obj_mtime, mtl_mtime;
+            std::uint64_t content_hash;
+            std::uint64_t file_size;
+            std::uint64_t mesh_table, material_table, strings, strings_size;
+            Mesh_Cache_String obj_path, mtl_path;
+        };
+
+        struct Mesh_Cache_Entry
+        {
+            Mesh_Cache_String material;
+            std::uint64_t vertex_count, index_count;
+            std::uint64_t vertex_offset, vertex_bytes;
+            std::uint64_t index_offset;
+            std::uint64_t lod_table;            // lod_count Mesh_Cache_Lod
+            std::uint64_t meshlet_table;        // meshlet_count Meshlet
+            std::uint32_t index_size;           // 0 (not indexed), 2 or 4
+            std::uint32_t lod_count;
+            std::uint32_t meshlet_count;
+            std::uint32_t packed;               // 1: vertices and indices stored packed
+            float bounds_min[3], bounds_max[3];
+            std::uint64_t packed_vertex_bytes, packed_index_bytes;
+        };
+
+        struct Mesh_Cache_Lod
+        {
+            std::uint64_t index_offset, index_count;
+            std::uint64_t packed_bytes;
+            float error;
+            std::uint32_t reserved;
+        };
+
+        struct Mesh_Cache_Material
+        {
+            Mesh_Cache_String name, diffuse_texture, ambient_texture;
+            float ambient[4], diffuse[4], specular[4];
+            double specular_exponent, opacity;
+        };
+
+        // Four lane multiply/xorshift hash, fast enough to run over the sources on every start
+        inline std::uint64_t hash_bytes(const char *p, size_t size, std::uint64_t seed)
+        {
+            const std::uint64_t K = 0x9E3779B97F4A7C15ull;
+            std::uint64_t lane[4] = {seed ^ size, seed + K, seed ^ (K >> 7), seed - K};
+
+            auto mix = [](std::uint64_t h, std::uint64_t w)
+            {
+                w *= 0xC2B2AE3D27D4EB4Full;
+                w ^= w >> 31;
+                return (h ^ w) * 0x165667B19E3779F9ull;
+            };
+
+            size_t i = 0;
+            for(; i + 32 <= size; i += 32)
+            {
+                std::uint64_t w[4];
+                std::memcpy(w, p + i, 32);
+                lane[0] = mix(lane[0], w[0]);
+                lane[1] = mix(lane[1], w[1]);
+                lane[2] = mix(lane[2], w[2]);
+                lane[3] = mix(lane[3], w[3]);
+            }
+
+            std::uint64_t tail[4] = {0, 0, 0, 0};
+            if(size > i)
+                std::memcpy(tail, p + i, size - i);
+            for(int k = 0; k < 4; ++k)
+                lane[k] = mix(lane[k], tail[k]);
+
+            std::uint64_t h = lane[0] ^ (lane[1] << 1) ^ (lane[2] << 2) ^ (lane[3] << 3);
+            h ^= h >> 33;
+            h *= 0xFF51AFD7ED558CCDull;
+            return h ^ (h >> 33);
+        }
+
+        // Whether every index of a list refers to one of the mesh's vertices
+        inline bool indices_in_range(const void *data, std::uint64_t count, std::uint32_t index_size, std::uint64_t vertex_count)
+        {
+            if(index_size == 2)
+            {
+                auto p = static_cast<const std::uint16_t *>(data);
+                return std::all_of(p, p + count, [=](std::uint16_t i) { return i < vertex_count; });
+            }
+
+            auto p = static_cast<const std::uint32_t *>(data);
+            return std::all_of(p, p + count, [=](std::uint32_t i) { return i < vertex_count; });
+        }
+
+        // One temp file per writer, so concurrent loads of a model never share a file
+        inline std::string mesh_cache_temp_path(const std::string &cache_path)
+        {
+            static std::atomic<std::uint32_t> counter(0);
+#ifdef WIN32
+            auto pid = std::uint64_t(GetCurrentProcessId());
+#else
+            auto pid = std::uint64_t(getpid());
+#endif
+            return cache_path + ".tmp." + std::to_string(pid) + "." + std::to_string(counter++);
+        }
+    }
+
+    // What a cache file is keyed by
+    struct Mesh_Cache_Source
+    {
+        std::string obj_path, mtl_path;
+        std::uint64_t obj_size, mtl_size;
+        std::int64_t obj_mtime, mtl_mtime;
+        std::uint32_t flags;
+        std::uint32_t options_key;
+        bool found;
+
+        Mesh_Cache_Source(const std::string &obj_path_, const std::string &mtl_path_, const Obj_Options &options):
+        obj_path(obj_path_), mtl_path(mtl_path_), obj_size(0), mtl_size(0), obj_mtime(0), mtl_mtime(0),
+        flags((options.indexed ? (options.optimize ? 3 : 1) : 0) | (options.compress_cache ? detail::MESH_CACHE_PACKED : 0)),
+        options_key(0), found(false)
+        {
+            if(options.indexed && !options.lod_ratios.empty())
+            {
+                auto h = detail::hash_bytes(reinterpret_cast<const char *>(options.lod_ratios.data()), options.lod_ratios.size() * sizeof(float), 0x6C6F64ull);
+                options_key = std::uint32_t(h) | 1;
+            }
+            if(options.indexed && options.meshlets)
+                options_key = std::uint32_t(detail::hash_bytes(nullptr, 0, 0x6D6C6574ull + options_key)) | 1;
+            if(options.generate_normals)
+            {
+                auto h = detail::hash_bytes(reinterpret_cast<const char *>(&options.crease_angle), sizeof(float), 0x6E6F726Dull + options_key);
+                options_key = std::uint32_t(h) | 1;
+            }
+
+            struct stat so, sm;
+            if(stat(obj_path.c_str(), &so) != 0 || stat(mtl_path.c_str(), &sm) != 0)
+                return;
+
+            obj_size = std::uint64_t(so.st_size);
+            mtl_size = std::uint64_t(sm.st_size);
+            obj_mtime = std::int64_t(so.st_mtime);
+            mtl_mtime = std::int64_t(sm.st_mtime);
+            found = true;
+        }
+
+        std::uint64_t content_hash() const
+        {
+            Mapped_File obj(obj_path), mtl(mtl_path);
+            auto h = detail::hash_bytes(obj.data(), obj.size(), 0x6B6E756F626A0001ull);
+            return detail::hash_bytes(mtl.data(), mtl.size(), h);
+        }
+    };
+
+    // Loads with different options keep separate caches
+    inline std::string mesh_cache_path(const Mesh_Cache_Source &source)
+    {
+        static const char *const SUFFIX[] = {".meshcache", ".indexed.meshcache", ".meshcache", ".optimized.meshcache"};
+        return source.obj_path + (source.flags & detail::MESH_CACHE_PACKED ? ".packed" : "") + SUFFIX[source.flags & 3];
+    }
+
+    // Read only view of a cache file
+    class Mesh_Cache
+    {
+        typedef std::unique_ptr<char[], Pool_Deleter> Block;
+
+        // Decoded streams of a packed mesh
+        struct Unpacked
+        {
+            Block vertices, indices;
+            std::vector<Block> lods;
+        };
+
+        Mapped_File file;
+        const detail::Mesh_Cache_Header *header;
+        const detail::Mesh_Cache_Entry *entries;
+        const detail::Mesh_Cache_Material *mats;
+        std::vector<Unpacked> unpacked;
+
+        bool in_file(std::uint64_t offset, std::uint64_t bytes) const
+        {
+            return offset <= file.size() && bytes <= file.size() - offset;
+        }
+
+        bool valid_string(const detail::Mesh_Cache_String &s) const
+        {
+            return s.offset <= header->strings_size && s.length <= header->strings_size - s.offset;
+        }
+
+        std::string string_at(const detail::Mesh_Cache_String &s) const
+        {
+            return std::string(file.data() + header->strings + s.offset, size_t(s.length));
+        }
+
+        const detail::Mesh_Cache_Lod &lod(size_t mesh, size_t level) const
+        {
+            return reinterpret_cast<const detail::Mesh_Cache_Lod *>(file.data() + entries[mesh].lod_table)[level];
+        }
+
+        // Packed streams may not claim more decoded bytes than they could hold
+        static bool plausible(std::uint64_t decoded, std::uint64_t stored)
+        {
+            return decoded / detail::MESH_CODEC_MAX_RATIO <= stored;
+        }
+
+        bool validate() const
+        {
+            const auto &h = *header;
+            if(h.file_size != file.size() || !in_file(h.strings, h.strings_size) ||
+               !in_file(h.mesh_table, std::uint64_t(h.mesh_count) * sizeof(detail::Mesh_Cache_Entry)) ||
+               !in_file(h.material_table, std::uint64_t(h.material_count) * sizeof(detail::Mesh_Cache_Material)) ||
+               h.mesh_table % alignof(detail::Mesh_Cache_Entry) || h.material_table % alignof(detail::Mesh_Cache_Material) ||
+               !valid_string(h.obj_path) || !valid_string(h.mtl_path))
+                return false;
+
+            for(std::uint32_t i = 0; i < h.mesh_count; ++i)
+            {
+                const auto &e = entries[i];
+                if(e.packed > 1 || (e.packed && !(h.flags & detail::MESH_CACHE_PACKED)))
+                    return false;
+
+                if(e.packed ? !in_file(e.vertex_offset, e.packed_vertex_bytes) || !in_file(e.index_offset, e.packed_index_bytes) ||
+                              !plausible(e.vertex_bytes, e.packed_vertex_bytes) ||
+                              (e.index_size && !plausible(e.index_count * e.index_size, e.packed_index_bytes))
+                            : !in_file(e.vertex_offset, e.vertex_bytes) || !in_file(e.index_offset, e.index_count * e.index_size) ||
+                              e.vertex_offset % 4 || e.index_offset % 4)
+                    return false;
+
+                if(!valid_string(e.material) || e.vertex_count > std::numeric_limits<std::uint64_t>::max() / 64 ||
+                   e.vertex_bytes != e.vertex_count * h.format_size ||
+                   (e.index_size != 0 && e.index_size != 2 && e.index_size != 4) ||
+                   e.index_count > std::numeric_limits<std::uint64_t>::max() / 4 ||
+                   !in_file(e.lod_table, std::uint64_t(e.lod_count) * sizeof(detail::Mesh_Cache_Lod)) ||
+                   e.lod_table % alignof(detail::Mesh_Cache_Lod) || (e.lod_count && !e.index_size) ||
+                   !in_file(e.meshlet_table, std::uint64_t(e.meshlet_count) * sizeof(Meshlet)) || e.meshlet_table % alignof(Meshlet))
+                    return false;
+
+                // packed lists are checked as they are decoded
+                if(!e.packed && e.index_size && !detail::indices_in_range(file.data() + e.index_offset, e.index_count, e.index_size, e.vertex_count))
+                    return false;
+
+                auto meshlets = reinterpret_cast<const Meshlet *>(file.data() + e.meshlet_table);
+                for(std::uint32_t l = 0; l < e.meshlet_count; ++l)
+                {
+                    if(meshlets[l].first_index > e.index_count || meshlets[l].index_count > e.index_count - meshlets[l].first_index)
+                        return false;
+                }
+
+                auto lods = reinterpret_cast<const detail::Mesh_Cache_Lod *>(file.data() + e.lod_table);
+                for(std::uint32_t l = 0; l < e.lod_count; ++l)
+                {
+                    if(lods[l].index_count > std::numeric_limits<std::uint64_t>::max() / 4)
+                        return false;
+                    if(e.packed ? !in_file(lods[l].index_offset, lods[l].packed_bytes) ||
+                                  !plausible(lods[l].index_count * e.index_size, lods[l].packed_bytes)
+                                : !in_file(lods[l].index_offset, lods[l].index_count * e.index_size) || lods[l].index_offset % 4 ||
+                                  !detail::indices_in_range(file.data() + lods[l].index_offset, lods[l].index_count, e.index_size, e.vertex_count))
+                        return false;
+                }
+            }
+
+            for(std::uint32_t i = 0; i < h.material_count; ++i)
+            {
+                const auto &m = mats[i];
+                if(!valid_string(m.name) || !valid_string(m.diffuse_texture) || !valid_string(m.ambient_texture))
+                    return false;
+            }
+
+            return true;
+        }
+
+        // Decodes the packed meshes, one task per stream so a model with a single large mesh
+        // still decodes its vertices and index lists side by side
+        bool unpack()
+        {
+            struct Job
+            {
+                size_t mesh;
+                int stream;     // -2 vertices, -1 indices, else a level of detail
+            };
+
+            std::vector<Job> jobs;
+            unpacked.clear();
+            unpacked.resize(header->mesh_count);
+            auto &pool = Buffer_Pool::shared();
+            for(size_t i = 0; i < header->mesh_count; ++i)
+            {
+                const auto &e = entries[i];
+                if(!e.packed)
+                    continue;
+
+                auto &u = unpacked[i];
+                u.vertices.reset(static_cast<char *>(pool.acquire(size_t(e.vertex_bytes))));
+                jobs.push_back(Job{i, -2});
+                if(e.index_size)
+                {
+                    u.indices.reset(static_cast<char *>(pool.acquire(size_t(e.index_count * e.index_size))));
+                    jobs.push_back(Job{i, -1});
+                }
+                for(std::uint32_t l = 0; l < e.lod_count; ++l)
+                {
+                    u.lods.emplace_back(static_cast<char *>(pool.acquire(size_t(lod(i, l).index_count * e.index_size))));
+                    jobs.push_back(Job{i, int(l)});
+                }
+            }
+
+            std::vector<char> ok(jobs.size(), 0);
+            parallel_for(jobs.size(), [&](size_t j)
+            {
+                const auto &e = entries[jobs[j].mesh];
+                auto &u = unpacked[jobs[j].mesh];
+                auto base = reinterpret_cast<const unsigned char *>(file.data());
+                if(jobs[j].stream == -2)
+                    ok[j] = unpack_mesh_vertices(ObjFormat(header->format), base + e.vertex_offset, size_t(e.packed_vertex_bytes),
+                                                 size_t(e.vertex_count), e.bounds_min, e.bounds_max, u.vertices.get());
+                else if(jobs[j].stream == -1)
+                    ok[j] = unpack_mesh_indices(base + e.index_offset, size_t(e.packed_index_bytes), size_t(e.index_count),
+                                                e.index_size, u.indices.get()) &&
+                            detail::indices_in_range(u.indices.get(), e.index_count, e.index_size, e.vertex_count);
+                else
+                {
+                    const auto &l = lod(jobs[j].mesh, size_t(jobs[j].stream));
+                    ok[j] = unpack_mesh_indices(base + l.index_offset, size_t(l.packed_bytes), size_t(l.index_count),
+                                                e.index_size, u.lods[jobs[j].stream].get()) &&
+                            detail::indices_in_range(u.lods[jobs[j].stream].get(), l.index_count, e.index_size, e.vertex_count);
+                }
+            });
+
+            return std::find(ok.begin(), ok.end(), 0) == ok.end();
+        }
+
+    public:
+        Mesh_Cache():file(), header(nullptr), entries(nullptr), mats(nullptr) {}
+
+        // False when the cache is missing, stale, from another version or damaged
+        bool open(const std::string &cache_path, const Mesh_Cache_Source &source)
+        {
+            header = nullptr;
+            unpacked.clear();
+            if(!source.found)
+                return false;
+
+            try
+            {
+                file.open(cache_path);
+            }catch(std::exception &)
+            {
+                return false;
+            }
+
+            if(file.size() < sizeof(detail::Mesh_Cache_Header))
+                return false;
+
+            auto h = reinterpret_cast<const detail::Mesh_Cache_Header *>(file.data());
+            if(std::memcmp(h->magic, detail::MESH_CACHE_MAGIC, sizeof(h->magic)) != 0 || h->version != MESH_CACHE_VERSION ||
+               h->byte_order != detail::MESH_CACHE_BYTE_ORDER || h->flags != source.flags || h->options_key != source.options_key ||
+               h->obj_size != source.obj_size || h->mtl_size != source.mtl_size ||
+               h->obj_mtime != source.obj_mtime || h->mtl_mtime != source.mtl_mtime)
+                return false;
+
+            header = h;
+            entries = reinterpret_cast<const detail::Mesh_Cache_Entry *>(file.data() + h->mesh_table);
+            mats = reinterpret_cast<const detail::Mesh_Cache_Material *>(file.data() + h->material_table);
+
+            if(!validate() || string_at(h->obj_path) != source.obj_path || string_at(h->mtl_path) != source.mtl_path ||
+               h->content_hash != source.content_hash())
+            {
+                header = nullptr;
+                return false;
+            }
+
+            if(h->flags & detail::MESH_CACHE_PACKED)
+            {
+                bool unpacked_all = false;
+                try
+                {
+                    unpacked_all = unpack();
+                }catch(std::exception &)
+                {
+                }
+                if(!unpacked_all)
+                {
+                    unpacked.clear();
+                    header = nullptr;
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        bool is_open() const { return header != nullptr; }
+
+        ObjFormat format() const { return ObjFormat(header->format); }
+        unsigned int format_size() const { return header->format_size; }
+        size_t mesh_count() const { return header->mesh_count; }
+
+        std::string material(size_t mesh) const { return string_at(entries[mesh].material); }
+        size_t vertex_count(size_t mesh) const { return size_t(entries[mesh].vertex_count); }
+        size_t index_count(size_t mesh) const { return size_t(entries[mesh].index_count); }
+        size_t index_size(size_t mesh) const { return entries[mesh].index_size; }
+
+        // Planar block: positions, then texture coordinates, then normals. Blocks of packed
+        // caches live as long as the Mesh_Cache.
+        const void *vertex_data(size_t mesh) const
+        {
+            return entries[mesh].packed ? unpacked[mesh].vertices.get() : file.data() + entries[mesh].vertex_offset;
+        }
+        size_t vertex_bytes(size_t mesh) const { return size_t(entries[mesh].vertex_bytes); }
+        const void *index_data(size_t mesh) const
+        {
+            return entries[mesh].packed ? unpacked[mesh].indices.get() : file.data() + entries[mesh].index_offset;
+        }
+        size_t index_bytes(size_t mesh) const { return index_count(mesh) * index_size(mesh); }
+
+        // Levels of detail, finest first, with index_size(mesh) byte indices
+        size_t lod_count(size_t mesh) const { return entries[mesh].lod_count; }
+        size_t lod_index_count(size_t mesh, size_t level) const { return size_t(lod(mesh, level).index_count); }
+        const void *lod_index_data(size_t mesh, size_t level) const
+        {
+            return entries[mesh].packed ? unpacked[mesh].lods[level].get() : file.data() + lod(mesh, level).index_offset;
+        }
+        float lod_error(size_t mesh, size_t level) const { return lod(mesh, level).error; }
+
+        size_t meshlet_count(size_t mesh) const { return entries[mesh].meshlet_count; }
+        const Meshlet *meshlets(size_t mesh) const { return reinterpret_cast<const Meshlet *>(file.data() + entries[mesh].meshlet_table); }
+
+        void bounds(size_t mesh, knu::math::Vector3f &lo, knu::math::Vector3f &hi) const
+        {
+            const auto &e = entries[mesh];
+            lo = knu::math::Vector3f(e.bounds_min[0], e.bounds_min[1], e.bounds_min[2]);
+            hi = knu::math::Vector3f(e.bounds_max[0], e.bounds_max[1], e.bounds_max[2]);
+        }
+
+        std::unordered_map<std::string, Obj_Material> materials() const
+        {
+            std::unordered_map<std::string, Obj_Material> result;
+            for(std::uint32_t i = 0; i < header->material_count; ++i)
+            {
+                const auto &c = mats[i];
+                Obj_Material m;
+                m.mat_name = string_at(c.name);
+                m.mat_ambient_color = knu::math::Vector4f(c.ambient[0], c.ambient[1], c.ambient[2], c.ambient[3]);
+                m.mat_diffuse_color = knu::math::Vector4f(c.diffuse[0], c.diffuse[1], c.diffuse[2], c.diffuse[3]);
+                m.mat_specular_color = knu::math::Vector4f(c.specular[0], c.specular[1], c.specular[2], c.specular[3]);
+                m.mat_specular_exponent = c.specular_exponent;
+                m.mat_opacity = c.opacity;
+                m.mat_diffuse_texture_name = string_at(c.diffuse_texture);
+                m.mat_ambient_texture_name = string_at(c.ambient_texture);
+                result[m.mat_name] = m;
+            }
+            return result;
+        }
+
+        // Copies the cached meshes into o
+        void load(Obj &o) const
+        {
+            o.model_format = format();
+            o.model_format_size = format_size();
+            o.meshes.clear();
+            o.meshes.resize(mesh_count());
+            o.str_mat_map = materials();
+            o.bvh.reset();
+
+            bool has_t = o.model_format == ObjFormat::Ver_Tex || o.model_format == ObjFormat::Ver_Tex_Nor;
+            bool has_n = o.model_format == ObjFormat::Ver_Nor || o.model_format == ObjFormat::Ver_Tex_Nor;
+
+            for(size_t i = 0; i < mesh_count(); ++i)
+            {
+                auto &m = o.meshes[i];
+                size_t count = vertex_count(i);
+                auto p = static_cast<const char *>(vertex_data(i));
+
+                m.material = material(i);
+                m.v.resize(count);
+                std::memcpy(static_cast<void *>(m.v.data()), p, count * sizeof(knu::math::Vector3f));
+                p += count * sizeof(knu::math::Vector3f);
+
+                if(has_t)
+                {
+                    m.t.resize(count);
+                    std::memcpy(static_cast<void *>(m.t.data()), p, count * sizeof(knu::math::Vector2f));
+                    p += count * sizeof(knu::math::Vector2f);
+                }
+
+                if(has_n)
+                {
+                    m.n.resize(count);
+                    std::memcpy(static_cast<void *>(m.n.data()), p, count * sizeof(knu::math::Vector3f));
+                }
+
+                if(index_size(i) == 2)
+                {
+                    m.indices16.resize(index_count(i));
+                    std::memcpy(m.indices16.data(), index_data(i), index_bytes(i));
+                }
+                else if(index_size(i) == 4)
+                {
+                    m.indices32.resize(index_count(i));
+                    std::memcpy(m.indices32.data(), index_data(i), index_bytes(i));
+                }
+
+                m.meshlets.assign(meshlets(i), meshlets(i) + meshlet_count(i));
+
+                m.lods.resize(lod_count(i));
+                for(size_t l = 0; l < m.lods.size(); ++l)
+                {
+                    auto &lod = m.lods[l];
+                    size_t count = lod_index_count(i, l);
+                    lod.error = lod_error(i, l);
+                    lod.indices.resize(count);
+                    if(index_size(i) == 4)
+                        std::memcpy(lod.indices.data(), lod_index_data(i, l), count * 4);
+                    else
+                    {
+                        auto p16 = static_cast<const std::uint16_t *>(lod_index_data(i, l));
+                        std::copy(p16, p16 + count, lod.indices.begin());
+                    }
+                }
+            }
+        }
+    };
+
+    // Writes o to cache_path, replacing any older cache. Returns false when the file could
+    // not be written; a missing cache only costs the next start a parse.
+    inline bool write_mesh_cache(const std::string &cache_path, const Mesh_Cache_Source &source, const Obj &o)
+    {
+        if(!source.found)
+            return false;
+
+        using namespace detail;
+
+        std::string strings;
+        auto add_string = [&strings](const std::string &s)
+        {
+            Mesh_Cache_String r = {strings.size(), s.size()};
+            strings += s;
+            return r;
+        };
+
+        auto align = [](std::uint64_t offset) { return (offset + 15) & ~std::uint64_t(15); };
+
+        Mesh_Cache_Header h;
+        std::memset(&h, 0, sizeof(h));
+        std::memcpy(h.magic, MESH_CACHE_MAGIC, sizeof(h.magic));
+        h.version = MESH_CACHE_VERSION;
+        h.byte_order = MESH_CACHE_BYTE_ORDER;
+        h.flags = source.flags;
+        h.options_key = source.options_key;
+        h.format = std::uint32_t(o.model_format);
+        h.format_size = o.model_format_size;
+        h.mesh_count = std::uint32_t(o.meshes.size());
+        h.material_count = std::uint32_t(o.str_mat_map.size());
+        h.obj_size = source.obj_size;
+        h.mtl_size = source.mtl_size;
+        h.obj_mtime = source.obj_mtime;
+        h.mtl_mtime = source.mtl_mtime;
+        h.content_hash = source.content_hash();
+        h.obj_path = add_string(source.obj_path);
+        h.mtl_path = add_string(source.mtl_path);
+
+        std::vector<Mesh_Cache_Entry> entries(o.meshes.size());
+        std::vector<std::vector<Mesh_Cache_Lod>> lod_tables(o.meshes.size());
+        std::vector<Mesh_Cache_Material> mats;
+
+        for(const auto &kv : o.str_mat_map)
+        {
+            const auto &m = kv.second;
+            Mesh_Cache_Material c;
+            std::memset(&c, 0, sizeof(c));
+            c.name = add_string(kv.first);
+            c.diffuse_texture = add_string(m.mat_diffuse_texture_name);
+            c.ambient_texture = add_string(m.mat_ambient_texture_name);
+            const knu::math::Vector4f *colors[3] = {&m.mat_ambient_color, &m.mat_diffuse_color, &m.mat_specular_color};
+            float *dst[3] = {c.ambient, c.diffuse, c.specular};
+            for(int k = 0; k < 3; ++k)
+            {
+                dst[k][0] = colors[k]->x;
+                dst[k][1] = colors[k]->y;
+                dst[k][2] = colors[k]->z;
+                dst[k][3] = colors[k]->w;
+            }
+            c.specular_exponent = m.mat_specular_exponent;
+            c.opacity = m.mat_opacity;
+            mats.push_back(c);
+        }
+
+        // The mesh's planar vertices, with its bounds taken from the position block at the front
+        auto vertex_block = [&o](size_t i, Mesh_Cache_Entry &e, std::vector<char> &block)
+        {
+            auto layout = Vertex_Layout::planar(o.model_format, size_t(e.vertex_count));
+            block.resize(layout.size);
+            o.write_mesh_vertices(i, block.data(), layout);
+
+            for(int k = 0; k < 3; ++k)
+            {
+                e.bounds_min[k] = e.vertex_count ? std::numeric_limits<float>::max() : 0.0f;
+                e.bounds_max[k] = e.vertex_count ? -std::numeric_limits<float>::max() : 0.0f;
+            }
+            for(size_t v = 0; v < e.vertex_count; ++v)
+            {
+                float c[3];
+                std::memcpy(c, block.data() + v * sizeof(c), sizeof(c));
+                for(int k = 0; k < 3; ++k)
+                {
+                    e.bounds_min[k] = std::min(e.bounds_min[k], c[k]);
+                    e.bounds_max[k] = std::max(e.bounds_max[k], c[k]);
+                }
+            }
+        };
+
+        // Packed streams are encoded before the layout, which depends on their sizes. Meshes
+        // with positions that cannot go on a grid are stored as they are.
+        struct Packed_Mesh
+        {
+            std::vector<unsigned char> vertices, indices;
+            std::vector<std::vector<unsigned char>> lods;
+        };
+        std::vector<Packed_Mesh> packed(o.meshes.size());
+        std::vector<char> block;
+
+        // header, mesh table, material table, mesh data, strings
+        std::uint64_t offset = align(sizeof(h));
+        h.mesh_table = offset;
+        offset = align(offset + entries.size() * sizeof(Mesh_Cache_Entry));
+        h.material_table = offset;
+        offset = align(offset + mats.size() * sizeof(Mesh_Cache_Material));
+
+        for(size_t i = 0; i < o.meshes.size(); ++i)
+        {
+            const auto &m = o.meshes[i];
+            auto &e = entries[i];
+            std::memset(&e, 0, sizeof(e));
+            e.material = add_string(m.material);
+            e.vertex_count = m.vertex_count();
+            e.vertex_bytes = e.vertex_count * o.model_format_size;
+            e.index_count = m.index_count();
+            e.index_size = m.indexed() ? (m.indices16.empty() ? 4 : 2) : 0;
+            e.lod_count = e.index_size ? std::uint32_t(m.lods.size()) : 0;
+
+            if(source.flags & MESH_CACHE_PACKED)
+            {
+                try
+                {
+                    vertex_block(i, e, block);
+                }catch(std::exception &)
+                {
+                    return false;
+                }
+
+                if(mesh_vertices_packable(e.bounds_min, e.bounds_max))
+                {
+                    auto &p = packed[i];
+                    e.packed = 1;
+                    p.vertices = pack_mesh_vertices(o.model_format, block.data(), size_t(e.vertex_count), e.bounds_min, e.bounds_max);
+                    e.packed_vertex_bytes = p.vertices.size();
+                    if(e.index_size == 2)
+                        p.indices = pack_mesh_indices(m.indices16.data(), m.indices16.size());
+                    else if(e.index_size == 4)
+                        p.indices = pack_mesh_indices(m.indices32.data(), m.indices32.size());
+                    e.packed_index_bytes = p.indices.size();
+                    for(std::uint32_t l = 0; l < e.lod_count; ++l)
+                        p.lods.push_back(pack_mesh_indices(m.lods[l].indices.data(), m.lods[l].indices.size()));
+                }
+            }
+
+            e.vertex_offset = offset;
+            offset = align(offset + (e.packed ? e.packed_vertex_bytes : e.vertex_bytes));
+            e.index_offset = offset;
+            offset = align(offset + (e.packed ? e.packed_index_bytes : e.index_count * e.index_size));
+
+            e.lod_table = offset;
+            offset = align(offset + e.lod_count * sizeof(Mesh_Cache_Lod));
+            lod_tables[i].resize(e.lod_count);
+            for(std::uint32_t l = 0; l < e.lod_count; ++l)
+            {
+                auto &lod = lod_tables[i][l];
+                std::memset(&lod, 0, sizeof(lod));
+                lod.index_count = m.lods[l].indices.size();
+                lod.error = m.lods[l].error;
+                lod.index_offset = offset;
+                lod.packed_bytes = e.packed ? packed[i].lods[l].size() : 0;
+                offset = align(offset + (e.packed ? lod.packed_bytes : lod.index_count * e.index_size));
+            }
+
+            e.meshlet_count = e.index_size ? std::uint32_t(m.meshlets.size()) : 0;
+            e.meshlet_table = offset;
+            offset = align(offset + e.meshlet_count * sizeof(Meshlet));
+        }
+
+        h.strings = offset;
+        h.strings_size = strings.size();
+        h.file_size = offset + strings.size();
+
+        // written beside the target and renamed over it, so readers never see half a file
+        auto temp_path = detail::mesh_cache_temp_path(cache_path);
+        {
+            std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+            if(!out)
+                return false;
+
+            std::uint64_t written = 0;
+            auto pad_to = [&](std::uint64_t target)
+            {
+                static const char zeros[16] = {};
+                out.write(zeros, std::streamsize(target - written));
+                written = target;
+            };
+            auto put = [&](const void *p, std::uint64_t bytes)
+            {
+                if(bytes)
+                    out.write(static_cast<const char *>(p), std::streamsize(bytes));
+                written += bytes;
+            };
+
+            put(&h, sizeof(h));
+            pad_to(h.mesh_table);
+            put(entries.data(), entries.size() * sizeof(Mesh_Cache_Entry));
+            pad_to(h.material_table);
+            put(mats.data(), mats.size() * sizeof(Mesh_Cache_Material));
+
+            for(size_t i = 0; i < o.meshes.size(); ++i)
+            {
+                const auto &m = o.meshes[i];
+                auto &e = entries[i];
+                const auto &p = packed[i];
+                
+                if(e.packed)
+                {
+                    pad_to(e.vertex_offset);
+                    put(p.vertices.data(), p.vertices.size());
+                    pad_to(e.index_offset);
+                    put(p.indices.data(), p.indices.size());
+                }
+                else
+                {
+                    try
+                    {
+                        vertex_block(i, e, block);
+                    }catch(std::exception &)
+                    {
+                        out.close();
+                        std::remove(temp_path.c_str());
+                        return false;
+                    }
+                    
+                    pad_to(e.vertex_offset);
+                    put(block.data(), block.size());
+                    pad_to(e.index_offset);
+                    if(e.index_size == 2)
+                        put(m.indices16.data(), m.indices16.size() * 2);
+                    else if(e.index_size == 4)
+                        put(m.indices32.data(), m.indices32.size() * 4);
+                }
+
+                pad_to(e.lod_table);
+                put(lod_tables[i].data(), lod_tables[i].size() * sizeof(Mesh_Cache_Lod));
+                for(std::uint32_t l = 0; l < e.lod_count; ++l)
+                {
+                    const auto &indices = m.lods[l].indices;
+                    pad_to(lod_tables[i][l].index_offset);
+                    if(e.packed)
+                        put(p.lods[l].data(), p.lods[l].size());
+                    else if(e.index_size == 4)
+                        put(indices.data(), indices.size() * 4);
+                    else
+                    {
+                        std::vector<std::uint16_t> narrow(indices.begin(), indices.end());
+                        put(narrow.data(), narrow.size() * 2);
+                    }
+                }
+
+                pad_to(e.meshlet_table);
+                put(m.meshlets.data(), e.meshlet_count * sizeof(Meshlet));
+            }
+
+            pad_to(h.strings);
+            put(strings.data(), strings.size());
+
+            // the bounds are known now
+            out.seekp(std::streamoff(h.mesh_table));
+            out.write(reinterpret_cast<const char *>(entries.data()), std::streamsize(entries.size() * sizeof(Mesh_Cache_Entry)));
+
+            if(!out)
+            {
+                out.close();
+                std::remove(temp_path.c_str());
+                return false;
+            }
+        }
+
+        // rename replaces the target in one step on POSIX; Windows will not rename over a file
+#ifdef WIN32
+        std::remove(cache_path.c_str());
+#endif
+        if(std::rename(temp_path.c_str(), cache_path.c_str()) != 0)
+        {
+            std::remove(temp_path.c_str());
+            return false;
+        }
+
+        return true;
+    }
+}
+
+#endif  // KNU_MESH_CACHE
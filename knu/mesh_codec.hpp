@@ -0,0 +1,644 @@
+#ifndef KNU_MESH_CODEC
+#define KNU_MESH_CODEC
+
+// Compact encoding of mesh data for the binary cache (mesh_cache.hpp):
+//  - positions: 16 bit integers on a grid spanning the mesh's bounds, so the error is at most
+//    half a step, 1/131070 of the extent on each axis,
+//  - normals: octahedral coordinates (Meyer et al. 2010) as two 16 bit integers,
+//  - texture coordinates: exact,
+//  - indices: difference to the previous index, zigzagged into LEB128 varints.
+// Every vertex component is stored as the zigzagged difference to the previous vertex, split
+// into byte planes, so the slowly changing high bytes end up next to each other. Both streams
+// then go through a byte oriented LZ77 codec in the spirit of LZ4 (64 KB window, no entropy
+// stage). Decoding is built for speed: long copies move 16 bytes at a time and the planes are
+// merged, summed up and converted 4 or 8 values at a time with SSE2. Decoders return false on
+// damaged input and never read or write outside the given ranges.
+
+#include <knu/obj.hpp>
+#include <knu/buffer_pool.hpp>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define KNU_MESH_CODEC_SSE2
+#endif
+
+namespace knu
+{
+    namespace detail
+    {
+        const int LZ_MIN_MATCH = 4;
+        const size_t LZ_WINDOW = 65535;
+        const int LZ_HASH_BITS = 14;
+
+        // Upper bound of decoded bytes per stored byte, for sanity checks on sizes read from disk
+        const size_t MESH_CODEC_MAX_RATIO = 2048;
+
+        inline std::uint32_t read32(const unsigned char *p)
+        {
+            std::uint32_t v;
+            std::memcpy(&v, p, 4);
+            return v;
+        }
+
+        inline void copy16(unsigned char *dst, const unsigned char *src)
+        {
+#ifdef KNU_MESH_CODEC_SSE2
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), _mm_loadu_si128(reinterpret_cast<const __m128i *>(src)));
+#else
+            std::memcpy(dst, src, 16);
+#endif
+        }
+
+        // Sequences of a token (literal count << 4 | match length - 4, 15 meaning more follows in
+        // bytes of up to 255), the literals, a 16 bit offset and the rest of the match length.
+        // The last sequence has literals only.
+        inline void lz_compress(const unsigned char *src, size_t size, std::vector<unsigned char> &out)
+        {
+            std::vector<std::uint32_t> table(size_t(1) << LZ_HASH_BITS, 0);
+            auto hash = [](std::uint32_t v) { return (v * 2654435761u) >> (32 - LZ_HASH_BITS); };
+            auto put_length = [&out](size_t length)
+            {
+                for(; length >= 255; length -= 255)
+                    out.push_back(255);
+                out.push_back((unsigned char)length);
+            };
+            auto put_literals = [&](size_t from, size_t to, size_t match)
+            {
+                size_t literals = to - from;
+                out.push_back((unsigned char)((std::min<size_t>(literals, 15) << 4) | std::min<size_t>(match, 15)));
+                if(literals >= 15)
+                    put_length(literals - 15);
+                out.insert(out.end(), src + from, src + to);
+            };
+
+            size_t anchor = 0, i = 0;
+            while(i + LZ_MIN_MATCH <= size)
+            {
+                std::uint32_t v = read32(src + i);
+                auto &slot = table[hash(v)];
+                size_t candidate = slot;
+                slot = std::uint32_t(i);
+
+                if(candidate >= i || i - candidate > LZ_WINDOW || read32(src + candidate) != v)
+                {
+                    // steps grow over data that does not compress
+                    i += 1 + ((i - anchor) >> 6);
+                    continue;
+                }
+
+                size_t length = LZ_MIN_MATCH;
+                while(i + length + 8 <= size)
+                {
+                    std::uint64_t a, b;
+                    std::memcpy(&a, src + candidate + length, 8);
+                    std::memcpy(&b, src + i + length, 8);
+                    if(a != b)
+                        break;
+                    length += 8;
+                }
+                while(i + length < size && src[candidate + length] == src[i + length])
+                    ++length;
+                while(i > anchor && candidate > 0 && src[i - 1] == src[candidate - 1])
+                {
+                    --i;
+                    --candidate;
+                    ++length;
+                }
+
+                size_t offset = i - candidate;
+                put_literals(anchor, i, length - LZ_MIN_MATCH);
+                out.push_back((unsigned char)(offset & 255));
+                out.push_back((unsigned char)(offset >> 8));
+                if(length - LZ_MIN_MATCH >= 15)
+                    put_length(length - LZ_MIN_MATCH - 15);
+
+                i += length;
+                anchor = i;
+                if(i + LZ_MIN_MATCH <= size)
+                    table[hash(read32(src + i - 2))] = std::uint32_t(i - 2);
+            }
+
+            put_literals(anchor, size, 0);
+        }
+
+        inline bool lz_decompress(const unsigned char *src, size_t size, unsigned char *dst, size_t dst_size)
+        {
+            const unsigned char *ip = src, *iend = src + size;
+            unsigned char *op = dst, *oend = dst + dst_size;
+
+            auto get_length = [&](size_t &length)
+            {
+                unsigned char b;
+                do
+                {
+                    if(ip == iend)
+                        return false;
+                    b = *ip++;
+                    length += b;
+                }while(b == 255);
+                return true;
+            };
+
+            while(true)
+            {
+                if(ip == iend)
+                    return false;
+                unsigned int token = *ip++;
+
+                size_t literals = token >> 4;
+                if(literals == 15 && !get_length(literals))
+                    return false;
+                if(literals > size_t(iend - ip) || literals > size_t(oend - op))
+                    return false;
+                if(literals <= 16 && iend - ip >= 16 && oend - op >= 16)
+                    copy16(op, ip);
+                else
+                    std::memcpy(op, ip, literals);
+                ip += literals;
+                op += literals;
+
+                if(ip == iend)
+                    break;
+
+                if(iend - ip < 2)
+                    return false;
+                size_t offset = size_t(ip[0]) | size_t(ip[1]) << 8;
+                ip += 2;
+                size_t length = token & 15;
+                if(length == 15 && !get_length(length))
+                    return false;
+                length += LZ_MIN_MATCH;
+                if(!offset || offset > size_t(op - dst) || length > size_t(oend - op))
+                    return false;
+
+                const unsigned char *match = op - offset;
+                if(offset >= 16 && size_t(oend - op) >= length + 15)
+                {
+                    // may run up to 15 bytes past the match, into space written later anyway
+                    for(size_t k = 0; k < length; k += 16)
+                        copy16(op + k, match + k);
+                }
+                else if(offset == 1)
+                    std::memset(op, *match, length);
+                else
+                {
+                    // the bytes from match repeat every offset bytes; copy them in doubling pieces
+                    for(size_t done = 0, period = offset; done < length; )
+                    {
+                        size_t n = std::min(period, length - done);
+                        std::memcpy(op + done, match, n);
+                        done += n;
+                        period += n;
+                    }
+                }
+                op += length;
+            }
+
+            return op == oend;
+        }
+
+        // Blocks start with their decoded size
+        inline std::vector<unsigned char> pack_bytes(const unsigned char *src, size_t size)
+        {
+            std::vector<unsigned char> out(sizeof(std::uint64_t));
+            std::uint64_t raw = size;
+            std::memcpy(out.data(), &raw, sizeof(raw));
+            out.reserve(sizeof(raw) + size + size / 255 + 16);
+            lz_compress(src, size, out);
+            return out;
+        }
+
+        inline bool packed_size(const unsigned char *src, size_t size, size_t &raw)
+        {
+            std::uint64_t r;
+            if(size < sizeof(r))
+                return false;
+            std::memcpy(&r, src, sizeof(r));
+            if(r / MESH_CODEC_MAX_RATIO > size)
+                return false;
+            raw = size_t(r);
+            return true;
+        }
+
+        inline bool unpack_bytes(const unsigned char *src, size_t size, unsigned char *dst, size_t dst_size)
+        {
+            size_t raw;
+            return packed_size(src, size, raw) && raw == dst_size &&
+                   lz_decompress(src + sizeof(std::uint64_t), size - sizeof(std::uint64_t), dst, dst_size);
+        }
+
+        template<typename Word>
+        Word zigzag(Word d)
+        {
+            const int bits = sizeof(Word) * 8;
+            return Word(Word(d << 1) ^ Word(0 - Word(d >> (bits - 1))));
+        }
+
+        template<typename Word>
+        Word unzigzag(Word z)
+        {
+            return Word(Word(z >> 1) ^ Word(0 - Word(z & 1)));
+        }
+
+        // Differences to the previous value, zigzagged and split into sizeof(Word) byte planes
+        template<typename Word>
+        unsigned char *put_channel(const Word *values, size_t count, unsigned char *out)
+        {
+            Word prev = 0;
+            for(size_t i = 0; i < count; ++i)
+            {
+                Word z = zigzag(Word(values[i] - prev));
+                prev = values[i];
+                for(size_t p = 0; p < sizeof(Word); ++p)
+                    out[p * count + i] = (unsigned char)(z >> (8 * p));
+            }
+            return out + sizeof(Word) * count;
+        }
+
+        // Values [first, first + n) of a 16 bit channel; prev carries the running sum across calls
+        inline void get_channel16(const unsigned char *planes, size_t count, size_t first, size_t n, std::uint16_t &prev, std::uint16_t *out)
+        {
+            const unsigned char *lo = planes + first, *hi = planes + count + first;
+            size_t i = 0;
+#ifdef KNU_MESH_CODEC_SSE2
+            const __m128i one = _mm_set1_epi16(1), zero = _mm_setzero_si128();
+            __m128i carry = _mm_set1_epi16(short(prev));
+            for(; i + 8 <= n; i += 8)
+            {
+                __m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(lo + i)),
+                                              _mm_loadl_epi64(reinterpret_cast<const __m128i *>(hi + i)));
+                v = _mm_xor_si128(_mm_srli_epi16(v, 1), _mm_sub_epi16(zero, _mm_and_si128(v, one)));
+                v = _mm_add_epi16(v, _mm_slli_si128(v, 2));
+                v = _mm_add_epi16(v, _mm_slli_si128(v, 4));
+                v = _mm_add_epi16(v, _mm_slli_si128(v, 8));
+                v = _mm_add_epi16(v, carry);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), v);
+                carry = _mm_shufflehi_epi16(v, 0xFF);
+                carry = _mm_unpackhi_epi64(carry, carry);
+            }
+            if(i)
+                prev = out[i - 1];
+#endif
+            for(; i < n; ++i)
+            {
+                prev = std::uint16_t(prev + unzigzag(std::uint16_t(lo[i] | hi[i] << 8)));
+                out[i] = prev;
+            }
+        }
+
+        inline void get_channel32(const unsigned char *planes, size_t count, size_t first, size_t n, std::uint32_t &prev, std::uint32_t *out)
+        {
+            const unsigned char *p0 = planes + first, *p1 = p0 + count, *p2 = p1 + count, *p3 = p2 + count;
+            size_t i = 0;
+#ifdef KNU_MESH_CODEC_SSE2
+            const __m128i one = _mm_set1_epi32(1), zero = _mm_setzero_si128();
+            __m128i carry = _mm_set1_epi32(int(prev));
+            for(; i + 8 <= n; i += 8)
+            {
+                __m128i b01 = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(p0 + i)),
+                                                _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p1 + i)));
+                __m128i b23 = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(p2 + i)),
+                                                _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p3 + i)));
+                __m128i halves[2] = {_mm_unpacklo_epi16(b01, b23), _mm_unpackhi_epi16(b01, b23)};
+                for(int h = 0; h < 2; ++h)
+                {
+                    __m128i v = halves[h];
+                    v = _mm_xor_si128(_mm_srli_epi32(v, 1), _mm_sub_epi32(zero, _mm_and_si128(v, one)));
+                    v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+                    v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+                    v = _mm_add_epi32(v, carry);
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i + 4 * h), v);
+                    carry = _mm_shuffle_epi32(v, 0xFF);
+                }
+            }
+            if(i)
+                prev = out[i - 1];
+#endif
+            for(; i < n; ++i)
+            {
+                prev += unzigzag(std::uint32_t(p0[i] | p1[i] << 8 | p2[i] << 16 | std::uint32_t(p3[i]) << 24));
+                out[i] = prev;
+            }
+        }
+
+#ifdef KNU_MESH_CODEC_SSE2
+        // x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3
+        inline void store_xyz4(float *out, __m128 x, __m128 y, __m128 z)
+        {
+            __m128 xy_lo = _mm_unpacklo_ps(x, y), xy_hi = _mm_unpackhi_ps(x, y);
+            __m128 yz_lo = _mm_unpacklo_ps(y, z), yz_hi = _mm_unpackhi_ps(y, z);
+            __m128 zx_lo = _mm_unpacklo_ps(z, x), zx_hi = _mm_unpackhi_ps(z, x);
+            _mm_storeu_ps(out, _mm_shuffle_ps(xy_lo, zx_lo, _MM_SHUFFLE(3, 0, 1, 0)));
+            _mm_storeu_ps(out + 4, _mm_shuffle_ps(yz_lo, xy_hi, _MM_SHUFFLE(1, 0, 3, 2)));
+            _mm_storeu_ps(out + 8, _mm_shuffle_ps(zx_hi, yz_hi, _MM_SHUFFLE(3, 2, 3, 0)));
+        }
+#endif
+
+        inline void octahedral_encode(const knu::math::Vector3f &n, std::int16_t &u, std::int16_t &v)
+        {
+            float l1 = std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z);
+            if(!(l1 > 0.0f) || !std::isfinite(l1))
+            {
+                u = v = 0;
+                return;
+            }
+
+            float x = n.x / l1, y = n.y / l1;
+            if(n.z < 0.0f)
+            {
+                float fx = (1.0f - std::fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+                float fy = (1.0f - std::fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+                x = fx;
+                y = fy;
+            }
+            u = std::int16_t(std::lround(std::max(-1.0f, std::min(1.0f, x)) * 32767.0f));
+            v = std::int16_t(std::lround(std::max(-1.0f, std::min(1.0f, y)) * 32767.0f));
+        }
+
+        inline void octahedral_decode(std::int16_t u, std::int16_t v, float *out)
+        {
+            float x = float(u) * (1.0f / 32767.0f), y = float(v) * (1.0f / 32767.0f);
+            float z = 1.0f - std::fabs(x) - std::fabs(y);
+            float t = std::max(-z, 0.0f);
+            x += x >= 0.0f ? -t : t;
+            y += y >= 0.0f ? -t : t;
+            float inv = 1.0f / std::sqrt(x * x + y * y + z * z);
+            out[0] = x * inv;
+            out[1] = y * inv;
+            out[2] = z * inv;
+        }
+
+        inline bool quantizable(const float lo[3], const float hi[3])
+        {
+            for(int k = 0; k < 3; ++k)
+                if(!std::isfinite(lo[k]) || !std::isfinite(hi[k]) || !std::isfinite(hi[k] - lo[k]) || hi[k] < lo[k])
+                    return false;
+            return true;
+        }
+
+        inline size_t vertex_stream_size(ObjFormat format, size_t count)
+        {
+            bool has_t = format == ObjFormat::Ver_Tex || format == ObjFormat::Ver_Tex_Nor;
+            bool has_n = format == ObjFormat::Ver_Nor || format == ObjFormat::Ver_Tex_Nor;
+            return count * (6 + (has_t ? 8 : 0) + (has_n ? 4 : 0));
+        }
+    }
+
+    // Whether positions within these bounds can be put on the grid; false for non finite values
+    inline bool mesh_vertices_packable(const float lo[3], const float hi[3])
+    {
+        return detail::quantizable(lo, hi);
+    }
+
+    // count vertices in the planar layout of the cache (positions, texture coordinates,
+    // normals), with every position inside [lo, hi]
+    inline std::vector<unsigned char> pack_mesh_vertices(ObjFormat format, const void *planar, size_t count, const float lo[3], const float hi[3])
+    {
+        using namespace detail;
+
+        bool has_t = format == ObjFormat::Ver_Tex || format == ObjFormat::Ver_Tex_Nor;
+        bool has_n = format == ObjFormat::Ver_Nor || format == ObjFormat::Ver_Tex_Nor;
+        auto in = static_cast<const float *>(planar);
+
+        std::vector<unsigned char> raw(vertex_stream_size(format, count));
+        unsigned char *p = raw.data();
+        std::vector<std::uint16_t> q16(count);
+        std::vector<std::uint32_t> q32(count);
+
+        for(int k = 0; k < 3; ++k)
+        {
+            float scale = (hi[k] - lo[k]) / 65535.0f;
+            float inv = scale > 0.0f ? 1.0f / scale : 0.0f;
+            for(size_t i = 0; i < count; ++i)
+            {
+                float q = std::floor((in[3 * i + k] - lo[k]) * inv + 0.5f);
+                q16[i] = std::uint16_t(std::max(0.0f, std::min(65535.0f, q)));
+            }
+            p = put_channel(q16.data(), count, p);
+        }
+        in += 3 * count;
+
+        if(has_t)
+        {
+            for(int k = 0; k < 2; ++k)
+            {
+                for(size_t i = 0; i < count; ++i)
+                    std::memcpy(&q32[i], in + 2 * i + k, 4);
+                p = put_channel(q32.data(), count, p);
+            }
+            in += 2 * count;
+        }
+
+        if(has_n)
+        {
+            std::vector<std::uint16_t> v16(count);
+            for(size_t i = 0; i < count; ++i)
+            {
+                std::int16_t u, v;
+                octahedral_encode(knu::math::Vector3f(in[3 * i], in[3 * i + 1], in[3 * i + 2]), u, v);
+                q16[i] = std::uint16_t(u);
+                v16[i] = std::uint16_t(v);
+            }
+            p = put_channel(q16.data(), count, p);
+            p = put_channel(v16.data(), count, p);
+        }
+
+        return pack_bytes(raw.data(), raw.size());
+    }
+
+    // Inverse of pack_mesh_vertices, into vertex_count * format size bytes at planar
+    inline bool unpack_mesh_vertices(ObjFormat format, const void *packed, size_t packed_bytes, size_t count,
+                                     const float lo[3], const float hi[3], void *planar)
+    {
+        using namespace detail;
+
+        if(!quantizable(lo, hi))
+            return false;
+
+        bool has_t = format == ObjFormat::Ver_Tex || format == ObjFormat::Ver_Tex_Nor;
+        bool has_n = format == ObjFormat::Ver_Nor || format == ObjFormat::Ver_Tex_Nor;
+
+        size_t raw_size = vertex_stream_size(format, count);
+        std::unique_ptr<unsigned char[], Pool_Deleter> raw(static_cast<unsigned char *>(Buffer_Pool::shared().acquire(raw_size)));
+        if(!unpack_bytes(static_cast<const unsigned char *>(packed), packed_bytes, raw.get(), raw_size))
+            return false;
+
+        const unsigned char *position_planes = raw.get(), *tex_planes = position_planes + 6 * count;
+        const unsigned char *normal_planes = tex_planes + (has_t ? 8 * count : 0);
+        float *positions = static_cast<float *>(planar);
+        float *tex_coords = positions + 3 * count;
+        float *normals = tex_coords + (has_t ? 2 * count : 0);
+
+        // a block at a time, so the channels stay in the L1 cache between the passes
+        const size_t BLOCK = 1024;
+        std::uint16_t c16[3][BLOCK];
+        std::uint32_t c32[2][BLOCK];
+        std::uint16_t prev16[5] = {0, 0, 0, 0, 0};
+        std::uint32_t prev32[2] = {0, 0};
+
+        float scale[3];
+        for(int k = 0; k < 3; ++k)
+            scale[k] = (hi[k] - lo[k]) / 65535.0f;
+
+        for(size_t first = 0; first < count; first += BLOCK)
+        {
+            size_t n = std::min(BLOCK, count - first);
+
+            for(int k = 0; k < 3; ++k)
+                get_channel16(position_planes + 2 * count * k, count, first, n, prev16[k], c16[k]);
+
+            float *out = positions + 3 * first;
+            size_t i = 0;
+#ifdef KNU_MESH_CODEC_SSE2
+            const __m128i zero = _mm_setzero_si128();
+            __m128 l[3], s[3];
+            for(int k = 0; k < 3; ++k)
+            {
+                l[k] = _mm_set1_ps(lo[k]);
+                s[k] = _mm_set1_ps(scale[k]);
+            }
+            for(; i + 4 <= n; i += 4)
+            {
+                __m128 c[3];
+                for(int k = 0; k < 3; ++k)
+                {
+                    __m128i q = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(c16[k] + i)), zero);
+                    c[k] = _mm_add_ps(l[k], _mm_mul_ps(_mm_cvtepi32_ps(q), s[k]));
+                }
+                store_xyz4(out + 3 * i, c[0], c[1], c[2]);
+            }
+#endif
+            for(; i < n; ++i)
+                for(int k = 0; k < 3; ++k)
+                    out[3 * i + k] = lo[k] + float(c16[k][i]) * scale[k];
+
+            if(has_t)
+            {
+                for(int k = 0; k < 2; ++k)
+                    get_channel32(tex_planes + 4 * count * k, count, first, n, prev32[k], c32[k]);
+
+                float *t = tex_coords + 2 * first;
+                i = 0;
+#ifdef KNU_MESH_CODEC_SSE2
+                for(; i + 4 <= n; i += 4)
+                {
+                    __m128i u = _mm_loadu_si128(reinterpret_cast<const __m128i *>(c32[0] + i));
+                    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(c32[1] + i));
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(t + 2 * i), _mm_unpacklo_epi32(u, v));
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(t + 2 * i + 4), _mm_unpackhi_epi32(u, v));
+                }
+#endif
+                for(; i < n; ++i)
+                {
+                    std::memcpy(t + 2 * i, &c32[0][i], 4);
+                    std::memcpy(t + 2 * i + 1, &c32[1][i], 4);
+                }
+            }
+
+            if(has_n)
+            {
+                for(int k = 0; k < 2; ++k)
+                    get_channel16(normal_planes + 2 * count * k, count, first, n, prev16[3 + k], c16[k]);
+
+                float *nout = normals + 3 * first;
+                i = 0;
+#ifdef KNU_MESH_CODEC_SSE2
+                const __m128 sign = _mm_set1_ps(-0.0f), unit = _mm_set1_ps(1.0f), snorm = _mm_set1_ps(1.0f / 32767.0f);
+                for(; i + 4 <= n; i += 4)
+                {
+                    __m128i u16 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(c16[0] + i));
+                    __m128i v16 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(c16[1] + i));
+                    __m128 x = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(u16, u16), 16)), snorm);
+                    __m128 y = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v16, v16), 16)), snorm);
+                    __m128 z = _mm_sub_ps(_mm_sub_ps(unit, _mm_andnot_ps(sign, x)), _mm_andnot_ps(sign, y));
+                    __m128 t = _mm_max_ps(_mm_sub_ps(_mm_setzero_ps(), z), _mm_setzero_ps());
+                    x = _mm_sub_ps(x, _mm_or_ps(_mm_and_ps(x, sign), t));
+                    y = _mm_sub_ps(y, _mm_or_ps(_mm_and_ps(y, sign), t));
+                    __m128 inv = _mm_div_ps(unit, _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z))));
+                    store_xyz4(nout + 3 * i, _mm_mul_ps(x, inv), _mm_mul_ps(y, inv), _mm_mul_ps(z, inv));
+                }
+#endif
+                for(; i < n; ++i)
+                    octahedral_decode(std::int16_t(c16[0][i]), std::int16_t(c16[1][i]), nout + 3 * i);
+            }
+        }
+
+        return true;
+    }
+
+    template<typename Index>
+    std::vector<unsigned char> pack_mesh_indices(const Index *indices, size_t count)
+    {
+        std::vector<unsigned char> raw;
+        raw.reserve(count + count / 2);
+        std::uint32_t prev = 0;
+        for(size_t i = 0; i < count; ++i)
+        {
+            std::uint32_t z = detail::zigzag(std::uint32_t(std::uint32_t(indices[i]) - prev));
+            prev = std::uint32_t(indices[i]);
+            for(; z >= 0x80; z >>= 7)
+                raw.push_back((unsigned char)(z | 0x80));
+            raw.push_back((unsigned char)z);
+        }
+        return detail::pack_bytes(raw.data(), raw.size());
+    }
+
+    // Inverse of pack_mesh_indices, into count indices of index_size (2 or 4) bytes
+    inline bool unpack_mesh_indices(const void *packed, size_t packed_bytes, size_t count, size_t index_size, void *indices)
+    {
+        using namespace detail;
+
+        auto src = static_cast<const unsigned char *>(packed);
+        size_t raw_size;
+        if(!packed_size(src, packed_bytes, raw_size) || raw_size < count)
+            return false;
+
+        std::unique_ptr<unsigned char[], Pool_Deleter> raw(static_cast<unsigned char *>(Buffer_Pool::shared().acquire(raw_size)));
+        if(!unpack_bytes(src, packed_bytes, raw.get(), raw_size))
+            return false;
+
+        const unsigned char *p = raw.get(), *end = p + raw_size;
+        auto out16 = static_cast<std::uint16_t *>(indices);
+        auto out32 = static_cast<std::uint32_t *>(indices);
+        std::uint32_t prev = 0;
+        for(size_t i = 0; i < count; ++i)
+        {
+            if(p == end)
+                return false;
+            std::uint32_t z = *p++;
+            if(z & 0x80)
+            {
+                z &= 0x7F;
+                for(int shift = 7; ; shift += 7)
+                {
+                    if(p == end || shift > 28)
+                        return false;
+                    std::uint32_t b = *p++;
+                    z |= (b & 0x7F) << shift;
+                    if(!(b & 0x80))
+                        break;
+                }
+            }
+
+            prev += unzigzag(z);
+            if(index_size == 2)
+            {
+                if(prev > 0xFFFF)
+                    return false;
+                out16[i] = std::uint16_t(prev);
+            }
+            else
+                out32[i] = prev;
+        }
+
+        return p == end;
+    }
+}
+
+#endif  // KNU_MESH_CODEC
@@ -0,0 +1,341 @@
+#ifndef KNU_MESH_MESHLETS
+#define KNU_MESH_MESHLETS
+
+// Splits indexed meshes into meshlets: clusters of at most MESHLET_MAX_VERTICES vertices
+// and MESHLET_MAX_TRIANGLES triangles. The mesh's triangles are reordered so every meshlet
+// is a contiguous range of its index list, which a multi-draw call can draw as is.
+// Meshlets grow from a seed triangle over the triangles next to the last one added,
+// preferring those that bring the fewest new vertices and face the way the meshlet does.
+// Each meshlet gets a bounding sphere for frustum culling and a normal cone for rejecting
+// clusters that face away from the camera.
+
+#include <knu/obj.hpp>
+#include <knu/parallel.hpp>
+#include <knu/mesh_optimizer.hpp>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+namespace knu
+{
+    const size_t MESHLET_MAX_VERTICES = 64;
+    const size_t MESHLET_MAX_TRIANGLES = 124;
+
+    namespace detail
+    {
+        // Bounding sphere and normal cone of m's triangles in indices; vertices are the ones they use
+        template<typename Position>
+        void meshlet_bounds(Meshlet &m, const std::uint32_t *indices, const std::uint32_t *vertices, size_t vertex_count, Position position)
+        {
+            using knu::math::v3f;
+
+            v3f lo = position(vertices[0]), hi = lo;
+            for(size_t i = 1; i < vertex_count; ++i)
+            {
+                auto p = position(vertices[i]);
+                lo.x = std::min(lo.x, p.x); lo.y = std::min(lo.y, p.y); lo.z = std::min(lo.z, p.z);
+                hi.x = std::max(hi.x, p.x); hi.y = std::max(hi.y, p.y); hi.z = std::max(hi.z, p.z);
+            }
+
+            auto center = (lo + hi) * 0.5f;
+            float radius = 0.0f;
+            for(size_t i = 0; i < vertex_count; ++i)
+                radius = std::max(radius, (position(vertices[i]) - center).length());
+
+            v3f axis;
+            std::vector<v3f> normals;
+            normals.reserve(m.index_count / 3);
+            for(size_t t = 0; t < m.index_count / 3; ++t)
+            {
+                const auto *tri = indices + m.first_index + t * 3;
+                auto a = position(tri[0]);
+                auto n = (position(tri[1]) - a).cross(position(tri[2]) - a);
+                if(n.is_zero())
+                    continue;
+                n.normalize();
+                normals.push_back(n);
+                axis += n;
+            }
+            axis.normalize();
+
+            float min_dot = 1.0f;
+            for(const auto &n : normals)
+                min_dot = std::min(min_dot, n.dot(axis));
+
+            // the apex sits far enough behind the centre that every triangle plane faces it
+            float max_t = 0.0f;
+            for(size_t t = 0, k = 0; t < m.index_count / 3; ++t)
+            {
+                const auto *tri = indices + m.first_index + t * 3;
+                auto a = position(tri[0]);
+                if((position(tri[1]) - a).cross(position(tri[2]) - a).is_zero())
+                    continue;
+
+                const auto &n = normals[k++];
+                float dn = n.dot(axis);
+                if(dn > 1e-6f)
+                    max_t = std::max(max_t, (center - a).dot(n) / dn);
+            }
+            auto apex = center - axis * max_t;
+
+            for(int k = 0; k < 3; ++k)
+            {
+                m.center[k] = (&center.x)[k];
+                m.cone_apex[k] = (&apex.x)[k];
+                m.cone_axis[k] = (&axis.x)[k];
+            }
+            m.radius = radius;
+
+            // cones wider than a hemisphere never cull
+            m.cone_cutoff = normals.empty() || min_dot <= 0.1f ? 2.0f : std::sqrt(1.0f - min_dot * min_dot);
+        }
+    }
+
+    // Reorders the triangles of an index list into meshlets and returns them.
+    // position(v) gives the position of vertex v.
+    template<typename Position>
+    std::vector<Meshlet> build_meshlets(std::vector<std::uint32_t> &indices, size_t vertex_count, Position position)
+    {
+        using knu::math::v3f;
+
+        std::vector<Meshlet> meshlets;
+        size_t tri_count = indices.size() / 3;
+        if(!tri_count)
+            return meshlets;
+
+        // emitted triangles are compacted out of a vertex's list as it is scanned, keeping
+        // the order of the rest; live_end[v] ends what is left of it
+        detail::Vertex_Triangles adjacency(indices.data(), tri_count * 3, vertex_count);
+        std::vector<std::uint32_t> live_end(adjacency.offsets.begin() + 1, adjacency.offsets.end());
+
+        // vertices shared by this many triangles, e.g. the centre of a fan, are left out of
+        // the search while the rest of the meshlet still has neighbours to offer
+        const std::uint32_t busy_valence = 256;
+
+        std::vector<v3f> normals(tri_count);
+        for(size_t t = 0; t < tri_count; ++t)
+        {
+            auto a = position(indices[t * 3]);
+            normals[t] = (position(indices[t * 3 + 1]) - a).cross(position(indices[t * 3 + 2]) - a);
+            normals[t].normalize();
+        }
+
+        std::vector<char> emitted(tri_count, 0), in_meshlet(vertex_count, 0);
+        std::vector<std::uint32_t> output, vertices;
+        output.reserve(tri_count * 3);
+        vertices.reserve(MESHLET_MAX_VERTICES);
+
+        size_t cursor = 0;
+        while(true)
+        {
+            while(cursor < tri_count && emitted[cursor])
+                ++cursor;
+            if(cursor == tri_count)
+                break;
+
+            Meshlet m = {};
+            m.first_index = std::uint32_t(output.size());
+            v3f axis;
+
+            auto new_vertices = [&](size_t t)
+            {
+                return size_t(!in_meshlet[indices[t * 3]]) + !in_meshlet[indices[t * 3 + 1]] + !in_meshlet[indices[t * 3 + 2]];
+            };
+
+            auto add = [&](size_t t)
+            {
+                for(int k = 0; k < 3; ++k)
+                {
+                    auto v = indices[t * 3 + k];
+                    output.push_back(v);
+                    if(!in_meshlet[v])
+                    {
+                        in_meshlet[v] = 1;
+                        vertices.push_back(v);
+                    }
+                }
+                emitted[t] = 1;
+                axis += normals[t];
+                m.index_count += 3;
+            };
+
+            // best unused triangle around the given vertices, or -1; skipped is set when a busy
+            // vertex was left out
+            auto best_around = [&](const std::uint32_t *around, size_t count, size_t &best_new, bool with_busy, bool &skipped)
+            {
+                long best = -1;
+                float best_dot = 0.0f;
+                auto dir = axis;
+                dir.normalize();
+
+                for(size_t i = 0; i < count; ++i)
+                {
+                    auto v = around[i];
+                    auto first = adjacency.offsets[v], live = first;
+                    if(!with_busy && live_end[v] - first > busy_valence)
+                    {
+                        skipped = true;
+                        continue;
+                    }
+
+                    for(auto o = first; o < live_end[v]; ++o)
+                    {
+                        auto t = adjacency.triangles[o];
+                        if(emitted[t])
+                            continue;
+                        adjacency.triangles[live++] = t;
+
+                        size_t extra = new_vertices(t);
+                        if(vertices.size() + extra > MESHLET_MAX_VERTICES)
+                            continue;
+
+                        float d = normals[t].dot(dir);
+                        if(best < 0 || extra < best_new || (extra == best_new && d > best_dot))
+                        {
+                            best = long(t);
+                            best_new = extra;
+                            best_dot = d;
+                        }
+                    }
+                    live_end[v] = live;
+                }
+                return best;
+            };
+
+            add(cursor);
+            while(m.index_count / 3 < MESHLET_MAX_TRIANGLES)
+            {
+                size_t best_new = 0;
+                bool skipped = false;
+                long next = best_around(&output[output.size() - 3], 3, best_new, false, skipped);
+                if(next < 0 || best_new > 1)
+                {
+                    // something closer around the rest of the meshlet?
+                    size_t other_new = 0;
+                    long other = best_around(vertices.data(), vertices.size(), other_new, false, skipped);
+                    if(other >= 0 && (next < 0 || other_new < best_new))
+                        next = other;
+                }
+                if(next < 0 && skipped)
+                    next = best_around(vertices.data(), vertices.size(), best_new, true, skipped);
+                if(next < 0)
+                    break;
+                add(size_t(next));
+            }
+
+            m.vertex_count = std::uint32_t(vertices.size());
+            detail::meshlet_bounds(m, output.data(), vertices.data(), vertices.size(), position);
+            meshlets.push_back(m);
+
+            for(auto v : vertices)
+                in_meshlet[v] = 0;
+            vertices.clear();
+        }
+
+        indices.swap(output);
+        return meshlets;
+    }
+
+    // Builds m.meshlets, reordering m's indices; meshes without indices or vertices are left alone
+    inline void build_meshlets(Mesh &m)
+    {
+        m.meshlets.clear();
+        if(!m.indexed() || m.v.empty())
+            return;
+
+        std::vector<std::uint32_t> indices(m.index_count());
+        for(size_t i = 0; i < indices.size(); ++i)
+            indices[i] = m.index(i);
+
+        const auto &v = m.v;
+        m.meshlets = build_meshlets(indices, v.size(), [&v](std::uint32_t i) { return v[i]; });
+
+        if(!m.indices16.empty())
+            m.indices16.assign(indices.begin(), indices.end());
+        else
+            m.indices32.swap(indices);
+    }
+
+    // Every submesh of o on its own worker
+    inline void build_meshlets(Obj &o)
+    {
+        parallel_for(o.meshes.size(), [&](size_t i)
+        {
+            build_meshlets(o.meshes[i]);
+        });
+    }
+
+    // Culling planes of a view projection (clip = v * view_proj), pointing inwards
+    struct Meshlet_Frustum
+    {
+        float planes[6][4];
+        knu::math::v3f camera;
+
+        Meshlet_Frustum(const knu::math::m4f &view_proj, const knu::math::v3f &camera_position):camera(camera_position)
+        {
+            knu::math::v4f rows[4] = {
+                knu::math::v4f(1.0f, 0.0f, 0.0f, 0.0f) * view_proj, knu::math::v4f(0.0f, 1.0f, 0.0f, 0.0f) * view_proj,
+                knu::math::v4f(0.0f, 0.0f, 1.0f, 0.0f) * view_proj, knu::math::v4f(0.0f, 0.0f, 0.0f, 1.0f) * view_proj};
+
+            // w + x, w - x, w + y, w - y, w + z, w - z
+            for(int p = 0; p < 6; ++p)
+            {
+                float s = (p & 1) ? -1.0f : 1.0f;
+                float len = 0.0f;
+                for(int r = 0; r < 4; ++r)
+                {
+                    const auto &row = rows[r];
+                    float c = p < 2 ? row.x : (p < 4 ? row.y : row.z);
+                    planes[p][r] = row.w + s * c;
+                    if(r < 3)
+                        len += planes[p][r] * planes[p][r];
+                }
+
+                len = std::sqrt(len);
+                for(int r = 0; r < 4 && len > 0.0f; ++r)
+                    planes[p][r] /= len;
+            }
+        }
+
+        bool visible(const Meshlet &m) const
+        {
+            for(int p = 0; p < 6; ++p)
+            {
+                if(planes[p][0] * m.center[0] + planes[p][1] * m.center[1] + planes[p][2] * m.center[2] + planes[p][3] < -m.radius)
+                    return false;
+            }
+
+            knu::math::v3f to_apex(m.cone_apex[0] - camera.x, m.cone_apex[1] - camera.y, m.cone_apex[2] - camera.z);
+            float len = to_apex.length();
+            float d = to_apex.x * m.cone_axis[0] + to_apex.y * m.cone_axis[1] + to_apex.z * m.cone_axis[2];
+            return !(len > 0.0f && d >= m.cone_cutoff * len);
+        }
+    };
+
+    // Index ranges of the visible meshlets, adjacent ranges merged, ready for a multi-draw
+    inline void cull_meshlets(const std::vector<Meshlet> &meshlets, const Meshlet_Frustum &frustum, std::vector<Meshlet_Draw> &draws)
+    {
+        std::vector<char> visible(meshlets.size());
+        parallel_for_ranges(meshlets.size(), [&](size_t begin, size_t end)
+        {
+            for(size_t i = begin; i < end; ++i)
+                visible[i] = frustum.visible(meshlets[i]);
+        }, 1024);
+
+        draws.clear();
+        for(size_t i = 0; i < meshlets.size(); ++i)
+        {
+            if(!visible[i])
+                continue;
+
+            const auto &m = meshlets[i];
+            if(!draws.empty() && draws.back().first_index + draws.back().index_count == m.first_index)
+                draws.back().index_count += m.index_count;
+            else
+                draws.push_back(Meshlet_Draw{m.first_index, m.index_count});
+        }
+    }
+}
+
+#endif  // KNU_MESH_MESHLETS
@@ -0,0 +1,581 @@
+#ifndef KNU_MESH_NORMALS
+#define KNU_MESH_NORMALS
+
+// Normals for models that come without them, and tangent frames for normal mapping.
+//  - generate_normals fills Obj_Reader::normals and the faces' normal indices. A corner's
+//    normal averages the faces around its vertex that meet its own face at no more than the
+//    crease angle, weighted by face area or by the corner angle. Corners of a vertex that
+//    end up with the same normal share it.
+//  - generate_tangents follows MikkTSpace (Mikkelsen 2008): per face texture space
+//    directions are projected into the tangent plane of each corner's normal, weighted by
+//    the corner angle and summed over the corners sharing a vertex. w holds the bitangent
+//    sign, B = w * cross(N, T).
+// Face terms are computed in parallel; vertex sums are gathered or reduced from per task
+// partial sums, so no worker writes where another one does.
+
+#include <knu/obj.hpp>
+#include <knu/parallel.hpp>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+namespace knu
+{
+    namespace detail
+    {
+        inline float corner_angle(const knu::math::v3f &p, const knu::math::v3f &a, const knu::math::v3f &b)
+        {
+            auto e1 = a - p, e2 = b - p;
+            float len = e1.length() * e2.length();
+            if(len <= 0.0f)
+                return 0.0f;
+            return std::acos(std::max(-1.0f, std::min(1.0f, e1.dot(e2) / len)));
+        }
+
+        // Any unit vector perpendicular to n
+        inline knu::math::v3f perpendicular(const knu::math::v3f &n)
+        {
+            auto axis = std::fabs(n.x) < 0.9f ? knu::math::v3f(1.0f, 0.0f, 0.0f) : knu::math::v3f(0.0f, 1.0f, 0.0f);
+            auto t = axis - n * n.dot(axis);
+            return t.normalize();
+        }
+
+        // Weighted unit normals in a k-d tree with subtree sums, so summing the ones within an
+        // angle of a direction visits only the nodes that straddle the edge of that cone
+        class Normal_Tree
+        {
+            struct Node
+            {
+                knu::math::v3f lo, hi, sum;
+                std::uint32_t begin, end;       // items
+                std::uint32_t left, right;      // children, 0 for leaves
+            };
+
+            std::vector<Node> nodes;
+            std::vector<knu::math::v3f> normals, sums;
+            std::vector<std::uint32_t> items;
+            mutable std::vector<std::uint32_t> stack;
+
+            static float component(const knu::math::v3f &v, int axis)
+            {
+                return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+            }
+
+            std::uint32_t build(std::uint32_t begin, std::uint32_t end)
+            {
+                auto index = std::uint32_t(nodes.size());
+                nodes.push_back(Node());
+
+                Node n;
+                n.lo = n.hi = normals[items[begin]];
+                for(auto i = begin; i < end; ++i)
+                {
+                    const auto &p = normals[items[i]];
+                    n.lo.set(std::min(n.lo.x, p.x), std::min(n.lo.y, p.y), std::min(n.lo.z, p.z));
+                    n.hi.set(std::max(n.hi.x, p.x), std::max(n.hi.y, p.y), std::max(n.hi.z, p.z));
+                    n.sum += sums[items[i]];
+                }
+                n.begin = begin;
+                n.end = end;
+                n.left = n.right = 0;
+
+                if(end - begin > 8)
+                {
+                    auto extent = n.hi - n.lo;
+                    int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+                    auto mid = begin + (end - begin) / 2;
+                    std::nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end, [&](std::uint32_t a, std::uint32_t b)
+                    {
+                        return component(normals[a], axis) < component(normals[b], axis);
+                    });
+
+                    n.left = build(begin, mid);
+                    n.right = build(mid, end);
+                }
+
+                nodes[index] = n;
+                return index;
+            }
+
+        public:
+            void build(std::vector<knu::math::v3f> unit_normals, std::vector<knu::math::v3f> weighted)
+            {
+                normals.swap(unit_normals);
+                sums.swap(weighted);
+                nodes.clear();
+                items.resize(normals.size());
+                for(std::uint32_t i = 0; i < items.size(); ++i)
+                    items[i] = i;
+                if(!items.empty())
+                    build(0, std::uint32_t(items.size()));
+            }
+
+            // Sum of the items whose normal has at least cos_angle as its dot product with n
+            knu::math::v3f sum_within(const knu::math::v3f &n, float cos_angle) const
+            {
+                // for unit vectors the dot product bound is a distance bound; nodes near the
+                // edge go down to the items, which are tested by the dot product itself
+                const float margin = 1e-4f;
+                float radius_sq = 2.0f - 2.0f * cos_angle;
+
+                knu::math::v3f total;
+                if(nodes.empty())
+                    return total;
+
+                stack.assign(1, 0);
+                while(!stack.empty())
+                {
+                    const auto &node = nodes[stack.back()];
+                    stack.pop_back();
+
+                    float near_sq = 0.0f, far_sq = 0.0f;
+                    for(int a = 0; a < 3; ++a)
+                    {
+                        float p = component(n, a), lo = component(node.lo, a), hi = component(node.hi, a);
+                        float d = std::max(0.0f, std::max(lo - p, p - hi));
+                        float f = std::max(std::fabs(p - lo), std::fabs(p - hi));
+                        near_sq += d * d;
+                        far_sq += f * f;
+                    }
+
+                    if(near_sq > radius_sq + margin)
+                        continue;
+                    if(far_sq < radius_sq - margin)
+                        total += node.sum;
+                    else if(node.left)
+                    {
+                        stack.push_back(node.left);
+                        stack.push_back(node.right);
+                    }
+                    else
+                    {
+                        for(auto i = node.begin; i < node.end; ++i)
+                            if(normals[items[i]].dot(n) >= cos_angle)
+                                total += sums[items[i]];
+                    }
+                }
+                return total;
+            }
+        };
+
+        // Splits [0, count) into tasks ranges and calls fn(task, begin, end) for each
+        template<typename Fn>
+        void parallel_tasks(size_t count, size_t tasks, Fn fn)
+        {
+            size_t per_task = (count + tasks - 1) / tasks;
+            parallel_for(tasks, [&](size_t task)
+            {
+                size_t begin = std::min(count, task * per_task);
+                fn(task, begin, std::min(count, begin + per_task));
+            });
+        }
+    }
+
+    enum class Normal_Weighting
+    {
+        area,       // larger faces count more
+        angle       // each face counts by the angle it spans at the vertex
+    };
+
+    // Gives every face corner of r a normal. Existing normals are replaced.
+    inline void generate_normals(Obj_Reader &r, float crease_angle = 180.0f, Normal_Weighting weighting = Normal_Weighting::angle)
+    {
+        using knu::math::v3f;
+        const auto &positions = r.vertices;
+
+        // vertex of every corner, mesh after mesh
+        size_t corner_count = 0;
+        for(const auto &m : r.meshes)
+            corner_count += m.faces.size();
+
+        std::vector<std::uint32_t> corners;
+        corners.reserve(corner_count);
+        for(const auto &m : r.meshes)
+        {
+            const auto &v = m.faces.v_indices;
+            for(size_t i = 0; i < v.size(); ++i)
+            {
+                // r may come from anywhere, so its indices are not trusted
+                if(v[i] < 0 || size_t(v[i]) >= positions.size())
+                    throw std::runtime_error("generate_normals() - face refers to a missing vertex");
+                corners.push_back(std::uint32_t(v[i]));
+            }
+        }
+        size_t tri_count = corner_count / 3;
+
+        // unit face normals and areas
+        std::vector<v3f> face_normals(tri_count);
+        std::vector<float> face_areas(tri_count);
+        parallel_for_ranges(tri_count, [&](size_t begin, size_t end)
+        {
+            for(size_t t = begin; t < end; ++t)
+            {
+                const auto &a = positions[corners[t * 3]], &b = positions[corners[t * 3 + 1]], &c = positions[corners[t * 3 + 2]];
+                auto n = (b - a).cross(c - a);
+                float len = n.length();
+                face_areas[t] = len * 0.5f;
+                face_normals[t] = len > 0.0f ? n / len : v3f();
+            }
+        }, 4096);
+
+        // corners around each vertex
+        std::vector<std::uint32_t> offsets(positions.size() + 1, 0), around(tri_count * 3);
+        for(size_t c = 0; c < tri_count * 3; ++c)
+            ++offsets[corners[c] + 1];
+        for(size_t v = 0; v < positions.size(); ++v)
+            offsets[v + 1] += offsets[v];
+        {
+            std::vector<std::uint32_t> fill(offsets.begin(), offsets.end() - 1);
+            for(size_t c = 0; c < tri_count * 3; ++c)
+                around[fill[corners[c]]++] = std::uint32_t(c);
+        }
+
+        float cos_crease = crease_angle >= 180.0f ? -2.0f : std::cos(crease_angle * 3.14159265f / 180.0f);
+
+        // each corner's normal, gathered per vertex; same[c] is the first corner of the
+        // vertex with the same normal. Corners are grouped by their face normal, so a vertex
+        // costs the sorting of its corners plus the crease tests between distinct face
+        // normals, and nothing beyond one sum when every face is within the crease angle.
+        std::vector<v3f> corner_normals(tri_count * 3);
+        std::vector<std::uint32_t> same(tri_count * 3), distinct(positions.size() + 1, 0);
+        parallel_for_ranges(positions.size(), [&](size_t begin, size_t end)
+        {
+            struct Group
+            {
+                v3f normal, sum, result;
+                std::uint32_t first;    // position of the group's first corner around the vertex
+            };
+
+            auto bits_less = [](const v3f &a, const v3f &b) { return std::memcmp(&a, &b, sizeof(v3f)) < 0; };
+
+            std::vector<float> weights;
+            std::vector<std::uint32_t> order, group_of;
+            std::vector<Group> groups;
+            std::vector<v3f> group_normals, group_sums;
+            detail::Normal_Tree tree;
+            for(size_t v = begin; v < end; ++v)
+            {
+                auto first = offsets[v], last = offsets[v + 1];
+                auto count = last - first;
+                if(!count)
+                    continue;
+
+                weights.resize(count);
+                for(auto i = first; i < last; ++i)
+                {
+                    auto c = around[i], t = c / 3, k = c % 3;
+                    if(weighting == Normal_Weighting::area)
+                        weights[i - first] = face_areas[t];
+                    else
+                        weights[i - first] = detail::corner_angle(positions[corners[c]], positions[corners[t * 3 + (k + 1) % 3]],
+                                                                  positions[corners[t * 3 + (k + 2) % 3]]);
+                }
+
+                // everything smoothed together when no two faces can be apart by more than the
+                // crease angle: each one is within half of it of their mean direction
+                v3f total, mean;
+                for(auto i = first; i < last; ++i)
+                {
+                    const auto &n = face_normals[around[i] / 3];
+                    total += n * weights[i - first];
+                    mean += n;
+                }
+                bool smooth = cos_crease < -1.0f;
+                if(!smooth && !mean.is_zero())
+                {
+                    mean.normalize();
+                    float spread = 1.0f;
+                    for(auto i = first; i < last; ++i)
+                    {
+                        const auto &n = face_normals[around[i] / 3];
+                        if(!n.is_zero())
+                            spread = std::min(spread, n.dot(mean));
+                    }
+                    smooth = spread >= 0.0f && 2.0f * spread * spread - 1.0f >= cos_crease + 1e-6f;
+                }
+
+                // corners in groups of equal face normals, in order around the vertex within a group
+                order.resize(count);
+                for(std::uint32_t i = 0; i < count; ++i)
+                    order[i] = i;
+                std::sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b)
+                {
+                    const auto &na = face_normals[around[first + a] / 3], &nb = face_normals[around[first + b] / 3];
+                    int cmp = std::memcmp(&na, &nb, sizeof(v3f));
+                    return cmp != 0 ? cmp < 0 : a < b;
+                });
+
+                groups.clear();
+                group_of.resize(count);
+                for(auto i : order)
+                {
+                    const auto &n = face_normals[around[first + i] / 3];
+                    if(groups.empty() || std::memcmp(&groups.back().normal, &n, sizeof(v3f)) != 0)
+                        groups.push_back(Group{n, v3f(), v3f(), i});
+                    groups.back().sum += n * weights[i];
+                    group_of[i] = std::uint32_t(groups.size() - 1);
+                }
+
+                // many distinct normals, such as around the tip of a finely divided cone, are
+                // summed through a tree instead of against each other
+                bool many = !smooth && groups.size() > 32;
+                if(!smooth)
+                {
+                    total = v3f();
+                    for(const auto &g : groups)
+                        total += g.sum;
+                }
+                if(many)
+                {
+                    group_normals.clear();
+                    group_sums.clear();
+                    for(const auto &g : groups)
+                    {
+                        group_normals.push_back(g.normal);
+                        group_sums.push_back(g.sum);
+                    }
+                    tree.build(group_normals, group_sums);
+                }
+
+                // corners of faces without area take the vertex's full average
+                for(auto &g : groups)
+                {
+                    if(smooth || g.normal.is_zero())
+                        g.result = total;
+                    else if(many)
+                        g.result = tree.sum_within(g.normal, cos_crease);
+                    else
+                    {
+                        for(const auto &other : groups)
+                            if(other.normal.dot(g.normal) >= cos_crease)
+                                g.result += other.sum;
+                    }
+
+                    if(g.result.is_zero())
+                        g.result = g.normal.is_zero() ? v3f(0.0f, 0.0f, 1.0f) : g.normal;
+                    g.result.normalize();
+                }
+
+                // groups ending with the same normal share the corner that comes first
+                order.resize(groups.size());
+                for(std::uint32_t g = 0; g < groups.size(); ++g)
+                    order[g] = g;
+                std::sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b)
+                {
+                    return bits_less(groups[a].result, groups[b].result) ||
+                           (!bits_less(groups[b].result, groups[a].result) && groups[a].first < groups[b].first);
+                });
+                for(size_t k = 0; k < order.size(); ++k)
+                {
+                    auto &g = groups[order[k]];
+                    if(k && std::memcmp(&groups[order[k - 1]].result, &g.result, sizeof(v3f)) == 0)
+                        g.first = groups[order[k - 1]].first;
+                    else
+                        ++distinct[v + 1];
+                }
+
+                for(auto i = first; i < last; ++i)
+                {
+                    const auto &g = groups[group_of[i - first]];
+                    corner_normals[around[i]] = g.result;
+                    same[around[i]] = around[first + g.first];
+                }
+            }
+        }, 1024);
+
+        for(size_t v = 0; v < positions.size(); ++v)
+            distinct[v + 1] += distinct[v];
+
+        r.normals.assign(distinct.back(), v3f());
+        std::vector<std::uint32_t> corner_normals_index(tri_count * 3);
+        parallel_for_ranges(positions.size(), [&](size_t begin, size_t end)
+        {
+            for(size_t v = begin; v < end; ++v)
+            {
+                auto next = distinct[v];
+                for(auto i = offsets[v]; i < offsets[v + 1]; ++i)
+                {
+                    auto c = around[i];
+                    if(same[c] == c)
+                    {
+                        r.normals[next] = corner_normals[c];
+                        corner_normals_index[c] = std::uint32_t(next++);
+                    }
+                    else
+                        corner_normals_index[c] = corner_normals_index[same[c]];
+                }
+            }
+        }, 1024);
+
+        // the meshes' normal streams are rebuilt for the new normals
+        size_t first = 0;
+        for(auto &m : r.meshes)
+        {
+            auto &n = m.faces.n_indices;
+            n = Obj_Index_Stream();
+            n.set_range(r.normals.size());
+            n.reserve(m.faces.size());
+            for(size_t i = 0; i < m.faces.size(); ++i)
+                n.push_back(int(corner_normals_index[first + i]));
+            first += m.faces.size();
+        }
+    }
+
+    // Fills m.tangents with one tangent per vertex. Needs positions, texture coordinates
+    // and normals in memory; other meshes are left without tangents.
+    inline void generate_tangents(Mesh &m)
+    {
+        using knu::math::v3f;
+        m.tangents.clear();
+        size_t vertex_count = m.v.size();
+        if(!vertex_count || m.t.size() != vertex_count || m.n.size() != vertex_count)
+            return;
+
+        // vertex of each corner; unindexed corners with equal values count as one vertex
+        size_t corner_count = m.corner_count() / 3 * 3;
+        std::vector<std::uint32_t> vertex(corner_count);
+        if(m.indexed())
+        {
+            for(size_t i = 0; i < corner_count; ++i)
+                vertex[i] = m.index(i);
+        }
+        else
+        {
+            // open addressing on the bits of position, texture coordinate and normal
+            const size_t words = (sizeof(v3f) * 2 + sizeof(knu::math::Vector2f)) / 4;
+            auto key = [&m](std::uint32_t i, std::uint32_t *k)
+            {
+                std::memcpy(k, &m.v[i], sizeof(v3f));
+                std::memcpy(k + 3, &m.t[i], sizeof(knu::math::Vector2f));
+                std::memcpy(k + 5, &m.n[i], sizeof(v3f));
+            };
+
+            size_t size = 16;
+            while(size < corner_count * 2)
+                size <<= 1;
+            std::vector<std::uint32_t> slots(size, ~0u);
+
+            for(size_t i = 0; i < corner_count; ++i)
+            {
+                std::uint32_t k[words], other[words];
+                key(std::uint32_t(i), k);
+
+                std::uint64_t h = 0;
+                for(size_t w = 0; w < words; ++w)
+                    h = (h ^ k[w]) * 0x9E3779B97F4A7C15ull;
+                h ^= h >> 29;
+
+                for(size_t slot = size_t(h) & (size - 1); ; slot = (slot + 1) & (size - 1))
+                {
+                    if(slots[slot] == ~0u)
+                    {
+                        slots[slot] = std::uint32_t(i);
+                        vertex[i] = std::uint32_t(i);
+                        break;
+                    }
+
+                    key(slots[slot], other);
+                    if(std::memcmp(k, other, sizeof(k)) == 0)
+                    {
+                        vertex[i] = slots[slot];
+                        break;
+                    }
+                }
+            }
+        }
+
+        // per task partial sums over its triangles, then reduced per vertex
+        size_t tri_count = corner_count / 3;
+        size_t tasks = std::max<size_t>(1, std::min<size_t>(worker_count(), tri_count / 16384));
+        std::vector<std::vector<v3f>> tangent_sums(tasks), bitangent_sums(tasks);
+
+        detail::parallel_tasks(tri_count, tasks, [&](size_t task, size_t begin, size_t end)
+        {
+            auto &ts = tangent_sums[task], &bs = bitangent_sums[task];
+            ts.assign(vertex_count, v3f());
+            bs.assign(vertex_count, v3f());
+
+            for(size_t t = begin; t < end; ++t)
+            {
+                const auto *ix = &vertex[t * 3];
+                const auto &p0 = m.v[ix[0]], &p1 = m.v[ix[1]], &p2 = m.v[ix[2]];
+                const auto &t0 = m.t[ix[0]], &t1 = m.t[ix[1]], &t2 = m.t[ix[2]];
+
+                auto e1 = p1 - p0, e2 = p2 - p0;
+                float du1 = t1.x - t0.x, dv1 = t1.y - t0.y, du2 = t2.x - t0.x, dv2 = t2.y - t0.y;
+                float det = du1 * dv2 - du2 * dv1;
+                if(det == 0.0f)
+                    continue;       // no texture space direction
+
+                float sign = det > 0.0f ? 1.0f : -1.0f;
+                auto s_dir = (e1 * dv2 - e2 * dv1) * sign;
+                auto t_dir = (e2 * du1 - e1 * du2) * sign;
+
+                for(int k = 0; k < 3; ++k)
+                {
+                    auto v = ix[k];
+                    const auto &n = m.n[v];
+                    const auto &p = m.v[v], &a = m.v[ix[(k + 1) % 3]], &b = m.v[ix[(k + 2) % 3]];
+
+                    // the corner angle measured in the tangent plane
+                    auto ea = (a - p) - n * n.dot(a - p), eb = (b - p) - n * n.dot(b - p);
+                    float len = ea.length() * eb.length();
+                    float w = len > 0.0f ? std::acos(std::max(-1.0f, std::min(1.0f, ea.dot(eb) / len))) : 0.0f;
+
+                    auto ts_dir = s_dir - n * n.dot(s_dir);
+                    auto bs_dir = t_dir - n * n.dot(t_dir);
+                    ts[v] += ts_dir.normalize() * w;
+                    bs[v] += bs_dir.normalize() * w;
+                }
+            }
+        });
+
+        m.tangents.resize(vertex_count);
+        parallel_for_ranges(vertex_count, [&](size_t begin, size_t end)
+        {
+            for(size_t v = begin; v < end; ++v)
+            {
+                v3f t, b;
+                for(size_t task = 0; task < tasks; ++task)
+                {
+                    t += tangent_sums[task][v];
+                    b += bitangent_sums[task][v];
+                }
+
+                // welded corners of an unindexed mesh take the sums of the vertex they became
+                auto s = m.indexed() || v >= corner_count ? std::uint32_t(v) : vertex[v];
+                if(s != v)
+                {
+                    t = v3f();
+                    b = v3f();
+                    for(size_t task = 0; task < tasks; ++task)
+                    {
+                        t += tangent_sums[task][s];
+                        b += bitangent_sums[task][s];
+                    }
+                }
+
+                const auto &n = m.n[v];
+                t = t - n * n.dot(t);
+                if(t.is_zero())
+                    t = detail::perpendicular(n);
+                t.normalize();
+
+                float w = n.cross(t).dot(b) < 0.0f ? -1.0f : 1.0f;
+                m.tangents[v] = knu::math::Vector4f(t.x, t.y, t.z, w);
+            }
+        }, 4096);
+    }
+
+    // Every submesh of o, one after the other; each one is spread over the workers
+    inline void generate_tangents(Obj &o)
+    {
+        for(auto &m : o.meshes)
+            generate_tangents(m);
+    }
+}
+
+#endif  // KNU_MESH_NORMALS
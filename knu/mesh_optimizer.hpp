@@ -0,0 +1,378 @@
+#ifndef KNU_MESH_OPTIMIZER
+#define KNU_MESH_OPTIMIZER
+
+// Index and vertex reordering for indexed meshes:
+//  - vertex cache: Tipsify (Sander, Nehab, Barczak 2007) fans around recently used vertices
+//    so the post-transform cache hits more often,
+//  - overdraw: the Tipsify output is cut into clusters that keep most of that locality and the
+//    clusters facing away from the mesh centre are drawn first,
+//  - vertex fetch: vertices are renumbered in the order the triangles first use them.
+// ACMR is transformed vertices per triangle, ATVR transformed vertices per vertex (1.0 is ideal).
+
+#include <knu/obj.hpp>
+#include <knu/parallel.hpp>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+namespace knu
+{
+    struct Vertex_Cache_Stats
+    {
+        float acmr;
+        float atvr;
+    };
+
+    struct Mesh_Optimize_Report
+    {
+        Vertex_Cache_Stats before, after;
+    };
+
+    // Simulates a FIFO post-transform cache of cache_size entries
+    template<typename Index>
+    Vertex_Cache_Stats analyze_vertex_cache(const Index *indices, size_t index_count, size_t vertex_count, unsigned int cache_size = 16)
+    {
+        std::vector<unsigned int> fifo(cache_size, ~0u);
+        size_t head = 0, misses = 0;
+
+        for(size_t i = 0; i < index_count; ++i)
+        {
+            unsigned int v = indices[i];
+            if(std::find(fifo.begin(), fifo.end(), v) != fifo.end())
+                continue;
+
+            fifo[head] = v;
+            head = (head + 1) % cache_size;
+            ++misses;
+        }
+
+        Vertex_Cache_Stats stats;
+        stats.acmr = index_count ? float(misses) / float(index_count / 3) : 0.0f;
+        stats.atvr = vertex_count ? float(misses) / float(vertex_count) : 0.0f;
+        return stats;
+    }
+
+    namespace detail
+    {
+        // Triangles around each vertex
+        struct Vertex_Triangles
+        {
+            std::vector<std::uint32_t> offsets, triangles;
+
+            Vertex_Triangles(const std::uint32_t *indices, size_t index_count, size_t vertex_count):
+            offsets(vertex_count + 1, 0), triangles(index_count)
+            {
+                for(size_t i = 0; i < index_count; ++i)
+                    ++offsets[indices[i] + 1];
+                for(size_t v = 0; v < vertex_count; ++v)
+                    offsets[v + 1] += offsets[v];
+
+                std::vector<std::uint32_t> fill(offsets.begin(), offsets.end() - 1);
+                for(size_t i = 0; i < index_count; ++i)
+                    triangles[fill[indices[i]]++] = std::uint32_t(i / 3);
+            }
+        };
+
+        // Cache misses of a triangle against a timestamp cache, which behaves like a FIFO of cache_size
+        inline unsigned int cache_misses(const std::uint32_t *tri, std::vector<unsigned int> &stamps, unsigned int &time, unsigned int cache_size)
+        {
+            unsigned int misses = 0;
+            for(int k = 0; k < 3; ++k)
+            {
+                if(time - stamps[tri[k]] > cache_size)
+                {
+                    stamps[tri[k]] = time++;
+                    ++misses;
+                }
+            }
+            return misses;
+        }
+    }
+
+    // Reorders triangles for the post-transform cache. Returns the first triangle of every
+    // cluster that starts after a cache flush, for optimize_overdraw.
+    inline std::vector<std::uint32_t> optimize_vertex_cache(std::uint32_t *indices, size_t index_count, size_t vertex_count, unsigned int cache_size = 16)
+    {
+        std::vector<std::uint32_t> clusters;
+        size_t tri_count = index_count / 3;
+        if(!tri_count)
+            return clusters;
+
+        detail::Vertex_Triangles adjacency(indices, tri_count * 3, vertex_count);
+
+        std::vector<int> live(vertex_count);
+        for(size_t v = 0; v < vertex_count; ++v)
+            live[v] = int(adjacency.offsets[v + 1] - adjacency.offsets[v]);
+
+        std::vector<unsigned int> stamps(vertex_count, 0);
+        std::vector<char> emitted(tri_count, 0);
+        std::vector<std::uint32_t> dead_end, candidates, output;
+        output.reserve(tri_count * 3);
+        dead_end.reserve(tri_count * 3);
+
+        unsigned int time = cache_size + 1;
+        size_t cursor = 0;
+        long fan = indices[0];
+        clusters.push_back(0);
+
+        while(fan >= 0)
+        {
+            candidates.clear();
+
+            for(auto o = adjacency.offsets[fan]; o < adjacency.offsets[fan + 1]; ++o)
+            {
+                auto t = adjacency.triangles[o];
+                if(emitted[t])
+                    continue;
+
+                for(int k = 0; k < 3; ++k)
+                {
+                    auto v = indices[t * 3 + k];
+                    output.push_back(v);
+                    dead_end.push_back(v);
+                    candidates.push_back(v);
+                    --live[v];
+
+                    if(time - stamps[v] > cache_size)
+                        stamps[v] = time++;
+                }
+                emitted[t] = 1;
+            }
+
+            // next fan: the oldest candidate that will still be cached after its remaining fan
+            long next = -1;
+            int best = -1;
+            for(auto v : candidates)
+            {
+                if(live[v] <= 0)
+                    continue;
+
+                int priority = 0;
+                if(time - stamps[v] + 2 * live[v] <= cache_size)
+                    priority = int(time - stamps[v]);
+                if(priority > best)
+                {
+                    best = priority;
+                    next = v;
+                }
+            }
+
+            if(next < 0)
+            {
+                // dead end: a recently touched vertex, else the next vertex with triangles left
+                while(!dead_end.empty() && next < 0)
+                {
+                    auto d = dead_end.back();
+                    dead_end.pop_back();
+                    if(live[d] > 0)
+                        next = d;
+                }
+
+                while(next < 0 && cursor < vertex_count)
+                {
+                    if(live[cursor] > 0)
+                        next = long(cursor);
+                    ++cursor;
+                }
+
+                if(next >= 0)
+                    clusters.push_back(std::uint32_t(output.size() / 3));
+            }
+
+            fan = next;
+        }
+
+        std::copy(output.begin(), output.end(), indices);
+
+        clusters.erase(std::unique(clusters.begin(), clusters.end()), clusters.end());
+        if(clusters.back() == tri_count)
+            clusters.pop_back();
+        return clusters;
+    }
+
+    // Reorders the clusters of a vertex cache optimized index list so outward facing ones are
+    // drawn first. Clusters are split further wherever their running ACMR is within threshold
+    // of the whole cluster's, so cache efficiency drops by at most about that factor.
+    template<typename Position>
+    void optimize_overdraw(std::uint32_t *indices, size_t index_count, size_t vertex_count, Position position,
+                           const std::vector<std::uint32_t> &hard_clusters, float threshold = 1.05f, unsigned int cache_size = 16)
+    {
+        size_t tri_count = index_count / 3;
+        if(tri_count < 2 || hard_clusters.empty())
+            return;
+
+        // soft boundaries
+        std::vector<std::uint32_t> clusters;
+        std::vector<unsigned int> stamps(vertex_count, 0);
+        unsigned int time = cache_size + 1;
+
+        for(size_t c = 0; c < hard_clusters.size(); ++c)
+        {
+            size_t first = hard_clusters[c];
+            size_t last = c + 1 < hard_clusters.size() ? hard_clusters[c + 1] : tri_count;
+
+            time += cache_size + 1;
+            unsigned int misses = 0;
+            for(size_t t = first; t < last; ++t)
+                misses += detail::cache_misses(indices + t * 3, stamps, time, cache_size);
+            float limit = threshold * float(misses) / float(last - first);
+
+            clusters.push_back(std::uint32_t(first));
+            time += cache_size + 1;
+            unsigned int running_misses = 0, running_tris = 0;
+            for(size_t t = first; t < last; ++t)
+            {
+                running_misses += detail::cache_misses(indices + t * 3, stamps, time, cache_size);
+                ++running_tris;
+
+                if(t + 1 < last && float(running_misses) / float(running_tris) <= limit)
+                {
+                    clusters.push_back(std::uint32_t(t + 1));
+                    running_misses = running_tris = 0;
+                    time += cache_size + 1;
+                }
+            }
+        }
+
+        // mesh centre, then each cluster's centroid and area weighted normal
+        knu::math::v3f centre;
+        for(size_t i = 0; i < tri_count * 3; ++i)
+            centre += position(indices[i]);
+        centre /= float(tri_count * 3);
+
+        struct Cluster
+        {
+            std::uint32_t first, last;
+            float sort_key;
+        };
+
+        std::vector<Cluster> sorted(clusters.size());
+        for(size_t c = 0; c < clusters.size(); ++c)
+        {
+            auto &cl = sorted[c];
+            cl.first = clusters[c];
+            cl.last = c + 1 < clusters.size() ? clusters[c + 1] : std::uint32_t(tri_count);
+
+            knu::math::v3f centroid, normal;
+            float area = 0.0f;
+            for(auto t = cl.first; t < cl.last; ++t)
+            {
+                auto a = position(indices[t * 3]), b = position(indices[t * 3 + 1]), d = position(indices[t * 3 + 2]);
+                auto n = (b - a).cross(d - a);
+                float ta = n.length();
+                centroid += (a + b + d) * (ta / 3.0f);
+                normal += n;
+                area += ta;
+            }
+
+            if(area > 0.0f)
+                centroid /= area;
+            float len = normal.length();
+            if(len > 0.0f)
+                normal /= len;
+
+            cl.sort_key = (centroid - centre).dot(normal);
+        }
+
+        std::stable_sort(sorted.begin(), sorted.end(), [](const Cluster &a, const Cluster &b) { return a.sort_key > b.sort_key; });
+
+        std::vector<std::uint32_t> output;
+        output.reserve(tri_count * 3);
+        for(const auto &cl : sorted)
+            output.insert(output.end(), indices + cl.first * 3, indices + cl.last * 3);
+        std::copy(output.begin(), output.end(), indices);
+    }
+
+    // Renumbers vertices in first use order. Returns remap[old] = new; unused vertices go last.
+    inline std::vector<std::uint32_t> optimize_vertex_fetch(std::uint32_t *indices, size_t index_count, size_t vertex_count)
+    {
+        std::vector<std::uint32_t> remap(vertex_count, ~0u);
+        std::uint32_t next = 0;
+
+        for(size_t i = 0; i < index_count; ++i)
+        {
+            auto &r = remap[indices[i]];
+            if(r == ~0u)
+                r = next++;
+            indices[i] = r;
+        }
+
+        for(auto &r : remap)
+        {
+            if(r == ~0u)
+                r = next++;
+        }
+
+        return remap;
+    }
+
+    // All three stages on one index list. position(v) gives the position of vertex v; the
+    // caller moves its vertex data with the returned remap (new index = remap[old]).
+    template<typename Position>
+    Mesh_Optimize_Report optimize_indices(std::vector<std::uint32_t> &indices, size_t vertex_count, Position position,
+                                          std::vector<std::uint32_t> &remap, unsigned int cache_size = 16)
+    {
+        Mesh_Optimize_Report report;
+        report.before = analyze_vertex_cache(indices.data(), indices.size(), vertex_count, cache_size);
+
+        auto clusters = optimize_vertex_cache(indices.data(), indices.size(), vertex_count, cache_size);
+        optimize_overdraw(indices.data(), indices.size(), vertex_count, position, clusters, 1.05f, cache_size);
+        remap = optimize_vertex_fetch(indices.data(), indices.size(), vertex_count);
+
+        report.after = analyze_vertex_cache(indices.data(), indices.size(), vertex_count, cache_size);
+        return report;
+    }
+
+    template<typename T>
+    void apply_vertex_remap(std::vector<T> &attribute, const std::vector<std::uint32_t> &remap)
+    {
+        if(attribute.empty())
+            return;
+
+        std::vector<T> moved(attribute);
+        for(size_t i = 0; i < attribute.size(); ++i)
+            moved[remap[i]] = attribute[i];
+        attribute.swap(moved);
+    }
+
+    // Optimizes an indexed Mesh in place; meshes without indices are left alone
+    inline Mesh_Optimize_Report optimize_mesh(Mesh &m, unsigned int cache_size = 16)
+    {
+        Mesh_Optimize_Report report = {};
+        if(!m.indexed() || m.v.empty())
+            return report;
+
+        std::vector<std::uint32_t> indices(m.index_count());
+        for(size_t i = 0; i < indices.size(); ++i)
+            indices[i] = m.index(i);
+
+        std::vector<std::uint32_t> remap;
+        const auto &v = m.v;
+        report = optimize_indices(indices, v.size(), [&v](std::uint32_t i) { return v[i]; }, remap, cache_size);
+
+        apply_vertex_remap(m.v, remap);
+        apply_vertex_remap(m.t, remap);
+        apply_vertex_remap(m.n, remap);
+
+        if(!m.indices16.empty())
+            m.indices16.assign(indices.begin(), indices.end());
+        else
+            m.indices32.swap(indices);
+
+        return report;
+    }
+
+    // Every submesh of o, optimized in parallel. Reset o.bvh afterwards if it was built.
+    inline std::vector<Mesh_Optimize_Report> optimize_meshes(Obj &o, unsigned int cache_size = 16)
+    {
+        std::vector<Mesh_Optimize_Report> reports(o.meshes.size());
+        parallel_for(o.meshes.size(), [&](size_t i)
+        {
+            reports[i] = optimize_mesh(o.meshes[i], cache_size);
+        });
+        return reports;
+    }
+}
+
+#endif  // KNU_MESH_OPTIMIZER
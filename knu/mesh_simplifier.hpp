@@ -0,0 +1,470 @@
+#ifndef KNU_MESH_SIMPLIFIER
+#define KNU_MESH_SIMPLIFIER
+
+// Quadric error (Garland, Heckbert 1997) simplification of indexed meshes by half edge
+// collapses: a vertex moves onto a neighbour, so the vertex buffer stays as it is and every
+// level of detail is just another index list into it.
+//  - Vertices with the same position but different texture coordinates or normals (seams)
+//    collapse together along the seam, each onto the matching vertex on its own side, or
+//    not at all.
+//  - Vertices on open edges keep their place. A submesh holds one material, so this is
+//    also what keeps material boundaries from opening cracks between submeshes.
+//  - Collapses that would flip a triangle are skipped.
+// Errors are distances to the original surface relative to the mesh's bounding box
+// diagonal, so error * screen size in pixels is the error in pixels.
+
+#include <knu/obj.hpp>
+#include <knu/parallel.hpp>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+
+namespace knu
+{
+    namespace detail
+    {
+        // Symmetric 4x4 error quadric: weighted sum of squared distances to a set of planes
+        struct Quadric
+        {
+            double a00, a01, a02, a11, a12, a22, b0, b1, b2, c, w;
+
+            Quadric():a00(0), a01(0), a02(0), a11(0), a12(0), a22(0), b0(0), b1(0), b2(0), c(0), w(0) {}
+
+            // plane n.p + d = 0 with unit n
+            void add_plane(double nx, double ny, double nz, double d, double weight)
+            {
+                a00 += weight * nx * nx; a01 += weight * nx * ny; a02 += weight * nx * nz;
+                a11 += weight * ny * ny; a12 += weight * ny * nz; a22 += weight * nz * nz;
+                b0 += weight * nx * d; b1 += weight * ny * d; b2 += weight * nz * d;
+                c += weight * d * d;
+                w += weight;
+            }
+
+            Quadric &operator+=(const Quadric &q)
+            {
+                a00 += q.a00; a01 += q.a01; a02 += q.a02;
+                a11 += q.a11; a12 += q.a12; a22 += q.a22;
+                b0 += q.b0; b1 += q.b1; b2 += q.b2;
+                c += q.c;
+                w += q.w;
+                return *this;
+            }
+
+            // mean squared distance
+            double error(const knu::math::v3f &p) const
+            {
+                double x = p.x, y = p.y, z = p.z;
+                double e = x * (a00 * x + a01 * y + a02 * z) + y * (a01 * x + a11 * y + a12 * z) + z * (a02 * x + a12 * y + a22 * z) +
+                           2.0 * (b0 * x + b1 * y + b2 * z) + c;
+                return e > 0.0 && w > 0.0 ? e / w : 0.0;
+            }
+        };
+
+        class Simplifier
+        {
+            enum Kind : char { FREE, LOCKED };
+
+            struct Collapse
+            {
+                std::uint32_t from, to;     // position groups
+                double cost;
+            };
+
+            std::vector<knu::math::v3f> positions;      // per vertex
+            std::vector<std::uint32_t> group;           // vertex -> position group
+            std::vector<std::uint32_t> group_vertex;    // position group -> one of its vertices
+            std::vector<char> kind;
+            std::vector<Quadric> quadrics;
+            std::vector<std::uint32_t> tris;            // live triangles, three vertices each
+            std::vector<std::uint32_t> remap;
+            std::vector<std::uint32_t> group_offsets, group_tris;
+            std::vector<std::pair<std::uint32_t, std::uint32_t>> wedges;    // vertex mapping of one collapse
+            double extent;
+            double worst;
+            bool movable;           // any vertex that may collapse at all
+
+            const knu::math::v3f &group_position(std::uint32_t g) const
+            {
+                return positions[group_vertex[g]];
+            }
+
+            void build_groups()
+            {
+                size_t count = positions.size();
+                std::vector<std::uint32_t> order(count);
+                for(size_t v = 0; v < count; ++v)
+                    order[v] = std::uint32_t(v);
+
+                auto less = [this](std::uint32_t a, std::uint32_t b)
+                {
+                    const auto &p = positions[a], &q = positions[b];
+                    if(p.x != q.x) return p.x < q.x;
+                    if(p.y != q.y) return p.y < q.y;
+                    return p.z < q.z;
+                };
+                std::sort(order.begin(), order.end(), less);
+
+                group.resize(count);
+                for(size_t i = 0; i < count; ++i)
+                {
+                    if(i == 0 || less(order[i - 1], order[i]))
+                        group_vertex.push_back(order[i]);
+                    group[order[i]] = std::uint32_t(group_vertex.size() - 1);
+                }
+            }
+
+            // Open and non-manifold edges lock their end points
+            void classify()
+            {
+                std::vector<std::pair<std::uint32_t, std::uint32_t>> edges;
+                edges.reserve(tris.size());
+                for(size_t i = 0; i < tris.size(); i += 3)
+                {
+                    for(int k = 0; k < 3; ++k)
+                    {
+                        auto a = group[tris[i + k]], b = group[tris[i + (k + 1) % 3]];
+                        edges.push_back(std::make_pair(std::min(a, b), std::max(a, b)));
+                    }
+                }
+                std::sort(edges.begin(), edges.end());
+
+                kind.assign(group_vertex.size(), FREE);
+                for(size_t i = 0; i < edges.size(); )
+                {
+                    size_t j = i;
+                    while(j < edges.size() && edges[j] == edges[i])
+                        ++j;
+                    if(j - i != 2)
+                        kind[edges[i].first] = kind[edges[i].second] = LOCKED;
+                    i = j;
+                }
+
+                movable = std::find(kind.begin(), kind.end(), FREE) != kind.end();
+            }
+
+            void build_quadrics()
+            {
+                quadrics.assign(group_vertex.size(), Quadric());
+                for(size_t i = 0; i < tris.size(); i += 3)
+                {
+                    const auto &a = positions[tris[i]], &b = positions[tris[i + 1]], &d = positions[tris[i + 2]];
+                    auto n = (b - a).cross(d - a);
+                    float len = n.length();
+                    if(len <= 0.0f)
+                        continue;
+
+                    n /= len;
+                    double dist = -double(n.dot(a));
+                    for(int k = 0; k < 3; ++k)
+                        quadrics[group[tris[i + k]]].add_plane(n.x, n.y, n.z, dist, len);
+                }
+            }
+
+            // Triangles touching each position group
+            void build_adjacency()
+            {
+                group_offsets.assign(group_vertex.size() + 1, 0);
+                for(auto v : tris)
+                    ++group_offsets[group[v] + 1];
+                for(size_t g = 0; g < group_vertex.size(); ++g)
+                    group_offsets[g + 1] += group_offsets[g];
+
+                group_tris.resize(tris.size());
+                std::vector<std::uint32_t> fill(group_offsets.begin(), group_offsets.end() - 1);
+                for(size_t i = 0; i < tris.size(); ++i)
+                    group_tris[fill[group[tris[i]]]++] = std::uint32_t(i / 3);
+            }
+
+            // Fills wedges with where each vertex of group from goes; false if the collapse
+            // would tear a seam or flip a triangle
+            bool plan(std::uint32_t from, std::uint32_t to)
+            {
+                wedges.clear();
+                const auto &target = group_position(to);
+
+                for(auto o = group_offsets[from]; o < group_offsets[from + 1]; ++o)
+                {
+                    const auto *t = &tris[group_tris[o] * 3];
+                    int k = group[t[0]] == from ? 0 : (group[t[1]] == from ? 1 : 2);
+                    auto v = t[k], v1 = t[(k + 1) % 3], v2 = t[(k + 2) % 3];
+
+                    if(group[v1] == to || group[v2] == to)
+                    {
+                        auto w = group[v1] == to ? v1 : v2;
+                        auto it = std::find_if(wedges.begin(), wedges.end(), [v](const std::pair<std::uint32_t, std::uint32_t> &p) { return p.first == v; });
+                        if(it == wedges.end())
+                            wedges.push_back(std::make_pair(v, w));
+                        else if(it->second != w)
+                            return false;
+                        continue;
+                    }
+
+                    const auto &p1 = positions[v1], &p2 = positions[v2];
+                    auto before = (p1 - positions[v]).cross(p2 - positions[v]);
+                    auto after = (p1 - target).cross(p2 - target);
+                    if(after.dot(before) <= 0.25f * after.length() * before.length())
+                        return false;
+                }
+
+                // every vertex of the group needs a partner on the other side
+                for(auto o = group_offsets[from]; o < group_offsets[from + 1]; ++o)
+                {
+                    const auto *t = &tris[group_tris[o] * 3];
+                    auto v = group[t[0]] == from ? t[0] : (group[t[1]] == from ? t[1] : t[2]);
+                    if(std::find_if(wedges.begin(), wedges.end(), [v](const std::pair<std::uint32_t, std::uint32_t> &p) { return p.first == v; }) == wedges.end())
+                        return false;
+                }
+
+                return !wedges.empty();
+            }
+
+            size_t shared_triangles(std::uint32_t from, std::uint32_t to) const
+            {
+                size_t shared = 0;
+                for(auto o = group_offsets[from]; o < group_offsets[from + 1]; ++o)
+                {
+                    const auto *t = &tris[group_tris[o] * 3];
+                    if(group[t[0]] == to || group[t[1]] == to || group[t[2]] == to)
+                        ++shared;
+                }
+                return shared;
+            }
+
+            // One round of non-overlapping collapses, cheapest first. Returns false when
+            // nothing could be collapsed.
+            bool pass(size_t target_tris, double max_cost)
+            {
+                build_adjacency();
+
+                std::vector<std::pair<std::uint32_t, std::uint32_t>> edges;
+                edges.reserve(tris.size());
+                for(size_t i = 0; i < tris.size(); i += 3)
+                {
+                    for(int k = 0; k < 3; ++k)
+                    {
+                        auto a = group[tris[i + k]], b = group[tris[i + (k + 1) % 3]];
+                        edges.push_back(std::make_pair(std::min(a, b), std::max(a, b)));
+                    }
+                }
+                std::sort(edges.begin(), edges.end());
+                edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+                std::vector<Collapse> collapses;
+                for(const auto &e : edges)
+                {
+                    Collapse best = {0, 0, std::numeric_limits<double>::max()};
+                    for(int dir = 0; dir < 2; ++dir)
+                    {
+                        auto from = dir ? e.second : e.first, to = dir ? e.first : e.second;
+                        if(kind[from] != FREE)
+                            continue;
+
+                        Quadric q = quadrics[from];
+                        q += quadrics[to];
+                        double cost = q.error(group_position(to));
+                        if(cost < best.cost && cost <= max_cost && plan(from, to))
+                            best = Collapse{from, to, cost};
+                    }
+                    if(best.cost <= max_cost)
+                        collapses.push_back(best);
+                }
+
+                std::sort(collapses.begin(), collapses.end(), [](const Collapse &a, const Collapse &b) { return a.cost < b.cost; });
+
+                // a collapse moves the triangles around its source, so their vertices wait
+                // for the next pass
+                std::vector<char> touched(group_vertex.size(), 0);
+                size_t tri_count = tris.size() / 3;
+                bool collapsed = false;
+
+                for(const auto &c : collapses)
+                {
+                    if(tri_count <= target_tris)
+                        break;
+                    if(touched[c.from] || touched[c.to])
+                        continue;
+
+                    plan(c.from, c.to);
+                    for(const auto &w : wedges)
+                        remap[w.first] = w.second;
+
+                    tri_count -= shared_triangles(c.from, c.to);
+                    for(auto o = group_offsets[c.from]; o < group_offsets[c.from + 1]; ++o)
+                    {
+                        const auto *t = &tris[group_tris[o] * 3];
+                        touched[group[t[0]]] = touched[group[t[1]]] = touched[group[t[2]]] = 1;
+                    }
+
+                    quadrics[c.to] += quadrics[c.from];
+                    worst = std::max(worst, c.cost);
+                    collapsed = true;
+                }
+
+                if(!collapsed)
+                    return false;
+
+                // moved vertices, then drop the triangles that lost their area
+                size_t out = 0;
+                for(size_t i = 0; i < tris.size(); i += 3)
+                {
+                    std::uint32_t a = remap[tris[i]], b = remap[tris[i + 1]], d = remap[tris[i + 2]];
+                    if(group[a] == group[b] || group[b] == group[d] || group[a] == group[d])
+                        continue;
+                    tris[out++] = a;
+                    tris[out++] = b;
+                    tris[out++] = d;
+                }
+                tris.resize(out);
+                return true;
+            }
+
+        public:
+            template<typename Position>
+            Simplifier(const std::uint32_t *indices, size_t index_count, size_t vertex_count, Position position):
+            positions(vertex_count), remap(vertex_count), extent(0.0), worst(0.0), movable(false)
+            {
+                for(size_t v = 0; v < vertex_count; ++v)
+                {
+                    positions[v] = position(std::uint32_t(v));
+                    remap[v] = std::uint32_t(v);
+                }
+
+                build_groups();
+
+                tris.reserve(index_count);
+                for(size_t i = 0; i + 2 < index_count; i += 3)
+                {
+                    auto a = indices[i], b = indices[i + 1], d = indices[i + 2];
+                    if(group[a] == group[b] || group[b] == group[d] || group[a] == group[d])
+                        continue;
+                    tris.push_back(a);
+                    tris.push_back(b);
+                    tris.push_back(d);
+                }
+
+                classify();
+                build_quadrics();
+
+                if(vertex_count)
+                {
+                    auto lo = positions[0], hi = positions[0];
+                    for(const auto &p : positions)
+                    {
+                        lo.x = std::min(lo.x, p.x); lo.y = std::min(lo.y, p.y); lo.z = std::min(lo.z, p.z);
+                        hi.x = std::max(hi.x, p.x); hi.y = std::max(hi.y, p.y); hi.z = std::max(hi.z, p.z);
+                    }
+                    extent = (hi - lo).length();
+                }
+            }
+
+            // Collapses until at most target_index_count indices are left or the next collapse
+            // would exceed max_error. Can be called again with a smaller target.
+            void simplify(size_t target_index_count, float max_error)
+            {
+                double limit = double(max_error) * extent;
+                double max_cost = limit * limit;
+                while(movable && tris.size() > target_index_count && pass(target_index_count / 3, max_cost))
+                    ;
+            }
+
+            const std::vector<std::uint32_t> &indices() const { return tris; }
+
+            float error() const
+            {
+                return extent > 0.0 ? float(std::sqrt(worst) / extent) : 0.0f;
+            }
+        };
+    }
+
+    // Simplified copy of an index list. position(v) gives the position of vertex v.
+    // result_error receives the error of the result.
+    template<typename Position>
+    std::vector<std::uint32_t> simplify_indices(const std::uint32_t *indices, size_t index_count, size_t vertex_count, Position position,
+                                                size_t target_index_count, float max_error = 1.0f, float *result_error = nullptr)
+    {
+        detail::Simplifier s(indices, index_count, vertex_count, position);
+        s.simplify(target_index_count, max_error);
+        if(result_error)
+            *result_error = s.error();
+        return s.indices();
+    }
+
+    // Levels at the given fractions of the full triangle count, finest first. Each level
+    // continues from the one before it; a level that saves less than a twentieth of the
+    // triangles before it ends the chain.
+    template<typename Position>
+    std::vector<Mesh_Lod> build_lod_chain(const std::uint32_t *indices, size_t index_count, size_t vertex_count, Position position,
+                                          std::vector<float> ratios, float max_error = 1.0f)
+    {
+        std::vector<Mesh_Lod> lods;
+        std::sort(ratios.begin(), ratios.end(), [](float a, float b) { return a > b; });
+
+        detail::Simplifier s(indices, index_count, vertex_count, position);
+        size_t previous = index_count;
+        for(auto ratio : ratios)
+        {
+            size_t target = size_t(double(index_count / 3) * std::max(0.0f, std::min(ratio, 1.0f))) * 3;
+            s.simplify(target, max_error);
+            if(s.indices().size() > previous - previous / 20)
+                break;
+
+            Mesh_Lod lod;
+            lod.indices = s.indices();
+            lod.error = s.error();
+            previous = lod.indices.size();
+            lods.push_back(std::move(lod));
+        }
+        return lods;
+    }
+
+    // Fills m.lods; meshes without indices or vertices are left alone
+    inline void generate_lods(Mesh &m, const std::vector<float> &ratios, float max_error = 1.0f)
+    {
+        m.lods.clear();
+        if(!m.indexed() || m.v.empty())
+            return;
+
+        std::vector<std::uint32_t> indices(m.index_count());
+        for(size_t i = 0; i < indices.size(); ++i)
+            indices[i] = m.index(i);
+
+        const auto &v = m.v;
+        m.lods = build_lod_chain(indices.data(), indices.size(), v.size(), [&v](std::uint32_t i) { return v[i]; }, ratios, max_error);
+    }
+
+    // Every submesh of o on its own worker
+    inline void generate_lods(Obj &o, const std::vector<float> &ratios, float max_error = 1.0f)
+    {
+        parallel_for(o.meshes.size(), [&](size_t i)
+        {
+            generate_lods(o.meshes[i], ratios, max_error);
+        });
+    }
+
+    // Finest level whose error covers no more than pixel_error pixels when the mesh is
+    // screen_size pixels across: 0 is the full mesh, i the (i - 1)th entry of lods
+    inline size_t select_lod(const std::vector<Mesh_Lod> &lods, float screen_size, float pixel_error = 1.0f)
+    {
+        size_t level = 0;
+        for(size_t i = 0; i < lods.size(); ++i)
+        {
+            if(lods[i].error * screen_size > pixel_error)
+                break;
+            level = i + 1;
+        }
+        return level;
+    }
+
+    // Pixels across a sphere of the given radius (half the bounding box diagonal) at distance
+    // from a perspective camera with vertical field of view fov_y, for select_lod
+    inline float lod_screen_size(float radius, float distance, float fov_y, float viewport_height)
+    {
+        if(distance <= radius)
+            return std::numeric_limits<float>::max();
+        return 2.0f * radius / (distance * std::tan(fov_y * 0.5f)) * viewport_height * 0.5f;
+    }
+}
+
+#endif  // KNU_MESH_SIMPLIFIER
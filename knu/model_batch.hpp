@@ -0,0 +1,466 @@
+#ifndef KNU_MODEL_BATCH
+#define KNU_MODEL_BATCH
+
+// Draws every instance of many models with one glMultiDrawElementsIndirect call.
+// The models share one vertex buffer (position, texture coordinate and normal interleaved)
+// and one index buffer, both grown on the GPU as models are added. Each instance owns a
+// slot in the command buffer and a transform in a shader storage buffer. A culled instance
+// keeps its slot with an instance count of zero, so culling on the CPU or in a compute
+// shader writes commands in place without compacting them.
+// The vertex shader finds its transform through an instanced attribute that reads back the
+// command's base_instance (GL 4.3, no draw parameters extension needed):
+//
+//     layout(location = 3) in uint instance;
+//     layout(std430, binding = 0) readonly buffer Transforms { mat4 transforms[]; };
+//     vec4 world = transforms[instance] * vec4(position, 1.0);
+//
+// Transforms follow the library's convention (p' = p * m) and are stored as they are,
+// which GLSL reads transposed, hence the multiplication from the left in the shader.
+
+#ifdef __APPLE__
+#include <OpenGL/gl3.h>
+#include <OpenGL/gl3ext.h>
+#endif
+
+#ifdef WIN32
+#include <Windows.h>
+#include <GL/glew.h>
+#endif
+
+#include <knu/shaderlocations.h>
+#include <knu/obj.hpp>
+#include <knu/mesh_meshlets.hpp>
+#include <knu/mesh_simplifier.hpp>
+#include <knu/parallel.hpp>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <limits>
+#include <cstdint>
+#include <cmath>
+#include <stdexcept>
+
+namespace knu
+{
+    namespace graphics
+    {
+        class model_batch
+        {
+        public:
+            // Laid out as GL expects in a GL_DRAW_INDIRECT_BUFFER
+            struct draw_command
+            {
+                GLuint count, instance_count, first_index;
+                GLint base_vertex;
+                GLuint base_instance;
+            };
+
+        private:
+            struct lod
+            {
+                GLuint first_index, count;
+                float error;        // relative to the bounding box diagonal
+            };
+
+            struct model
+            {
+                GLint base_vertex;
+                std::vector<lod> lods;      // full detail first
+                knu::math::v3f center;
+                float radius;               // half the bounding box diagonal
+            };
+
+            static const size_t VERTEX_BYTES = 32;
+
+            std::vector<model> models;
+            std::vector<size_t> instance_models;
+            std::vector<knu::math::m4f> transforms;
+
+            // geometry added since the last upload
+            std::vector<char> staged_vertices;
+            std::vector<std::uint32_t> staged_indices;
+            size_t vertex_count, index_count, uploaded_vertex_bytes, uploaded_indices, uploaded_instances;
+
+            GLuint vao, vertex_buffer, index_buffer, instance_buffer, transform_buffer, command_buffer;
+            GLuint instance_location, transform_binding;
+            bool transforms_dirty;
+
+        private:
+            // Replaces buffer with one holding its first used bytes followed by data
+            static void append_buffer(GLuint &buffer, size_t used, const void *data, size_t bytes)
+            {
+                GLuint grown = 0;
+                glGenBuffers(1, &grown);
+                glBindBuffer(GL_COPY_WRITE_BUFFER, grown);
+                glBufferData(GL_COPY_WRITE_BUFFER, used + bytes, nullptr, GL_STATIC_DRAW);
+
+                if(buffer)
+                {
+                    glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+                    if(used)
+                        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, used);
+                    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+                    glDeleteBuffers(1, &buffer);
+                }
+
+                glBufferSubData(GL_COPY_WRITE_BUFFER, used, bytes, data);
+                glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+                buffer = grown;
+            }
+
+            void setup_vao()
+            {
+                if(!vao)
+                    glGenVertexArrays(1, &vao);
+
+                glBindVertexArray(vao);
+                glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+                glVertexAttribPointer((int)AttributeLocations::posAttrib, 3, GL_FLOAT, GL_FALSE, VERTEX_BYTES, (GLvoid *)0);
+                glVertexAttribPointer((int)AttributeLocations::texcAttrib, 2, GL_FLOAT, GL_FALSE, VERTEX_BYTES, (GLvoid *)12);
+                glVertexAttribPointer((int)AttributeLocations::normAttrib, 3, GL_FLOAT, GL_FALSE, VERTEX_BYTES, (GLvoid *)20);
+                glEnableVertexAttribArray((int)AttributeLocations::posAttrib);
+                glEnableVertexAttribArray((int)AttributeLocations::texcAttrib);
+                glEnableVertexAttribArray((int)AttributeLocations::normAttrib);
+
+                glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+                glVertexAttribIPointer(instance_location, 1, GL_UNSIGNED_INT, sizeof(GLuint), (GLvoid *)0);
+                glVertexAttribDivisor(instance_location, 1);
+                glEnableVertexAttribArray(instance_location);
+
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);     // recorded in the vao
+                glBindVertexArray(0);
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+            }
+
+            void upload_instances()
+            {
+                size_t count = instance_models.size();
+                std::vector<GLuint> ids(count);
+                for(size_t i = 0; i < count; ++i)
+                    ids[i] = GLuint(i);
+
+                std::vector<draw_command> commands(count);
+                for(size_t i = 0; i < count; ++i)
+                    commands[i] = command(i, 0);
+
+                if(!instance_buffer)
+                {
+                    glGenBuffers(1, &instance_buffer);
+                    glGenBuffers(1, &transform_buffer);
+                    glGenBuffers(1, &command_buffer);
+                }
+
+                glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+                glBufferData(GL_ARRAY_BUFFER, count * sizeof(GLuint), ids.data(), GL_STATIC_DRAW);
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, transform_buffer);
+                glBufferData(GL_SHADER_STORAGE_BUFFER, count * sizeof(knu::math::m4f), transforms.data(), GL_DYNAMIC_DRAW);
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+                glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer);
+                glBufferData(GL_DRAW_INDIRECT_BUFFER, count * sizeof(draw_command), commands.data(), GL_DYNAMIC_DRAW);
+                glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+                uploaded_instances = count;
+                transforms_dirty = false;
+            }
+
+            // Largest scale the transform applies to a direction
+            static float max_scale(const knu::math::m4f &m)
+            {
+                float scale = 0.0f;
+                for(int row = 0; row < 3; ++row)
+                    scale = std::max(scale, m[row * 4] * m[row * 4] + m[row * 4 + 1] * m[row * 4 + 1] + m[row * 4 + 2] * m[row * 4 + 2]);
+                return std::sqrt(scale);
+            }
+
+        public:
+            // instance_location is the attribute the vertex shader reads its instance from,
+            // transform_binding the shader storage binding of the transforms
+            explicit model_batch(GLuint instance_location_ = 3, GLuint transform_binding_ = 0):
+            vertex_count(0), index_count(0), uploaded_vertex_bytes(0), uploaded_indices(0), uploaded_instances(0),
+            vao(0), vertex_buffer(0), index_buffer(0), instance_buffer(0), transform_buffer(0), command_buffer(0),
+            instance_location(instance_location_), transform_binding(transform_binding_), transforms_dirty(false)
+            {
+            }
+
+            ~model_batch()
+            {
+                GLuint buffers[] = {vertex_buffer, index_buffer, instance_buffer, transform_buffer, command_buffer};
+                for(auto buffer : buffers)
+                {
+                    if(buffer)
+                        glDeleteBuffers(1, &buffer);
+                }
+
+                if(vao)
+                    glDeleteVertexArrays(1, &vao);
+            }
+
+            // No copy constructor or assignment
+            model_batch(const model_batch &) = delete;
+            model_batch &operator=(const model_batch &) = delete;
+
+            // Adds every submesh of o as one model and returns its index. Levels of detail
+            // come from the meshes' lods; a submesh with fewer levels repeats its coarsest.
+            size_t add_model(const Obj &o)
+            {
+                model m;
+                m.base_vertex = GLint(vertex_count);
+
+                // vertices, with the first vertex of each submesh in the model
+                std::vector<size_t> first_vertex(o.meshes.size() + 1, 0);
+                for(size_t i = 0; i < o.meshes.size(); ++i)
+                    first_vertex[i + 1] = first_vertex[i] + o.meshes[i].vertex_count();
+
+                size_t first_byte = staged_vertices.size();
+                staged_vertices.resize(first_byte + first_vertex.back() * VERTEX_BYTES);
+                for(size_t i = 0; i < o.meshes.size(); ++i)
+                {
+                    size_t count = o.meshes[i].vertex_count();
+                    if(count)
+                        o.write_mesh_vertices(i, &staged_vertices[first_byte + first_vertex[i] * VERTEX_BYTES], Vertex_Layout::interleaved(ObjFormat::Ver_Tex_Nor, count));
+                }
+
+                knu::math::v3f lo(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+                knu::math::v3f hi(-lo.x, -lo.y, -lo.z);
+                for(size_t v = 0; v < first_vertex.back(); ++v)
+                {
+                    const auto *p = reinterpret_cast<const float *>(&staged_vertices[first_byte + v * VERTEX_BYTES]);
+                    lo.x = std::min(lo.x, p[0]); lo.y = std::min(lo.y, p[1]); lo.z = std::min(lo.z, p[2]);
+                    hi.x = std::max(hi.x, p[0]); hi.y = std::max(hi.y, p[1]); hi.z = std::max(hi.z, p[2]);
+                }
+                if(!first_vertex.back())
+                    lo = hi = knu::math::v3f();
+                m.center = (lo + hi) * 0.5f;
+                m.radius = (hi - lo).length() * 0.5f;
+
+                // each level is the submeshes' index lists back to back
+                size_t levels = 1;
+                for(const auto &mesh : o.meshes)
+                    levels = std::max(levels, mesh.lods.size() + 1);
+
+                for(size_t level = 0; level < levels; ++level)
+                {
+                    lod l = {GLuint(index_count + staged_indices.size()), 0, 0.0f};
+                    for(size_t i = 0; i < o.meshes.size(); ++i)
+                    {
+                        const auto &mesh = o.meshes[i];
+                        auto base = std::uint32_t(first_vertex[i]);
+                        size_t mesh_level = std::min(level, mesh.lods.size());
+
+                        if(mesh_level)
+                        {
+                            const auto &coarse = mesh.lods[mesh_level - 1];
+                            for(auto index : coarse.indices)
+                                staged_indices.push_back(base + index);
+                            l.error = std::max(l.error, coarse.error);
+                        }
+                        else if(mesh.indexed())
+                        {
+                            for(size_t k = 0; k < mesh.index_count(); ++k)
+                                staged_indices.push_back(base + mesh.index(k));
+                        }
+                        else
+                        {
+                            for(size_t k = 0; k < mesh.vertex_count(); ++k)
+                                staged_indices.push_back(base + std::uint32_t(k));
+                        }
+                    }
+                    l.count = GLuint(index_count + staged_indices.size() - l.first_index);
+                    m.lods.push_back(l);
+                }
+
+                vertex_count += first_vertex.back();
+                models.push_back(std::move(m));
+                return models.size() - 1;
+            }
+
+            // Loads modelname.obj/.mtl the way Model_Obj does, through the mesh cache, with
+            // levels of detail at lod_ratios
+            size_t add_model(const std::string &model_name, std::vector<float> lod_ratios = std::vector<float>())
+            {
+                return add_model(Obj(model_name + ".mtl", model_name + ".obj", Model_Obj::load_options(std::move(lod_ratios))));
+            }
+
+            size_t add_instance(size_t model_index, const knu::math::m4f &transform)
+            {
+                if(model_index >= models.size())
+                    throw std::runtime_error("model_batch::add_instance() - no such model");
+
+                instance_models.push_back(model_index);
+                transforms.push_back(transform);
+                return instance_models.size() - 1;
+            }
+
+            void set_transform(size_t instance, const knu::math::m4f &transform)
+            {
+                transforms[instance] = transform;
+                transforms_dirty = true;
+            }
+
+            const knu::math::m4f &get_transform(size_t instance) const
+            {
+                return transforms[instance];
+            }
+
+            size_t model_count() const
+            {
+                return models.size();
+            }
+
+            size_t instance_count() const
+            {
+                return instance_models.size();
+            }
+
+            size_t lod_count(size_t model_index) const
+            {
+                return models[model_index].lods.size();
+            }
+
+            // The command that draws instance at the level of detail (clamped to its coarsest)
+            draw_command command(size_t instance, size_t level) const
+            {
+                const auto &m = models[instance_models[instance]];
+                const auto &l = m.lods[std::min(level, m.lods.size() - 1)];
+                return draw_command{l.count, 1, l.first_index, m.base_vertex, GLuint(instance)};
+            }
+
+            // Bounding sphere of instance in world space
+            void bounds(size_t instance, knu::math::v3f &center, float &radius) const
+            {
+                const auto &m = models[instance_models[instance]];
+                const auto &t = transforms[instance];
+                auto c = knu::math::v4f(m.center.x, m.center.y, m.center.z, 1.0f) * t;
+                center = knu::math::v3f(c.x, c.y, c.z);
+                radius = m.radius * max_scale(t);
+            }
+
+            // Sends the models and instances added since the last upload to the GPU. Adding
+            // instances rewrites the command buffer with every instance at full detail.
+            // draw() uploads on its own as well.
+            void upload()
+            {
+                bool geometry = !staged_vertices.empty() || !staged_indices.empty();
+                if(geometry)
+                {
+                    append_buffer(vertex_buffer, uploaded_vertex_bytes, staged_vertices.data(), staged_vertices.size());
+                    append_buffer(index_buffer, uploaded_indices * sizeof(std::uint32_t), staged_indices.data(), staged_indices.size() * sizeof(std::uint32_t));
+                    uploaded_vertex_bytes += staged_vertices.size();
+                    uploaded_indices += staged_indices.size();
+                    index_count += staged_indices.size();
+                    std::vector<char>().swap(staged_vertices);
+                    std::vector<std::uint32_t>().swap(staged_indices);
+                }
+
+                bool instances = uploaded_instances != instance_models.size() || !instance_buffer;
+                if(instances)
+                    upload_instances();
+                else if(transforms_dirty)
+                {
+                    glBindBuffer(GL_SHADER_STORAGE_BUFFER, transform_buffer);
+                    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, transforms.size() * sizeof(knu::math::m4f), transforms.data());
+                    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+                    transforms_dirty = false;
+                }
+
+                if(geometry || instances)
+                    setup_vao();
+            }
+
+            // The command buffer, one draw_command per instance, e.g. for a culling compute
+            // shader to bind as a shader storage buffer
+            GLuint commands() const
+            {
+                return command_buffer;
+            }
+
+            // Maps the command buffer for writing every instance's command; the previous
+            // contents are discarded
+            draw_command *map_commands()
+            {
+                upload();
+                if(instance_models.empty())
+                    return nullptr;
+
+                glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer);
+                auto commands = glMapBufferRange(GL_DRAW_INDIRECT_BUFFER, 0, instance_models.size() * sizeof(draw_command),
+                                                 GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+                if(!commands)
+                    throw std::runtime_error("model_batch::map_commands() - unable to map the command buffer");
+                return static_cast<draw_command *>(commands);
+            }
+
+            void unmap_commands()
+            {
+                glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer);
+                glUnmapBuffer(GL_DRAW_INDIRECT_BUFFER);
+                glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+            }
+
+            // Writes the command buffer for a frame: instances outside the frustum draw
+            // nothing, the others draw the coarsest level whose error stays within
+            // pixel_error pixels. fov_y is in radians; view_proj maps world space to clip
+            // space (clip = v * view_proj).
+            void cull(const knu::math::m4f &view_proj, const knu::math::v3f &camera_position, float fov_y, float viewport_height, float pixel_error = 1.0f)
+            {
+                auto commands = map_commands();
+                if(!commands)
+                    return;
+
+                Meshlet_Frustum frustum(view_proj, camera_position);
+                parallel_for_ranges(instance_models.size(), [&](size_t begin, size_t end)
+                {
+                    for(size_t i = begin; i < end; ++i)
+                    {
+                        knu::math::v3f center;
+                        float radius;
+                        bounds(i, center, radius);
+
+                        bool inside = true;
+                        for(int p = 0; p < 6 && inside; ++p)
+                        {
+                            const auto &plane = frustum.planes[p];
+                            inside = plane[0] * center.x + plane[1] * center.y + plane[2] * center.z + plane[3] >= -radius;
+                        }
+
+                        auto c = command(i, 0);
+                        if(!inside)
+                            c.instance_count = 0;
+                        else
+                        {
+                            const auto &lods = models[instance_models[i]].lods;
+                            float screen_size = lod_screen_size(radius, (center - camera_position).length(), fov_y, viewport_height);
+                            size_t level = 0;
+                            while(level + 1 < lods.size() && lods[level + 1].error * screen_size <= pixel_error)
+                                ++level;
+                            c = command(i, level);
+                        }
+                        commands[i] = c;
+                    }
+                }, 1024);
+
+                unmap_commands();
+            }
+
+            // Every instance as the command buffer says, with one vao bind and one call
+            void draw()
+            {
+                upload();
+                if(instance_models.empty())
+                    return;
+
+                glBindVertexArray(vao);
+                glBindBufferBase(GL_SHADER_STORAGE_BUFFER, transform_binding, transform_buffer);
+                glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer);
+                glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, nullptr, (GLsizei)instance_models.size(), 0);
+                glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+                glBindVertexArray(0);
+            }
+        };
+    }
+}
+
+#endif  // KNU_MODEL_BATCH
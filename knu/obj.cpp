@@ -12,8 +12,26 @@
 #include <iostream>
 #include <stdexcept>
 #include <future>
-#include <sstream>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <cmath>
 #include <knu/shaderlocations.h>
+#include <knu/mapped_file.hpp>
+#include <knu/parallel.hpp>
+#include <knu/mesh_cache.hpp>
+#include <knu/mesh_optimizer.hpp>
+#include <knu/mesh_simplifier.hpp>
+#include <knu/mesh_normals.hpp>
+#include <knu/mesh_meshlets.hpp>
+#include <knu/file_watch.hpp>
+#include <knu/material_library.hpp>
 
 #include "obj.hpp"
 
@@ -21,560 +39,1888 @@ using namespace std;
 using namespace knu;
 
 
-const string MAT_STRING_REP = "(\\.mtl)";
-const string OBJ_STRING_REP = "(.obj)";
-
-const string MAT_COUNT = "(Count)";
-const string MAT_NAME = "newmtl (\\w+)";
-const string MAT_AMBIENT =	"Ka ([-+]?[0-9]*\\.?[0-9]*) ([-+]?[0-9]*\\.?[0-9]*) ([-+]?[0-9]*\\.?[0-9]*)";
-const string MAT_DIFFUSE =	"Kd ([-+]?[0-9]*\\.?[0-9]*) ([-+]?[0-9]*\\.?[0-9]*) ([-+]?[0-9]*\\.?[0-9]*)";
-const string MAT_SPECULAR = "Ks ([-+]?[0-9]*\\.?[0-9]*) ([-+]?[0-9]*\\.?[0-9]*) ([-+]?[0-9]*\\.?[0-9]*)";
-const string MAT_SPECULAR_EXPONENT = "Ns ([-+]?[0-9]*\\.?[0-9]*)";
-const string MAT_OPACITY = "d ([-+]?[0-9]*\\.?[0-9]*)";
-const string MAT_DIFFUSE_TEXTURE = "map_Kd (\\w+\\.\\w+)";
-const string MAT_AMBIENT_TEXTURE = "map_Ka";
-
-const string OBJ_NEW_MESH = "o (\\w+)";
-const string OBJ_VERTEX = "v ([-+]?[0-9]*\\.?[0-9]*) ([-+]?[0-9]*\\.?[0-9]*) ([-+]?[0-9]*\\.?[0-9]*)";
-const string OBJ_TEXTURE = "vt ([-+]?[0-9]*\\.?[0-9]*) ([-+]?[0-9]*\\.?[0-9]*)";
-const string OBJ_NORMAL = "vn ([-+]?[0-9]*\\.?[0-9]*) ([-+]?[0-9]*\\.?[0-9]*) ([-+]?[0-9]*\\.?[0-9]*)";
-
-const string OBJ_USE_MATERIAL = "usemtl (\\w+)";
-const string OBJ_FACE_0 = "f (\\d+) (\\d+) (\\d+)";         // 3 indices per line (triangle) | vertex only
-const string OBJ_FACE_1 = "f (\\d+) (\\d+) (\\d+) (\\d+)";       // 4 indices per line (Quad) | vertex only
-const string OBJ_FACE_2 = "f (\\d+)/(\\d+)/(\\d+) (\\d+)/(\\d+)/(\\d+) (\\d+)/(\\d+)/(\\d+)";    // vertex/texture/normal
-const string OBJ_FACE_3 = "f (\\d+)//(\\d+) (\\d+)//(\\d+) (\\d+)//(\\d+)";		// vertex//normal x 3
-const string OBJ_FACE_4 = "f (\\d+)/(\\d+) (\\d+)/(\\d+) (\\d+)/(\\d+)";		// vertex/texture
-
-
-void Obj_Reader::register_handlers()
-{
-    mat_matches[MAT_COUNT] = &Obj_Reader::mat_count_handler;
-    mat_matches[MAT_NAME] = &Obj_Reader::mat_name_handler;
-    mat_matches[MAT_AMBIENT] = &Obj_Reader::mat_ambient_handler;
-    mat_matches[MAT_DIFFUSE] = &Obj_Reader::mat_diffuse_handler;
-    mat_matches[MAT_SPECULAR] = &Obj_Reader::mat_specular_handler;
-    mat_matches[MAT_SPECULAR_EXPONENT] = &Obj_Reader::mat_specular_exponent_handler;
-    mat_matches[MAT_OPACITY] = &Obj_Reader::mat_opacity_handler;
-    mat_matches[MAT_DIFFUSE_TEXTURE] = &Obj_Reader::mat_diffuse_texture_handler;
-    
-    obj_matches[OBJ_NEW_MESH] = &Obj_Reader::obj_new_mesh_handler;
-    obj_matches[OBJ_VERTEX] = &Obj_Reader::obj_vertex_handler;
-    obj_matches[OBJ_TEXTURE] = &Obj_Reader::obj_texture_handler;
-    obj_matches[OBJ_NORMAL] = &Obj_Reader::obj_normal_handler;
-    obj_matches[OBJ_USE_MATERIAL] = &Obj_Reader::obj_add_mat_to_mesh_handler;
-    obj_matches[OBJ_FACE_0] = &Obj_Reader::obj_face_handler;
-    obj_matches[OBJ_FACE_1] = &Obj_Reader::obj_face_handler;
-    obj_matches[OBJ_FACE_2] = &Obj_Reader::obj_face_handler;
-	obj_matches[OBJ_FACE_3] = &Obj_Reader::obj_face_handler;
-    obj_matches[OBJ_FACE_4] = &Obj_Reader::obj_face_handler;
-}
-
-Obj_Reader::Obj_Reader(string material_path, string obj_path)
-{
-    register_handlers();
-    try
+namespace
+{
+    // Pieces a watched .obj is parsed in
+    const size_t PROGRESS_CHUNK_BYTES = 4 << 20;
+    
+    void check_cancelled(const Obj_Options &options)
+    {
+        if(options.progress && options.progress->cancelled)
+            throw Obj_Load_Cancelled();
+    }
+    
+    typedef std::chrono::steady_clock Load_Clock;
+    
+    // Adds the time since start to a phase of a timed load and starts the next phase
+    void end_phase(const Obj_Options &options, double Obj_Load_Timings::*phase, Load_Clock::time_point &start)
+    {
+        auto now = Load_Clock::now();
+        if(options.timings)
+            (*options.timings).*phase += std::chrono::duration<double>(now - start).count();
+        start = now;
+    }
+    
+    // Tokenizing helpers. All of them work on [p, end) ranges inside the mapped file.
+    
+    inline bool is_space(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+    
+    inline const char *skip_space(const char *p, const char *end)
+    {
+        while(p < end && is_space(*p))
+            ++p;
+        return p;
+    }
+    
+    inline const char *skip_token(const char *p, const char *end)
+    {
+        while(p < end && !is_space(*p))
+            ++p;
+        return p;
+    }
+    
+    inline const char *line_end(const char *p, const char *end)
+    {
+        auto eol = static_cast<const char *>(memchr(p, '\n', end - p));
+        return eol ? eol : end;
+    }
+    
+    // True when [p, end) starts with the token t followed by whitespace or the end of the line
+    inline bool is_token(const char *p, const char *end, const char *t)
+    {
+        while(*t)
+        {
+            if(p == end || *p != *t)
+                return false;
+            ++p;
+            ++t;
+        }
+        return p == end || is_space(*p);
+    }
+    
+    // The rest of the line after the keyword, trimmed
+    inline string rest_of_line(const char *p, const char *end)
+    {
+        p = skip_space(skip_token(p, end), end);
+        while(end > p && is_space(end[-1]))
+            --end;
+        return string(p, end);
+    }
+    
+    // First word after the keyword
+    inline string first_word(const char *p, const char *end)
+    {
+        p = skip_space(skip_token(p, end), end);
+        return string(p, skip_token(p, end));
+    }
+    
+    const double POWERS_OF_TEN[] =
+    {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    
+    // Decimal float in the forms OBJ/MTL writers produce ([+-]digits[.digits][e[+-]digits]).
+    // Up to 19 significant digits are kept; the scale is applied in double, so results match
+    // strtof for everything but pathological inputs.
+    inline const char *parse_float(const char *p, const char *end, float &out)
+    {
+        p = skip_space(p, end);
+        
+        bool negative = false;
+        if(p < end && (*p == '-' || *p == '+'))
+        {
+            negative = *p == '-';
+            ++p;
+        }
+        
+        uint64_t mantissa = 0;
+        int significant = 0;
+        int exponent = 0;
+        
+        while(p < end && unsigned(*p - '0') < 10)
+        {
+            if(significant < 19)
+            {
+                mantissa = mantissa * 10 + unsigned(*p - '0');
+                if(mantissa)
+                    ++significant;
+            }
+            else
+                ++exponent;
+            ++p;
+        }
+        
+        if(p < end && *p == '.')
+        {
+            ++p;
+            while(p < end && unsigned(*p - '0') < 10)
+            {
+                if(significant < 19)
+                {
+                    mantissa = mantissa * 10 + unsigned(*p - '0');
+                    if(mantissa)
+                        ++significant;
+                    --exponent;
+                }
+                ++p;
+            }
+        }
+        
+        if(p < end && (*p == 'e' || *p == 'E'))
+        {
+            ++p;
+            bool negative_exponent = false;
+            if(p < end && (*p == '-' || *p == '+'))
+            {
+                negative_exponent = *p == '-';
+                ++p;
+            }
+            
+            int e = 0;
+            while(p < end && unsigned(*p - '0') < 10)
+            {
+                if(e < 10000)
+                    e = e * 10 + (*p - '0');
+                ++p;
+            }
+            exponent += negative_exponent ? -e : e;
+        }
+        
+        double value = double(mantissa);
+        if(exponent < 0)
+            value = exponent >= -22 ? value / POWERS_OF_TEN[-exponent] : value * pow(10.0, exponent);
+        else if(exponent > 0)
+            value = exponent <= 22 ? value * POWERS_OF_TEN[exponent] : value * pow(10.0, exponent);
+        
+        out = float(negative ? -value : value);
+        return p;
+    }
+    
+    inline const char *parse_int(const char *p, const char *end, int &out)
+    {
+        bool negative = false;
+        if(p < end && (*p == '-' || *p == '+'))
+        {
+            negative = *p == '-';
+            ++p;
+        }
+        
+        // saturates instead of overflowing, so huge indices stay out of range
+        int value = 0;
+        while(p < end && unsigned(*p - '0') < 10)
+        {
+            value = value <= (INT_MAX - 9) / 10 ? value * 10 + (*p - '0') : INT_MAX;
+            ++p;
+        }
+        
+        out = negative ? -value : value;
+        return p;
+    }
+    
+    const int MAX_FACE_CORNERS = 64;
+    
+    // What an .obj line holds, told by its first token; line starts past the indentation
+    enum class Obj_Statement
+    {
+        other,
+        vertex,
+        tex_coord,
+        normal,
+        face,
+        object,
+        material
+    };
+    
+    inline Obj_Statement classify_line(const char *line, const char *end)
+    {
+        if(end - line < 2)
+            return Obj_Statement::other;
+        
+        switch(line[0])
+        {
+            case 'v':
+            {
+                if(is_space(line[1]))
+                    return Obj_Statement::vertex;
+                if(line[1] == 't' && (line + 2 == end || is_space(line[2])))
+                    return Obj_Statement::tex_coord;
+                if(line[1] == 'n' && (line + 2 == end || is_space(line[2])))
+                    return Obj_Statement::normal;
+            }break;
+                
+            case 'f':
+            {
+                if(is_space(line[1]))
+                    return Obj_Statement::face;
+            }break;
+                
+            case 'o':
+            {
+                if(is_space(line[1]))
+                    return Obj_Statement::object;
+            }break;
+                
+            case 'u':
+            {
+                if(is_token(line, end, "usemtl"))
+                    return Obj_Statement::material;
+            }break;
+        }
+        
+        return Obj_Statement::other;
+    }
+    
+    // Elements and triangle corners of a piece of the file, counted before it is parsed so
+    // every array is sized once. Face corners are counted by token; a malformed face can
+    // only make the count too large.
+    struct Obj_Counts
+    {
+        size_t vertices = 0, tex_coords = 0, normals = 0, corners = 0;
+    };
+    
+    inline Obj_Counts count_obj_lines(const char *first, const char *last)
     {
-        auto mat_future = async(launch::async, &Obj_Reader::read_material_file, this, material_path);
-        auto obj_future = async(launch::async, &Obj_Reader::read_obj_file, this, obj_path);
+        Obj_Counts counts;
+        
+        for(auto p = first; p < last; )
+        {
+            auto end = line_end(p, last);
+            auto line = skip_space(p, end);
+            p = end + 1;
+            
+            switch(classify_line(line, end))
+            {
+                case Obj_Statement::vertex: ++counts.vertices; break;
+                case Obj_Statement::tex_coord: ++counts.tex_coords; break;
+                case Obj_Statement::normal: ++counts.normals; break;
+                    
+                case Obj_Statement::face:
+                {
+                    size_t count = 0;
+                    for(auto c = skip_space(line + 1, end); c < end && count < MAX_FACE_CORNERS; c = skip_space(c, end))
+                    {
+                        c = skip_token(c, end);
+                        ++count;
+                    }
+                    
+                    if(count >= 3)
+                        counts.corners += (count - 2) * 3;
+                }break;
+                    
+                default: break;
+            }
+        }
+        
+        return counts;
+    }
+    
+    // OBJ indices are 1 based, negative values count back from the latest element;
+    // count is the number of elements of the file up to the face
+    inline int to_index(int index, size_t count)
+    {
+        if(index > 0)
+            return index - 1;
+        if(index < 0)
+            return int(count) + index;
+        return -1;
+    }
+    
+    // Chunk boundaries: count roughly equal pieces, each ending just after a newline
+    inline std::vector<const char *> split_at_lines(const char *first, const char *last, size_t count)
+    {
+        std::vector<const char *> bounds(1, first);
+        size_t size = last - first;
+        
+        for(size_t i = 1; i < count; ++i)
+        {
+            auto p = std::max(first + size * i / count, bounds.back());
+            p = line_end(p, last);
+            if(p < last)
+                ++p;
+            if(p > bounds.back() && p < last)
+                bounds.push_back(p);
+        }
+        
+        bounds.push_back(last);
+        return bounds;
+    }
+}
+
+namespace
+{
+    // Open addressing (linear probing) map from a face corner's v/vt/vn indices to the
+    // welded vertex. Slots hold vertex + 1 so zero means empty; the keys live in a
+    // separate array indexed by vertex.
+    class Corner_Table
+    {
+        std::vector<std::uint32_t> slots;
+        std::vector<Obj_Face> keys;
+        size_t mask;
+        
+        static size_t hash(int v, int t, int n)
+        {
+            std::uint64_t h = std::uint32_t(v) * 0x9E3779B97F4A7C15ull;
+            h ^= (std::uint32_t(t) + 0x7F4A7C15ull) * 0xC2B2AE3D27D4EB4Full;
+            h ^= (std::uint32_t(n) + 0x165667B1ull) * 0x165667B19E3779F9ull;
+            return size_t(h ^ (h >> 29));
+        }
+        
+    public:
+        Corner_Table():mask(0) {}
+        
+        // The distinct corners in the order they were first seen
+        std::vector<Obj_Face> &corners()
+        {
+            return keys;
+        }
+        
+        // Sized for at most corners distinct keys at a load factor of one half
+        void reset(size_t corners)
+        {
+            size_t size = 16;
+            while(size < corners * 2)
+                size <<= 1;
+            
+            slots.assign(size, 0);
+            keys.clear();
+            keys.reserve(corners);
+            mask = size - 1;
+        }
+        
+        std::uint32_t find_or_insert(int v, int t, int n, bool &inserted)
+        {
+            for(size_t i = hash(v, t, n) & mask; ; i = (i + 1) & mask)
+            {
+                auto slot = slots[i];
+                if(!slot)
+                {
+                    keys.push_back(Obj_Face(v, t, n));
+                    slots[i] = std::uint32_t(keys.size());
+                    inserted = true;
+                    return std::uint32_t(keys.size() - 1);
+                }
+                
+                const auto &k = keys[slot - 1];
+                if(k.v_index == v && k.t_index == t && k.n_index == n)
+                {
+                    inserted = false;
+                    return slot - 1;
+                }
+            }
+        }
+    };
+}
+
+// What one piece of the .obj file contributes: its faces and the o/usemtl lines between
+// them, which are replayed in order when the pieces are merged. Its elements are parsed
+// straight into the reader's arrays.
+struct knu::Obj_Chunk
+{
+    struct Event
+    {
+        size_t first_face;      // faces before this index come before the event
+        bool new_object;        // "o" line, otherwise "usemtl"
+        string name;
+    };
+    
+    Obj_Counts counts;
+    size_t v_first, t_first, n_first;       // elements of the chunks before this one
+    Obj_Faces faces;
+    vector<Event> events;
+};
+
+namespace
+{
+    // Walks the statements of [first, last) and hands them to the sink:
+    // vertex/tex_coord/normal(value), face(v, t, n, count) with the raw 1 based (or negative)
+    // indices of each corner, object(name) and material(name).
+    template<typename Sink>
+    void parse_obj_lines(const char *first, const char *last, Sink &sink)
+    {
+        int cv[MAX_FACE_CORNERS], ct[MAX_FACE_CORNERS], cn[MAX_FACE_CORNERS];
+        
+        for(auto p = first; p < last; )
+        {
+            auto end = line_end(p, last);
+            auto line = skip_space(p, end);
+            p = end + 1;
+            
+            float x = 0.0f, y = 0.0f, z = 0.0f;
+            switch(classify_line(line, end))
+            {
+                case Obj_Statement::vertex:
+                {
+                    parse_float(parse_float(parse_float(line + 1, end, x), end, y), end, z);
+                    sink.vertex(knu::math::Vector3f(x, y, z));
+                }break;
+                    
+                case Obj_Statement::tex_coord:
+                {
+                    parse_float(parse_float(line + 2, end, x), end, y);
+                    sink.tex_coord(knu::math::Vector2f(x, y));
+                }break;
+                    
+                case Obj_Statement::normal:
+                {
+                    parse_float(parse_float(parse_float(line + 2, end, x), end, y), end, z);
+                    sink.normal(knu::math::Vector3f(x, y, z));
+                }break;
+                    
+                case Obj_Statement::face:
+                {
+                    // each corner is v, v/t, v//n or v/t/n
+                    int count = 0;
+                    for(auto c = line + 1; count < MAX_FACE_CORNERS; )
+                    {
+                        c = skip_space(c, end);
+                        if(c == end)
+                            break;
+                        
+                        // anything but a number ends the corners; a 0 index is an error for the sink
+                        bool number = unsigned(*c - '0') < 10 || ((*c == '-' || *c == '+') && c + 1 < end && unsigned(c[1] - '0') < 10);
+                        if(!number)
+                            break;
+                        
+                        int v = 0, t = 0, n = 0;
+                        c = parse_int(c, end, v);
+                        
+                        if(c < end && *c == '/')
+                        {
+                            ++c;
+                            if(c < end && *c != '/')
+                                c = parse_int(c, end, t);
+                            
+                            if(c < end && *c == '/')
+                                c = parse_int(c + 1, end, n);
+                        }
+                        
+                        c = skip_token(c, end);
+                        cv[count] = v;
+                        ct[count] = t;
+                        cn[count] = n;
+                        ++count;
+                    }
+                    
+                    if(count >= 3)
+                        sink.face(cv, ct, cn, count);
+                }break;
+                    
+                case Obj_Statement::object:
+                    sink.object(first_word(line, end));
+                    break;
+                    
+                case Obj_Statement::material:
+                    sink.material(first_word(line, end));
+                    break;
+                    
+                default:
+                    break;
+            }
+        }
+    }
+    
+    // Elements are written to their place in the reader's arrays, which were sized from the
+    // counts; indices are resolved against everything before them in the file
+    struct Chunk_Sink
+    {
+        Obj_Reader &reader;
+        Obj_Chunk &chunk;
+        size_t v_count, t_count, n_count;
+        
+        void vertex(const knu::math::Vector3f &v) { reader.vertices[v_count++] = v; }
+        void tex_coord(const knu::math::Vector2f &t) { reader.tex_coords[t_count++] = t; }
+        void normal(const knu::math::Vector3f &n) { reader.normals[n_count++] = n; }
+        
+        // Zero (no index) is only allowed for texture coordinates and normals
+        static int resolve(int index, size_t count, bool required, const char *element)
+        {
+            if(!index && !required)
+                return -1;
+            
+            int i = to_index(index, count);
+            if(i < 0 || size_t(i) >= count)
+                throw runtime_error(string("Obj_Reader - face refers to a ") + element + " that has not been read");
+            return i;
+        }
+        
+        void face(const int *v, const int *t, const int *n, int count)
+        {
+            // polygons are split into a triangle fan
+            for(int i = 1; i + 1 < count; ++i)
+            {
+                const int corner[3] = {0, i, i + 1};
+                for(int k : corner)
+                    chunk.faces.push_back(Obj_Face(resolve(v[k], v_count, true, "vertex"), resolve(t[k], t_count, false, "texture coordinate"),
+                                                   resolve(n[k], n_count, false, "normal")));
+            }
+        }
+        
+        void object(string name)
+        {
+            chunk.events.push_back(Obj_Chunk::Event{chunk.faces.size(), true, std::move(name)});
+        }
+        
+        void material(string name)
+        {
+            chunk.events.push_back(Obj_Chunk::Event{chunk.faces.size(), false, std::move(name)});
+        }
+    };
+    
+    void parse_obj_chunk(const char *first, const char *last, Obj_Reader &reader, Obj_Chunk &chunk)
+    {
+        Chunk_Sink sink = {reader, chunk, chunk.v_first, chunk.t_first, chunk.n_first};
+        parse_obj_lines(first, last, sink);
+    }
+    
+    // Material library statements; unknown ones are skipped
+    void parse_material(const char *first, const char *last, std::vector<Obj_Material> &materials)
+    {
+        for(auto p = first; p < last; )
+        {
+            auto end = line_end(p, last);
+            auto line = skip_space(p, end);
+            p = end + 1;
+        
+            if(line == end)
+                continue;
+        
+            if(is_token(line, end, "newmtl"))
+            {
+                materials.push_back(Obj_Material());
+                materials.back().mat_name = first_word(line, end);
+                continue;
+            }
+        
+            if(*line == '#')
+            {
+                // exporters write "# Material Count: N" up front
+                static const char COUNT[] = "Material Count:";
+                auto found = std::search(line, end, COUNT, COUNT + sizeof(COUNT) - 1);
+                if(found != end)
+                {
+                    int count = 0;
+                    parse_int(skip_space(found + sizeof(COUNT) - 1, end), end, count);
+                    materials.reserve(count > 0 ? count : 0);
+                }
+                continue;
+            }
+        
+            if(materials.empty())
+                continue;
+        
+            auto &m = materials.back();
+            float x = 0.0f, y = 0.0f, z = 0.0f;
+        
+            if(is_token(line, end, "Ka"))
+            {
+                parse_float(parse_float(parse_float(line + 2, end, x), end, y), end, z);
+                m.mat_ambient_color = knu::math::Vector4f(x, y, z, 1.0f);
+            }
+            else if(is_token(line, end, "Kd"))
+            {
+                parse_float(parse_float(parse_float(line + 2, end, x), end, y), end, z);
+                m.mat_diffuse_color = knu::math::Vector4f(x, y, z, 1.0f);
+            }
+            else if(is_token(line, end, "Ks"))
+            {
+                parse_float(parse_float(parse_float(line + 2, end, x), end, y), end, z);
+                m.mat_specular_color = knu::math::Vector4f(x, y, z, 1.0f);
+            }
+            else if(is_token(line, end, "Ns"))
+            {
+                parse_float(line + 2, end, x);
+                m.mat_specular_exponent = x;
+            }
+            else if(is_token(line, end, "d"))
+            {
+                parse_float(line + 1, end, x);
+                m.mat_opacity = x;
+            }
+            else if(is_token(line, end, "map_Kd") || is_token(line, end, "map_Ka"))
+            {
+                // only the file name is kept; textures are looked up next to the model
+                auto name = rest_of_line(line, end);
+                auto slash = name.find_last_of("/\\");
+                if(slash != string::npos)
+                    name.erase(0, slash + 1);
+            
+                if(line[5] == 'd')
+                    m.mat_diffuse_texture_name = name;
+                else
+                    m.mat_ambient_texture_name = name;
+            }
+        }
+    }
+}
+
+Obj_Reader::Obj_Reader(string material_path, string obj_path, Obj_Options options_):
+options(options_)
+{
+    auto mat_future = async(launch::async, &Obj_Reader::read_material_file, this, material_path);
+    auto obj_future = async(launch::async, &Obj_Reader::read_obj_file, this, obj_path);
+    
+    mat_future.get();
+    obj_future.get();
+}
+
+void Obj_Reader::read_material_file(std::string material_path)
+{
+    if(material_path.find(".mtl") == string::npos)
+        throw runtime_error("Not a material file");
+    
+    // parsed once per process, however many models share the file
+    auto start = Load_Clock::now();
+    materials = Material_Library::shared().materials(material_path);
+    end_phase(options, &Obj_Load_Timings::materials, start);
+}
+
+void Obj_Reader::read_obj_file(std::string obj_path)
+{
+    if(obj_path.find(".obj") == string::npos)
+        throw runtime_error("Not a .obj file");
+    
+    auto start = Load_Clock::now();
+    Mapped_File file(obj_path);
+    
+    size_t chunk_count = 1;
+    if(options.parallel_parse)
+        chunk_count = std::max<size_t>(1, std::min<size_t>(worker_count() * 4, file.size() / std::max<size_t>(options.min_chunk_bytes, 1)));
+    
+    // a watched load is parsed in pieces small enough to report and cancel between
+    auto progress = options.progress.get();
+    if(progress)
+    {
+        progress->bytes_total = file.size();
+        chunk_count = std::max<size_t>(chunk_count, file.size() / PROGRESS_CHUNK_BYTES);
+    }
+    
+    auto bounds = split_at_lines(file.begin(), file.end(), chunk_count);
+    std::vector<Obj_Chunk> chunks(bounds.size() - 1);
+    size_t min_per_task = options.parallel_parse ? 1 : chunks.size();
+    
+    // a quick count first, so the element arrays are sized once and each chunk knows
+    // where its elements go
+    parallel_for(chunks.size(), [&](size_t i)
+    {
+        chunks[i].counts = count_obj_lines(bounds[i], bounds[i + 1]);
+    }, min_per_task);
+    
+    size_t v = 0, t = 0, n = 0;
+    for(auto &c : chunks)
+    {
+        c.v_first = v;
+        c.t_first = t;
+        c.n_first = n;
+        v += c.counts.vertices;
+        t += c.counts.tex_coords;
+        n += c.counts.normals;
+    }
+    vertices.resize(v);
+    tex_coords.resize(t);
+    normals.resize(n);
+    end_phase(options, &Obj_Load_Timings::read, start);
+    
+    parallel_for(chunks.size(), [&](size_t i)
+    {
+        check_cancelled(options);
+        auto &c = chunks[i];
+        c.faces.set_ranges(v, t, n);
+        c.faces.reserve(c.counts.corners);
+        parse_obj_chunk(bounds[i], bounds[i + 1], *this, c);
+        if(progress)
+            progress->bytes_parsed += std::uint64_t(bounds[i + 1] - bounds[i]);
+    }, min_per_task);
+    check_cancelled(options);
+    end_phase(options, &Obj_Load_Timings::tokenize, start);
+    
+    merge_chunks(chunks);
+    end_phase(options, &Obj_Load_Timings::faces, start);
+}
+
+Obj_Mesh &Obj_Reader::current_mesh()
+{
+    // faces before any "o" line go to an unnamed mesh
+    if(meshes.empty())
+        meshes.push_back(Obj_Mesh());
+    return meshes.back();
+}
+
+void Obj_Reader::merge_chunks(std::vector<Obj_Chunk> &chunks)
+{
+    // the runs of faces between object/material changes, in file order, and the mesh
+    // each run belongs to
+    struct Run
+    {
+        size_t mesh, chunk, first, last;
+    };
+    std::vector<Run> runs;
+    
+    for(size_t ci = 0; ci < chunks.size(); ++ci)
+    {
+        const auto &chunk = chunks[ci];
+        size_t face = 0;
+        for(size_t e = 0; e <= chunk.events.size(); ++e)
+        {
+            size_t next = e < chunk.events.size() ? chunk.events[e].first_face : chunk.faces.size();
+            if(next > face)
+            {
+                current_mesh();
+                runs.push_back(Run{meshes.size() - 1, ci, face, next});
+                face = next;
+            }
+            
+            if(e == chunk.events.size())
+                break;
+            
+            const auto &ev = chunk.events[e];
+            if(ev.new_object)
+            {
+                meshes.push_back(Obj_Mesh());
+                meshes.back().obj_name = ev.name;
+            }
+            else
+            {
+                auto &mesh = current_mesh();
+                bool has_faces = !runs.empty() && runs.back().mesh == meshes.size() - 1;
+                
+                // a material change inside an object starts a new mesh, so every mesh has one material
+                if(has_faces && mesh.mat_name != ev.name)
+                {
+                    Obj_Mesh split;
+                    split.obj_name = mesh.obj_name;
+                    meshes.push_back(std::move(split));
+                }
+                meshes.back().mat_name = ev.name;
+            }
+        }
+    }
+    
+    // a mesh made of one whole chunk takes its faces as they are; the others are sized
+    // exactly and filled chunk by chunk, each chunk freed once copied
+    std::vector<size_t> sizes(meshes.size(), 0), run_counts(meshes.size(), 0);
+    for(const auto &r : runs)
+    {
+        sizes[r.mesh] += r.last - r.first;
+        ++run_counts[r.mesh];
+    }
+    
+    auto takes_chunk = [&](const Run &r)
+    {
+        return run_counts[r.mesh] == 1 && r.first == 0 && r.last == chunks[r.chunk].faces.size();
+    };
+    
+    for(const auto &r : runs)
+    {
+        if(!takes_chunk(r))
+        {
+            auto &faces = meshes[r.mesh].faces;
+            if(faces.empty())
+            {
+                faces.set_ranges(vertices.size(), tex_coords.size(), normals.size());
+                faces.reserve(sizes[r.mesh]);
+            }
+        }
+    }
+    
+    size_t r = 0;
+    for(size_t ci = 0; ci < chunks.size(); ++ci)
+    {
+        for(; r < runs.size() && runs[r].chunk == ci; ++r)
+        {
+            auto &faces = meshes[runs[r].mesh].faces;
+            if(takes_chunk(runs[r]))
+                faces = std::move(chunks[ci].faces);
+            else
+                faces.append(chunks[ci].faces, runs[r].first, runs[r].last);
+        }
+        chunks[ci] = Obj_Chunk();
+    }
+}
+
+namespace
+{
+    class Stream_Sink
+    {
+        // welded vertex, table key and slots, per block vertex
+        static const size_t BLOCK_VERTEX_BYTES = sizeof(knu::math::Vector3f) * 2 + sizeof(knu::math::Vector2f) + 12 + 8;
+        
+        const std::function<void(Obj_Stream_Block &)> &on_block;
+        size_t memory_ceiling, max_vertices, max_indices, block_bytes, pool_bytes;
+        
+        std::deque<knu::math::Vector3f> vertices;
+        std::deque<knu::math::Vector2f> tex_coords;
+        std::deque<knu::math::Vector3f> normals;
+        
+        Corner_Table table;
+        Obj_Stream_Block block;
+        std::vector<std::uint32_t> indices;
+        bool any_t, any_n, run_emitted;
+        
+        void grow_pool(size_t bytes)
+        {
+            pool_bytes += bytes;
+            if(pool_bytes + block_bytes > memory_ceiling)
+                throw runtime_error("stream_obj() - vertex data exceeds the memory ceiling");
+        }
         
-        mat_future.get();
-        obj_future.get();
-    }catch(std::exception &ex)
-    {
-        std::cerr << ex.what() << std::endl;
-        std::exit(-1);
-    }
-}
-
-std::string Obj_Reader::read_next_line(std::ifstream &file)
-{
-    string line;
-    getline(file, line);
-    return line;
+        static int absolute(int index, size_t count)
+        {
+            int i = index > 0 ? index - 1 : int(count) + index;
+            return index && i >= 0 && size_t(i) < count ? i : -1;
+        }
+        
+        void flush(bool mesh_end)
+        {
+            if(indices.empty() && !(mesh_end && run_emitted))
+                return;
+            
+            auto &m = block.mesh;
+            if(!any_t)
+                m.t.clear();
+            if(!any_n)
+                m.n.clear();
+            
+            if(m.v.size() <= 65536)
+                m.indices16.assign(indices.begin(), indices.end());
+            else
+                m.indices32.assign(indices.begin(), indices.end());
+            
+            block.mesh_end = mesh_end;
+            on_block(block);
+            run_emitted = !mesh_end;
+            
+            m.v.clear();
+            m.t.clear();
+            m.n.clear();
+            m.indices16.clear();
+            m.indices32.clear();
+            indices.clear();
+            table.reset(max_vertices);
+            any_t = any_n = false;
+        }
+        
+    public:
+        Stream_Sink(const std::function<void(Obj_Stream_Block &)> &on_block_, const Obj_Stream_Options &options):
+        on_block(on_block_), memory_ceiling(options.memory_ceiling), max_vertices(std::max<size_t>(options.max_block_vertices, 3)),
+        max_indices(max_vertices * 6), block_bytes(0), pool_bytes(0), any_t(false), any_n(false), run_emitted(false)
+        {
+            block_bytes = max_vertices * BLOCK_VERTEX_BYTES + max_indices * sizeof(std::uint32_t) * 2;
+            if(block_bytes > memory_ceiling)
+                throw runtime_error("stream_obj() - max_block_vertices does not fit in the memory ceiling");
+            
+            table.reset(max_vertices);
+            indices.reserve(max_indices);
+        }
+        
+        void vertex(const knu::math::Vector3f &v)
+        {
+            grow_pool(sizeof(v));
+            vertices.push_back(v);
+        }
+        
+        void tex_coord(const knu::math::Vector2f &t)
+        {
+            grow_pool(sizeof(t));
+            tex_coords.push_back(t);
+        }
+        
+        void normal(const knu::math::Vector3f &n)
+        {
+            grow_pool(sizeof(n));
+            normals.push_back(n);
+        }
+        
+        void face(const int *v, const int *t, const int *n, int count)
+        {
+            auto &m = block.mesh;
+            
+            for(int i = 1; i + 1 < count; ++i)
+            {
+                if(m.v.size() + 3 > max_vertices || indices.size() + 3 > max_indices)
+                    flush(false);
+                
+                const int corner[3] = {0, i, i + 1};
+                for(int k : corner)
+                {
+                    int vi = absolute(v[k], vertices.size());
+                    if(vi < 0)
+                        throw runtime_error("stream_obj() - face refers to a vertex that has not been read");
+                    int ti = absolute(t[k], tex_coords.size());
+                    int ni = absolute(n[k], normals.size());
+                    
+                    bool inserted = false;
+                    indices.push_back(table.find_or_insert(vi, ti, ni, inserted));
+                    if(!inserted)
+                        continue;
+                    
+                    m.v.push_back(vertices[vi]);
+                    m.t.push_back(ti < 0 ? knu::math::Vector2f() : tex_coords[ti]);
+                    m.n.push_back(ni < 0 ? knu::math::Vector3f() : normals[ni]);
+                    any_t = any_t || ti >= 0;
+                    any_n = any_n || ni >= 0;
+                }
+            }
+        }
+        
+        void object(string name)
+        {
+            flush(true);
+            block.obj_name = std::move(name);
+            block.mesh.material.clear();
+        }
+        
+        void material(string name)
+        {
+            // same rule as Obj_Reader: a material change after faces starts a new run
+            if(name == block.mesh.material)
+                return;
+            
+            flush(true);
+            block.mesh.material = std::move(name);
+        }
+        
+        void finish()
+        {
+            flush(true);
+        }
+    };
 }
 
-void Obj_Reader::read_material_file(std::string material_path)
+namespace
 {
-    regex r(MAT_STRING_REP);
-    smatch match;
+    // Vertex i of a mesh given as corners into the parsed v/vt/vn arrays; missing
+    // texture coordinates and normals read as zero
+    struct Corner_Source
+    {
+        const Obj_Reader &data;
+        const Obj_Faces &corners;
+        
+        void operator()(size_t i, knu::math::Vector3f &v, knu::math::Vector2f &t, knu::math::Vector3f &n) const
+        {
+            auto c = corners[i];
+            v = data.vertices[c.v_index];
+            t = size_t(c.t_index) < data.tex_coords.size() ? data.tex_coords[c.t_index] : knu::math::Vector2f();
+            n = size_t(c.n_index) < data.normals.size() ? data.normals[c.n_index] : knu::math::Vector3f();
+        }
+    };
     
-    if(!regex_search(material_path, match, r))
-        throw runtime_error("Not a material file");
+    // Vertex i of a mesh kept in Mesh::v/t/n
+    struct Mesh_Source
+    {
+        const Mesh &mesh;
+        
+        void operator()(size_t i, knu::math::Vector3f &v, knu::math::Vector2f &t, knu::math::Vector3f &n) const
+        {
+            v = mesh.v[i];
+            if(!mesh.t.empty())
+                t = mesh.t[i];
+            if(!mesh.n.empty())
+                n = mesh.n[i];
+        }
+    };
     
-    ifstream file(material_path);
+    // Corners per flattening task
+    const size_t FLATTEN_GRAIN = 1 << 16;
+    
+    // Looks up corners [first, last) of one attribute. Corners without an index, or past the
+    // end of a stream that never started, are left as they are.
+    template<typename Values, typename T>
+    void gather_attribute(const Values &values, const Obj_Index_Stream &indices, size_t first, size_t last, T *out)
+    {
+        last = std::min(last, indices.size());
+        for(size_t i = first; i < last; ++i)
+        {
+            auto k = size_t(indices[i]);        // -1 wraps past any size
+            if(k < values.size())
+                out[i - first] = values[k];
+        }
+    }
     
-    if(!file)
-        throw runtime_error("Could not open material file at " + material_path);
+    // Fills the v/t/n arrays of each mesh with its corners, the attributes the format has.
+    // The arrays are sized once, then ranges of corners from all the meshes are looked up
+    // on worker threads.
+    void flatten_meshes(const Obj_Reader &data, const std::vector<std::pair<Mesh *, const Obj_Faces *>> &meshes, ObjFormat format)
+    {
+        bool has_t = format == ObjFormat::Ver_Tex || format == ObjFormat::Ver_Tex_Nor;
+        bool has_n = format == ObjFormat::Ver_Nor || format == ObjFormat::Ver_Tex_Nor;
+        
+        struct Range {size_t mesh, first, last;};
+        std::vector<Range> ranges;
+        for(size_t i = 0; i < meshes.size(); ++i)
+        {
+            auto &mesh = *meshes[i].first;
+            size_t count = meshes[i].second->size();
+            mesh.v.resize(count);
+            mesh.t.resize(has_t ? count : 0);
+            mesh.n.resize(has_n ? count : 0);
+            
+            for(size_t first = 0; first < count; first += FLATTEN_GRAIN)
+                ranges.push_back(Range{i, first, std::min(first + FLATTEN_GRAIN, count)});
+        }
+        
+        parallel_for(ranges.size(), [&](size_t r)
+        {
+            const auto &range = ranges[r];
+            auto &mesh = *meshes[range.mesh].first;
+            const auto &corners = *meshes[range.mesh].second;
+            
+            gather_attribute(data.vertices, corners.v_indices, range.first, range.last, mesh.v.data() + range.first);
+            if(has_t)
+                gather_attribute(data.tex_coords, corners.t_indices, range.first, range.last, mesh.t.data() + range.first);
+            if(has_n)
+                gather_attribute(data.normals, corners.n_indices, range.first, range.last, mesh.n.data() + range.first);
+        });
+    }
     
-    while(!check_eof(file))
+    // Writes count vertices from source into dst in one pass
+    template<typename Source>
+    void write_vertices(char *dst, const Vertex_Layout &layout, size_t count, const Source &source)
     {
-        auto current_line = read_next_line(file);
-        dispatch_to_mat_parser(current_line);
+        knu::math::Vector3f v, n;
+        knu::math::Vector2f t;
         
+        for(size_t i = 0; i < count; ++i)
+        {
+            source(i, v, t, n);
+            
+            const float pv[3] = {v.x, v.y, v.z}, pt[2] = {t.x, t.y}, pn[3] = {n.x, n.y, n.z};
+            std::memcpy(dst + layout.position.offset + i * layout.position.stride, pv, sizeof(pv));
+            if(layout.tex_coord.offset >= 0)
+                std::memcpy(dst + layout.tex_coord.offset + i * layout.tex_coord.stride, pt, sizeof(pt));
+            if(layout.normal.offset >= 0)
+                std::memcpy(dst + layout.normal.offset + i * layout.normal.stride, pn, sizeof(pn));
+        }
     }
 }
 
-void Obj_Reader::read_obj_file(std::string obj_path)
+std::unordered_map<std::string, Obj_Material> knu::stream_obj(string material_path, string obj_path,
+                                                              const std::function<void(Obj_Stream_Block &)> &on_block,
+                                                              Obj_Stream_Options options)
 {
-    regex r(OBJ_STRING_REP);
-    smatch match;
-    
-    if(!regex_search(obj_path, match, r))
+    if(obj_path.find(".obj") == string::npos)
         throw runtime_error("Not a .obj file");
     
-    ifstream file(obj_path);
+    auto materials = read_obj_materials(material_path);
     
-    if(!file)
-        throw runtime_error("Could not open obj file at" + obj_path);
+    Stream_Sink sink(on_block, options);
+    Mapped_File file(obj_path);
+    parse_obj_lines(file.begin(), file.end(), sink);
+    sink.finish();
     
-    while(!check_eof(file))
-    {
-        auto current_line = read_next_line(file);
-        dispatch_to_obj_parser(current_line);
-    }
+    return materials;
 }
 
-void Obj_Reader::dispatch_to_mat_parser(std::string line)
+std::unordered_map<std::string, Obj_Material> knu::read_obj_materials(string material_path)
 {
-    auto iterator = find_if(begin(mat_matches), end(mat_matches), Mat_Compare_With_Line(line));
-    if(iterator != end(mat_matches))
-        (this->*iterator->second)(line);
+    if(material_path.find(".mtl") == string::npos)
+        throw runtime_error("Not a material file");
     
+    std::vector<Obj_Material> materials;
+    Mapped_File file(material_path);
+    parse_material(file.begin(), file.end(), materials);
+    
+    std::unordered_map<std::string, Obj_Material> result;
+    for(auto &m : materials)
+        result[m.mat_name] = m;
+    return result;
 }
 
-void Obj_Reader::dispatch_to_obj_parser(std::string line)
+
+Obj::Obj()
 {
-    auto iterator = find_if(begin(obj_matches), end(obj_matches), Obj_Compare_With_Line(line));
-    if(iterator != end(obj_matches))
-        (this->*iterator->second)(line);
+    
 }
 
-void Obj_Reader::mat_name_handler(std::string line)
+Obj::Obj(string material_name, string obj_name, Obj_Options options)
 {
-    regex r(MAT_NAME);
-    smatch match;
-    regex_search(line, match, r);
-    materials.push_back(Obj_Material());
-    materials.back().mat_name = match[1];
+    load_obj(material_name, obj_name, options);
 }
 
-void Obj_Reader::mat_count_handler(std::string line)
+string Obj::get_path(std::string file_name)
 {
-    stringstream ss(line);
-    string identifier;
-    int count = 0;
-    ss >> identifier >> identifier >> identifier >> count;
-    materials.reserve(count);
+    std::string file_path;
+/*#ifdef __APPLE__
+    int pos = file_name.find('.');
+    if(pos == string::npos)
+        throw (runtime_error("No file extension in: " + file_name));
+    
+    string name(begin(file_name), begin(file_name) + pos++);
+    string extension(begin(file_name) + pos, end(file_name));
+    
+    NSString *file_name_ = [[NSBundle mainBundle] pathForResource:[NSString stringWithCString:name.c_str() encoding:NSUTF8StringEncoding] ofType:[NSString stringWithCString:extension.c_str() encoding:NSUTF8StringEncoding]];
+    
+    if(nil == file_name_)
+        throw (runtime_error("Unable to find path for: " + file_name));
+    
+    file_path = file_name_.UTF8String;
+    
+#else   */                
+    file_path = file_name;  // Windows machine ?
     
+    return file_path;
 }
 
-void Obj_Reader::mat_ambient_handler(std::string line)
+void Obj::make_obj(string mat_path, string obj_path, Obj_Options options)
 {
-    regex r(MAT_AMBIENT);
-    smatch match;
-    regex_search(line, match, r);
+    model_data.reset(new knu::Obj_Reader(mat_path, obj_path, options));
+    check_cancelled(options);
     
-    materials.back().mat_ambient_color = knu::math::Vector4f(stof(match[1]), stof(match[2]), stof(match[3]), 1.0f);
+    auto start = Load_Clock::now();
+    make_meshes(options);
+    end_phase(options, &Obj_Load_Timings::flatten, start);
 }
 
-void Obj_Reader::mat_diffuse_handler(std::string line)
+// Turns the parsed faces into meshes
+void Obj::make_meshes(const Obj_Options &options)
 {
-    regex r(MAT_DIFFUSE);
-    smatch match;
-    regex_search(line, match, r);
-    materials.back().mat_diffuse_color = knu::math::Vector4f(stof(match[1]), stof(match[2]), stof(match[3]), 1.0f);
+    if(options.generate_normals && model_data->normals.empty() && !model_data->vertices.empty())
+        generate_normals(*model_data, options.crease_angle);
+    
+    if(options.indexed)
+    {
+        make_indexed_obj(options);
+        return;
+    }
+    
+    if(options.vertex_target)
+    {
+        make_targeted_obj(options.vertex_target);
+        return;
+    }
+    
+    // the faces' corners become the vertices, every mesh in one parallel pass
+    set_format();
+    std::vector<std::pair<Mesh *, const Obj_Faces *>> flat;
+    size_t first = meshes.size();
+    for(const auto &m : model_data->meshes)
+    {
+        meshes.push_back(Mesh());
+        meshes.back().material = m.mat_name;
+    }
+    for(size_t mi = 0; mi < model_data->meshes.size(); ++mi)
+        flat.push_back(std::make_pair(&meshes[first + mi], &model_data->meshes[mi].faces));
+    
+    flatten_meshes(*model_data, flat, model_format);
 }
 
-void Obj_Reader::mat_specular_handler(std::string line)
+void Obj::set_format()
 {
-    regex r(MAT_SPECULAR);
-    smatch match;
-    regex_search(line, match, r);
-    materials.back().mat_specular_color = knu::math::Vector4f(stof(match[1]), stof(match[2]), stof(match[3]), 1.0f);
+    bool has_t = !model_data->tex_coords.empty();
+    bool has_n = !model_data->normals.empty();
+    
+    model_format = has_t ? (has_n ? ObjFormat::Ver_Tex_Nor : ObjFormat::Ver_Tex) : (has_n ? ObjFormat::Ver_Nor : ObjFormat::Ver);
+    model_format_size = sizeof(knu::math::Vector3f) + (has_t ? sizeof(knu::math::Vector2f) : 0) + (has_n ? sizeof(knu::math::Vector3f) : 0);
 }
 
-void Obj_Reader::mat_specular_exponent_handler(std::string line)
+void Obj::make_indexed_obj(const Obj_Options &options)
 {
-    regex r(MAT_SPECULAR_EXPONENT);
-    smatch match;
-    regex_search(line, match, r);
-    materials.back().mat_specular_exponent = stof(match[1]);
+    set_format();
+    bool has_t = !model_data->tex_coords.empty();
+    bool has_n = !model_data->normals.empty();
+    
+    const auto &source = model_data->meshes;
+    std::vector<std::vector<std::uint32_t>> indices(source.size());
+    std::vector<std::vector<Mesh_Lod>> lods(source.size());
+    std::vector<std::vector<Meshlet>> meshlets(source.size());
+    welded.resize(source.size());
+    
+    // submeshes are welded, optimized and simplified independently
+    parallel_for(source.size(), [&](size_t mi)
+    {
+        check_cancelled(options);
+        
+        const auto &faces = source[mi].faces;
+        Corner_Table table;
+        table.reset(faces.size());
+        
+        const auto &vertices = model_data->vertices;
+        auto &mesh_indices = indices[mi];
+        mesh_indices.resize(faces.size());
+        for(size_t i = 0; i < faces.size(); ++i)
+        {
+            const auto &f = faces[i];
+            // the positions below are read through these indices unchecked
+            if(f.v_index < 0 || size_t(f.v_index) >= vertices.size() ||
+               (has_t && f.t_index >= int(model_data->tex_coords.size())) || (has_n && f.n_index >= int(model_data->normals.size())))
+                throw runtime_error("make_indexed_obj() - face refers to a missing vertex element");
+            bool inserted = false;
+            mesh_indices[i] = table.find_or_insert(f.v_index, has_t ? f.t_index : -1, has_n ? f.n_index : -1, inserted);
+        }
+        
+        auto &corners = table.corners();
+        if(corners.empty())
+            return;
+        
+        auto position = [&](std::uint32_t v) { return vertices[corners[v].v_index]; };
+        
+        if(options.optimize)
+        {
+            std::vector<std::uint32_t> remap;
+            optimize_indices(mesh_indices, corners.size(), position, remap);
+            apply_vertex_remap(corners, remap);
+        }
+        
+        if(options.meshlets)
+            meshlets[mi] = build_meshlets(mesh_indices, corners.size(), position);
+        
+        if(!options.lod_ratios.empty())
+        {
+            lods[mi] = build_lod_chain(mesh_indices.data(), mesh_indices.size(), corners.size(), position, options.lod_ratios);
+            if(options.optimize)
+            {
+                for(auto &lod : lods[mi])
+                    optimize_vertex_cache(lod.indices.data(), lod.indices.size(), corners.size());
+            }
+        }
+        
+        auto &distinct = welded[mi];
+        distinct.set_ranges(vertices.size(), model_data->tex_coords.size(), model_data->normals.size());
+        distinct.reserve(corners.size());
+        for(const auto &c : corners)
+            distinct.push_back(c);
+    });
+    
+    for(size_t mi = 0; mi < source.size(); ++mi)
+    {
+        meshes.push_back(Mesh());
+        auto &mesh = meshes.back();
+        mesh.material = source[mi].mat_name;
+        mesh.lods.swap(lods[mi]);
+        mesh.meshlets.swap(meshlets[mi]);
+        
+        if(welded[mi].size() <= 65536)
+            mesh.indices16.assign(indices[mi].begin(), indices[mi].end());
+        else
+            mesh.indices32.swap(indices[mi]);
+        
+        emit_mesh(mi, welded[mi], options.vertex_target);
+    }
 }
 
-void Obj_Reader::mat_opacity_handler(std::string line)
+void Obj::make_targeted_obj(const Vertex_Target &target)
 {
-    regex r(MAT_OPACITY);
-    smatch match;
+    set_format();
     
-    // Match instead of search in order to avoid conflict with MAT_DIFFUSE (kd #)
-    if(regex_match(line, match, r))
+    for(size_t mi = 0; mi < model_data->meshes.size(); ++mi)
     {
-        materials.back().mat_opacity = stof(match[1]);
+        const auto &m = model_data->meshes[mi];
+        meshes.push_back(Mesh());
+        meshes.back().material = m.mat_name;
+        emit_mesh(mi, m.faces, target);
     }
-	else	// check if it matches with MAT_DIFFUSE
-	{
-		
-		regex r2(MAT_DIFFUSE);
-		if(regex_match(line, match, r2))
-		{
-			mat_diffuse_handler(line);
-		}
-	}
 }
 
-void Obj_Reader::mat_diffuse_texture_handler(std::string line)
+// The vertices of mesh index are the given corners. They go to the target in a single
+// pass, or into Mesh::v/t/n when there is no target or it declines the mesh.
+void Obj::emit_mesh(size_t index, const Obj_Faces &corners, const Vertex_Target &target)
 {
-    regex r(MAT_DIFFUSE_TEXTURE);
-    smatch match;
-    auto pos = line.find_last_of("/");
+    auto &mesh = meshes[index];
+    const auto &data = *model_data;
+    size_t count = corners.size();
     
-    if(line.npos != pos)
+    if(target)
     {
-        ++pos;
-        std::string texture_name(line.begin() + pos, line.end());
-        materials.back().mat_diffuse_texture_name = texture_name;
-    }else
-    {
-        regex_search(line, match, r);
-        std::string textureName = match[1];
-        materials.back().mat_diffuse_texture_name = textureName;
+        auto layout = Vertex_Layout::interleaved(model_format, count);
+        if(auto dst = static_cast<char *>(target(index, model_format, count, layout)))
+        {
+            write_vertices(dst, layout, count, Corner_Source{data, corners});
+            mesh.target_vertices = count;
+            return;
+        }
     }
+    
+    flatten_meshes(data, {std::make_pair(&mesh, &corners)}, model_format);
 }
 
-void Obj_Reader::mat_ambient_texture_handler(std::string line)
+void Obj::write_mesh_vertices(size_t index, char *dst, const Vertex_Layout &layout) const
 {
-    // TODO - THIS FUNCTION NEEDS TO BE TESTED
-    regex r(MAT_AMBIENT_TEXTURE);
-    smatch match;
-    auto pos = line.find_last_of("/");
+    const auto &mesh = meshes[index];
     
-    if(line.npos != pos)
+    if(!mesh.target_vertices)
     {
-        ++pos;
-        std::string texture_name(line.begin() + pos, line.end());
-        materials.back().mat_ambient_texture_name = texture_name;
-    }else
+        write_vertices(dst, layout, mesh.v.size(), Mesh_Source{mesh});
+        return;
+    }
+    
+    // only while loading: the corners are rebuilt from the parsed data
+    if(!model_data)
+        throw runtime_error("write_mesh_vertices() - the mesh's vertices went to a vertex target");
+    
+    const auto &corners = welded.empty() ? model_data->meshes[index].faces : welded[index];
+    write_vertices(dst, layout, corners.size(), Corner_Source{*model_data, corners});
+}
+
+// Hands meshes that came out of the binary cache to the vertex target
+void Obj::target_cached_meshes(const Vertex_Target &target)
+{
+    for(size_t mi = 0; mi < meshes.size(); ++mi)
+    {
+        auto &mesh = meshes[mi];
+        size_t count = mesh.v.size();
+        auto layout = Vertex_Layout::interleaved(model_format, count);
+        auto dst = static_cast<char *>(target(mi, model_format, count, layout));
+        if(!dst)
+            continue;
+        
+        write_vertices(dst, layout, count, Mesh_Source{mesh});
+        mesh.target_vertices = count;
+        std::vector<knu::math::Vector3f>().swap(mesh.v);
+        std::vector<knu::math::Vector2f>().swap(mesh.t);
+        std::vector<knu::math::Vector3f>().swap(mesh.n);
+    }
+}
+
+void Obj::make_mat()
+{
+    for (auto &m : model_data->materials)
     {
-        regex_search(line, match, r);
-        std::string textureName = match[1];
-        materials.back().mat_ambient_texture_name = textureName;
+		str_mat_map[m.mat_name] = m;
     }
 }
 
-void Obj_Reader::obj_new_mesh_handler(std::string line)
+void Obj::load_obj(std::string material_name, std::string obj_name, Obj_Options options)
 {
-    regex r(OBJ_NEW_MESH);
-    smatch match;
+    auto mat_path = get_path(material_name);
+    auto obj_path = get_path(obj_name);
+    material_path = mat_path;
+    
+    Mesh_Cache_Source source(obj_path, mat_path, options);
+    if(options.use_cache)
+    {
+        Mesh_Cache cache;
+        if(cache.open(mesh_cache_path(source), source))
+        {
+            cache.load(*this);
+            if(options.progress)
+                options.progress->bytes_parsed = options.progress->bytes_total = source.obj_size;
+            if(options.generate_tangents)
+                generate_tangents(*this);
+            if(options.vertex_target)
+                target_cached_meshes(options.vertex_target);
+            return;
+        }
+    }
+    
+    make_obj(mat_path, obj_path, options);
+    auto start = Load_Clock::now();
+    make_mat();
+    end_phase(options, &Obj_Load_Timings::materials, start);
+    if(options.generate_tangents)
+        generate_tangents(*this);
+    
+    // before the parsed data is dropped, so meshes sent to a vertex target can be written too
+    check_cancelled(options);
+    if(options.use_cache)
+        write_mesh_cache(mesh_cache_path(source), source, *this);
     
-    regex_search(line, match, r);
-    meshes.push_back(Obj_Mesh());
-    meshes.back().obj_name = match[1];
+    model_data.reset();
+    welded.clear();
+}
+
+void Obj::load_materials(std::string material_name)
+{
+    material_path = get_path(material_name);
     
+    auto &library = Material_Library::shared();
+    library.load(material_path, true);
+    str_mat_map.clear();
+    for(auto &m : library.materials(material_path))
+        str_mat_map[m.mat_name] = m;
+}
+
+namespace
+{
+    // A few long lived threads running queued loads in order. Each load already spreads its
+    // phases over the cores, so more loaders would only multiply threads. The pool is never
+    // destroyed: loads still queued when the program exits are dropped with it.
+    class Load_Pool
+    {
+        std::mutex lock;
+        std::condition_variable wake;
+        std::deque<std::function<void()>> jobs;
+        
+        void run()
+        {
+            while(true)
+            {
+                std::function<void()> job;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    wake.wait(guard, [this]() { return !jobs.empty(); });
+                    job = std::move(jobs.front());
+                    jobs.pop_front();
+                }
+                job();
+            }
+        }
+        
+        Load_Pool()
+        {
+            unsigned int loaders = std::min(4u, worker_count());
+            for(unsigned int i = 0; i < loaders; ++i)
+                std::thread(&Load_Pool::run, this).detach();
+        }
+        
+    public:
+        static Load_Pool &shared()
+        {
+            static auto pool = new Load_Pool();
+            return *pool;
+        }
+        
+        void submit(std::function<void()> job)
+        {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                jobs.push_back(std::move(job));
+            }
+            wake.notify_one();
+        }
+    };
 }
 
-void Obj_Reader::obj_vertex_handler(std::string line)
+Obj_Load_Handle knu::load_obj_async(std::string material_name, std::string obj_name, Obj_Options options)
 {
-    regex r(OBJ_VERTEX);
-    smatch match;
+    if(!options.progress)
+        options.progress = std::make_shared<Obj_Load_Progress>();
+    auto state = options.progress;
+    
+    // the promise's future does not wait for the load when the last handle goes away
+    auto promise = std::make_shared<std::promise<Obj_Load_Result>>();
+    auto result = promise->get_future().share();
+    
+    Load_Pool::shared().submit([material_name, obj_name, options, promise]()
+    {
+        Obj_Load_Result r;
+        try
+        {
+            r.obj = std::make_shared<Obj>(material_name, obj_name, options);
+            r.status = Obj_Load_Status::done;
+        }catch(Obj_Load_Cancelled &)
+        {
+            r.status = Obj_Load_Status::cancelled;
+        }catch(std::exception &ex)
+        {
+            r.status = Obj_Load_Status::failed;
+            r.error = ex.what();
+        }catch(...)
+        {
+            r.status = Obj_Load_Status::failed;
+            r.error = "unknown error";
+        }
+        promise->set_value(std::move(r));
+    });
     
-    regex_search(line, match, r);
-    vertices.push_back(knu::math::Vector3f(stof(match[1]), stof(match[2]), stof(match[3])));
+    return Obj_Load_Handle(result, state);
 }
 
-void Obj_Reader::obj_texture_handler(std::string line)
+#ifndef DO_NOT_INCLUDE_MODEL_PORTION
+#ifdef __APPLE__
+#include <OpenGL/gl3.h>
+#endif
+
+#ifdef WIN32
+#include <GL/glew.h>
+#endif
+
+Model_Obj::Model_Obj():
+modelBuffer(0), modelVao(0), indexBuffer(0), indexType(0), verticesCount(0), indicesCount(0), vSize(0), nSize(0), tSize(0),
+vertexCapacity(0), vertexBytes(0), indexCapacity(0), indexBytes(0), firstMaterial(0), lodCount(1)
 {
-    regex r(OBJ_TEXTURE);
-    smatch match;
     
-    regex_search(line, match, r);
-    tex_coords.push_back(knu::math::Vector2f(stof(match[1]), stof(match[2])));
 }
 
-void Obj_Reader::obj_normal_handler(std::string line)
+Model_Obj::Model_Obj(std::string modelName, std::string pathOfTextures):Model_Obj()
+{
+    load_model(modelName, pathOfTextures);
+}
+
+Model_Obj::~Model_Obj()
+{
+    destory_model();
+}
+
+Obj_Options Model_Obj::load_options(std::vector<float> lod_ratios)
+{
+    Obj_Options options;
+    options.indexed = true;
+    options.optimize = true;
+    options.lod_ratios = std::move(lod_ratios);
+    options.generate_normals = true;
+    options.meshlets = true;
+    return options;
+}
+
+Obj_Load_Handle Model_Obj::load_model_async(std::string modelName, std::vector<float> lod_ratios)
+{
+    return load_obj_async(modelName + ".mtl", modelName + ".obj", load_options(std::move(lod_ratios)));
+}
+
+void Model_Obj::set_lod_ratios(std::vector<float> ratios)
+{
+    lodRatios = std::move(ratios);
+}
+
+// One submesh as it comes from an Obj or a cache. Without indices (index_size 0) its
+// vertices are drawn in order.
+struct Model_Obj::SubmeshSource
+{
+    struct Lod {const void *indices; size_t count, indexSize; float error;};
+    
+    std::string material;
+    size_t vertexCount;
+    const void *indices;
+    size_t indexCount, indexSize;
+    std::vector<Lod> lods;
+    const Meshlet *meshlets;
+    size_t meshletCount;
+};
+
+namespace
 {
-    regex r(OBJ_NORMAL);
-    smatch match;
+    // Appends count indices of index_size bytes (0: the vertices in order), offset by base
+    void append_indices(std::vector<std::uint32_t> &dst, const void *src, size_t count, size_t index_size, size_t base)
+    {
+        size_t first = dst.size();
+        dst.resize(first + count);
+        auto out = dst.data() + first;
+        
+        if(index_size == 2)
+        {
+            auto in = static_cast<const std::uint16_t *>(src);
+            for(size_t i = 0; i < count; ++i)
+                out[i] = std::uint32_t(in[i] + base);
+        }
+        else if(index_size == 4)
+        {
+            auto in = static_cast<const std::uint32_t *>(src);
+            for(size_t i = 0; i < count; ++i)
+                out[i] = std::uint32_t(in[i] + base);
+        }
+        else
+        {
+            for(size_t i = 0; i < count; ++i)
+                out[i] = std::uint32_t(base + i);
+        }
+    }
     
-    regex_search(line, match, r);
-    normals.push_back(knu::math::Vector3f(stof(match[1]), stof(match[2]), stof(match[3])));
+    // Writes every submesh of o back to back in layout, which covers them all
+    void write_model_vertices(const Obj &o, char *dst, const Vertex_Layout &layout)
+    {
+        size_t first = 0;
+        for(size_t i = 0; i < o.meshes.size(); ++i)
+        {
+            auto at = layout;
+            for(auto attribute : {&at.position, &at.tex_coord, &at.normal})
+            {
+                if(attribute->offset >= 0)
+                    attribute->offset += std::ptrdiff_t(first * attribute->stride);
+            }
+            o.write_mesh_vertices(i, dst, at);
+            first += o.meshes[i].vertex_count();
+        }
+    }
 }
 
-void Obj_Reader::obj_add_mat_to_mesh_handler(std::string line)
+void Model_Obj::upload(const Obj &o, std::string modelname)
 {
-
-    regex r1(OBJ_USE_MATERIAL);
-    smatch match;
-    regex_search(line, match, r1);
-
-    std::string m_name = match[1];
-    meshes.back().mat_name = m_name;
+    if(!modelname.empty())
+        modelName = modelname;
+    
+    size_t total = 0;
+    for(const auto &mesh : o.meshes)
+        total += mesh.vertex_count();
+    
+    // a resident model keeps its layout, and whatever of its buffers did not change
+    if(modelBuffer)
+    {
+        bool planar = vertexLayout.position.stride == sizeof(knu::math::Vector3f);
+        vertexLayout = planar ? Vertex_Layout::planar(o.model_format, total) : Vertex_Layout::interleaved(o.model_format, total);
+        
+        std::vector<char> vertices(vertexLayout.size);
+        write_model_vertices(o, vertices.data(), vertexLayout);
+        update_buffer(modelBuffer, vertexCapacity, vertexBytes, vertices.data(), vertices.size());
+        setup_model(o);
+        return;
+    }
+    
+    // every submesh's vertices, back to back, written straight into the mapping
+    vertexLayout = Vertex_Layout::interleaved(o.model_format, total);
+    vertexCapacity = vertexBytes = vertexLayout.size;
+    if(vertexLayout.size)
+    {
+        glGenBuffers(1, &modelBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, modelBuffer);
+        glBufferData(GL_ARRAY_BUFFER, vertexLayout.size, nullptr, GL_STATIC_DRAW);
+        auto dst = static_cast<char *>(glMapBufferRange(GL_ARRAY_BUFFER, 0, vertexLayout.size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+        if(!dst)
+            throw std::runtime_error("upload() - unable to map the vertex buffer");
+        
+        write_model_vertices(o, dst, vertexLayout);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+    }
     
+    setup_model(o);
 }
 
-void Obj_Reader::obj_face_handler(std::string line)
+void Model_Obj::load_model(std::string modelName, std::string pathOTextures)
 {
-    regex r0(OBJ_FACE_0);
-
-    smatch match;
+    // a fresh load; reloading in place is upload() and reload()
+    destory_model();
+    this->modelName = modelName;
+    auto options = load_options(lodRatios);
     
-    if(regex_match(line, match, r0))
+    // a current cache is uploaded straight from its mapping, or from its decoded blocks when
+    // only a packed one was shipped
+    for(int packed = 0; packed < 2; ++packed)
     {
-        // 3 indices per face.
-        // Only vertices x 3
-        meshes.back().faces.push_back(Obj_Face(stoi(match[1]) -1, -1, -1));
-        meshes.back().faces.push_back(Obj_Face(stoi(match[2]) -1, -1, -1));
-        meshes.back().faces.push_back(Obj_Face(stoi(match[3]) -1, -1, -1));
-        return;
+        options.compress_cache = packed != 0;
+        Mesh_Cache cache;
+        Mesh_Cache_Source source(modelName + ".obj", modelName + ".mtl", options);
+        if(cache.open(mesh_cache_path(source), source) && cache.mesh_count())
+        {
+            load_cached(cache);
+            return;
+        }
     }
-    // remember to subtract 1 from each indice as Wavefront obj files start at 0
+    options.compress_cache = false;
     
-    regex r1(OBJ_FACE_1);
+    // otherwise the loader writes each submesh interleaved into a mapped buffer of its own;
+    // the buffers are packed into one on the GPU afterwards
+    std::vector<unsigned int> staging;
+    options.vertex_target = [&staging](size_t mesh, ObjFormat, size_t, Vertex_Layout &layout) -> void *
+    {
+        if(!layout.size)
+            return nullptr;
+        
+        staging.resize(std::max(staging.size(), mesh + 1), 0);
+        glGenBuffers(1, &staging[mesh]);
+        glBindBuffer(GL_ARRAY_BUFFER, staging[mesh]);
+        glBufferData(GL_ARRAY_BUFFER, layout.size, nullptr, GL_STATIC_COPY);
+        auto dst = glMapBufferRange(GL_ARRAY_BUFFER, 0, layout.size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if(!dst)
+            throw std::runtime_error("load_model() - unable to map the vertex buffer");
+        return dst;
+    };
     
-    if(regex_match(line, match, r1))
+    auto release_staging = [&staging]()
     {
-        // 4 indices per face.
-        // Only vertices x 4
-        meshes.back().faces.push_back(Obj_Face(stoi(match[1]) -1, -1, -1));
-        meshes.back().faces.push_back(Obj_Face(stoi(match[2]) -1, -1, -1));
-        meshes.back().faces.push_back(Obj_Face(stoi(match[3]) -1, -1, -1));
-        meshes.back().faces.push_back(Obj_Face(stoi(match[4]) -1, -1, -1));
-        return;
+        for(auto buffer : staging)
+        {
+            if(!buffer)
+                continue;
+            glBindBuffer(GL_ARRAY_BUFFER, buffer);
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            glDeleteBuffers(1, &buffer);
+        }
+        staging.clear();
+    };
+    
+    std::unique_ptr<Obj> loaded;
+    try
+    {
+        loaded.reset(new Obj(modelName + ".mtl", modelName + ".obj", options));
+    }catch(...)
+    {
+        release_staging();
+        throw;
     }
+    const auto &o = *loaded;
     
-    regex r2(OBJ_FACE_2);
+    size_t total = 0;
+    for(const auto &mesh : o.meshes)
+        total += mesh.vertex_count();
+    vertexLayout = Vertex_Layout::interleaved(o.model_format, total);
+    vertexCapacity = vertexBytes = vertexLayout.size;
     
-    if(regex_match(line, match, r2))
+    if(vertexLayout.size)
     {
-        // vertex/texture/normal x 3
-        meshes.back().faces.push_back(Obj_Face(stoi(match[1]) - 1, stoi(match[2]) - 1, stoi(match[3]) - 1));
-        meshes.back().faces.push_back(Obj_Face(stoi(match[4]) - 1, stoi(match[5]) - 1, stoi(match[6]) - 1));
-        meshes.back().faces.push_back(Obj_Face(stoi(match[7]) - 1, stoi(match[8]) - 1, stoi(match[9]) - 1));
-        return;
+        glGenBuffers(1, &modelBuffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, modelBuffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, vertexLayout.size, nullptr, GL_STATIC_DRAW);
+        
+        // only empty submeshes are without a staging buffer
+        size_t first = 0, stride = vertexLayout.position.stride;
+        for(size_t i = 0; i < o.meshes.size(); ++i)
+        {
+            size_t bytes = o.meshes[i].vertex_count() * stride;
+            if(i < staging.size() && staging[i])
+            {
+                glBindBuffer(GL_COPY_READ_BUFFER, staging[i]);
+                glUnmapBuffer(GL_COPY_READ_BUFFER);
+                glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, first, bytes);
+                glBindBuffer(GL_COPY_READ_BUFFER, 0);
+                glDeleteBuffers(1, &staging[i]);
+                staging[i] = 0;
+            }
+            first += bytes;
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
     }
-
-	regex r3(OBJ_FACE_3);
-
-	if(regex_match(line, match, r3))
-	{
-		// vertex//normal x 3
-		meshes.back().faces.push_back(Obj_Face(stoi(match[1]) - 1, -1, stoi(match[2]) - 1));
-		meshes.back().faces.push_back(Obj_Face(stoi(match[3]) - 1, -1, stoi(match[4]) - 1));
-		meshes.back().faces.push_back(Obj_Face(stoi(match[5]) - 1, -1, stoi(match[6]) - 1));
-		return;
-	}
-    
-    regex r4(OBJ_FACE_4);
+    release_staging();
     
-	if(regex_match(line, match, r4))
-	{
-		// vertex//normal x 3
-		meshes.back().faces.push_back(Obj_Face(stoi(match[1]) - 1, stoi(match[2]) - 1, -1));
-		meshes.back().faces.push_back(Obj_Face(stoi(match[3]) - 1, stoi(match[4]) - 1, -1));
-		meshes.back().faces.push_back(Obj_Face(stoi(match[5]) - 1, stoi(match[6]) - 1, -1));
-		return;
-	}
+    setup_model(o);
 }
 
-
-Obj::Obj()
+// Everything after the vertex buffer, once its vertices are in place
+void Model_Obj::setup_model(const Obj &o)
 {
+    std::vector<SubmeshSource> sources;
+    size_t total = 0;
+    for(const auto &mesh : o.meshes)
+    {
+        SubmeshSource source = {mesh.material, mesh.vertex_count(), nullptr, 0, 0, {}, mesh.meshlets.data(), mesh.meshlets.size()};
+        if(!mesh.indices16.empty())
+            source.indices = mesh.indices16.data(), source.indexCount = mesh.indices16.size(), source.indexSize = sizeof(std::uint16_t);
+        else if(!mesh.indices32.empty())
+            source.indices = mesh.indices32.data(), source.indexCount = mesh.indices32.size(), source.indexSize = sizeof(std::uint32_t);
+        
+        for(const auto &lod : mesh.lods)
+            source.lods.push_back(SubmeshSource::Lod{lod.indices.data(), lod.indices.size(), sizeof(std::uint32_t), lod.error});
+        
+        total += mesh.vertex_count();
+        sources.push_back(std::move(source));
+    }
     
+    retrieve_vertices_information(o.model_format, total);
+    setup_submeshes(sources);
+    setup_vao(o.model_format);
+    setup_materials(o.material_path);
 }
 
-Obj::Obj(string material_name, string obj_name)
-{
-    load_obj(material_name, obj_name);
-}
-
-string Obj::get_path(std::string file_name)
+void Model_Obj::load_cached(const Mesh_Cache &cache)
 {
-    std::string file_path;
-/*#ifdef __APPLE__
-    int pos = file_name.find('.');
-    if(pos == string::npos)
-        throw (runtime_error("No file extension in: " + file_name));
-    
-    string name(begin(file_name), begin(file_name) + pos++);
-    string extension(begin(file_name) + pos, end(file_name));
-    
-    NSString *file_name_ = [[NSBundle mainBundle] pathForResource:[NSString stringWithCString:name.c_str() encoding:NSUTF8StringEncoding] ofType:[NSString stringWithCString:extension.c_str() encoding:NSUTF8StringEncoding]];
+    auto format = cache.format();
+    size_t total = 0;
+    for(size_t i = 0; i < cache.mesh_count(); ++i)
+        total += cache.vertex_count(i);
     
-    if(nil == file_name_)
-        throw (runtime_error("Unable to find path for: " + file_name));
+    retrieve_vertices_information(format, total);
+    vertexLayout = Vertex_Layout::planar(format, total);
+    vertexCapacity = vertexBytes = vertexLayout.size;
     
-    file_path = file_name_.UTF8String;
+    // each submesh's planar blocks go to their place in the model's planar layout
+    glGenBuffers(1, &modelBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, modelBuffer);
+    glBufferData(GL_ARRAY_BUFFER, vertexLayout.size, nullptr, GL_STATIC_DRAW);
     
-#else   */                
-    file_path = file_name;  // Windows machine ?
+    std::vector<SubmeshSource> sources;
+    size_t first = 0;
+    for(size_t i = 0; i < cache.mesh_count(); ++i)
+    {
+        size_t count = cache.vertex_count(i);
+        auto from = Vertex_Layout::planar(format, count);
+        auto data = static_cast<const char *>(cache.vertex_data(i));
+        
+        const Vertex_Layout::Attribute Vertex_Layout::*attributes[] = {&Vertex_Layout::position, &Vertex_Layout::tex_coord, &Vertex_Layout::normal};
+        for(auto attribute : attributes)
+        {
+            const auto &src = from.*attribute, &dst = vertexLayout.*attribute;
+            if(src.offset >= 0 && count)
+                glBufferSubData(GL_ARRAY_BUFFER, dst.offset + first * dst.stride, count * src.stride, data + src.offset);
+        }
+        first += count;
+        
+        SubmeshSource source = {cache.material(i), count, cache.index_data(i), cache.index_count(i), cache.index_size(i), {},
+                                cache.meshlets(i), cache.meshlet_count(i)};
+        for(size_t l = 0; l < cache.lod_count(i); ++l)
+            source.lods.push_back(SubmeshSource::Lod{cache.lod_index_data(i, l), cache.lod_index_count(i, l), cache.index_size(i), cache.lod_error(i, l)});
+        sources.push_back(std::move(source));
+    }
     
-    return file_path;
+    setup_submeshes(sources);
+    setup_vao(format);
+    setup_materials(modelName + ".mtl");
 }
 
-void Obj::make_obj(string mat_path, string obj_path)
+void Model_Obj::setup_submeshes(const std::vector<SubmeshSource> &sources)
 {
-    model_data.reset(new knu::Obj_Reader(mat_path, obj_path));
+    // vertices stay in source order; the index lists are laid out by material
+    std::vector<size_t> firstVertex(sources.size() + 1, 0), order(sources.size());
+    for(size_t i = 0; i < sources.size(); ++i)
+    {
+        firstVertex[i + 1] = firstVertex[i] + sources[i].vertexCount;
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return sources[a].material < sources[b].material; });
+    
+    std::vector<std::uint32_t> indices;
+    submeshes.clear();
+    materialRanges.clear();
+    firstMaterial = 0;
+    meshlets.clear();
     
-    if((!model_data->normals.empty()) && (!model_data->tex_coords.empty()))
+    for(auto i : order)
     {
-        // Vertex, normals and texture coords are present
-        model_format = ObjFormat::Ver_Tex_Nor;
-		model_format_size = sizeof(knu::math::Vector3f) + sizeof(knu::math::Vector3f) + sizeof(knu::math::Vector2f);
-        for(auto &m : model_data->meshes)
-        {
-            meshes.push_back(Mesh());
-            meshes.back().material = m.mat_name;
-            
-            for (auto &f : m.faces)
-            {
-                meshes.back().v.push_back(knu::math::Vector3f());
-                meshes.back().t.push_back(knu::math::Vector2f());
-                meshes.back().n.push_back(knu::math::Vector3f());
-                meshes.back().v.back() = knu::math::Vector3f(model_data->vertices[f.v_index].x, model_data->vertices[f.v_index].y,
-                                                                  model_data->vertices[f.v_index].z);
-                meshes.back().t.back() = knu::math::Vector2f(model_data->tex_coords[f.t_index].x, model_data->tex_coords[f.t_index].y);
-                meshes.back().n.back() = knu::math::Vector3f(model_data->normals[f.n_index].x, model_data->normals[f.n_index].y,
-                                                                  model_data->normals[f.n_index].z);
-            }
-            
-        }
+        const auto &source = sources[i];
+        size_t first = indices.size();
+        append_indices(indices, source.indices, source.indexSize ? source.indexCount : source.vertexCount, source.indexSize, firstVertex[i]);
         
-    }else if (model_data->normals.empty() && (!model_data->tex_coords.empty()))
-    {
-        // tex coords are present, but no normals
-        model_format = ObjFormat::Ver_Tex;
-		model_format_size = sizeof(knu::math::Vector3f) + sizeof(knu::math::Vector2f);
-        for(auto &m : model_data->meshes)
+        for(size_t m = 0; m < source.meshletCount; ++m)
         {
-            meshes.push_back(Mesh());
-            meshes.back().material = m.mat_name;
-            
-            for (auto &f : m.faces)
-            {
-                meshes.back().v.push_back(knu::math::Vector3f());
-                meshes.back().t.push_back(knu::math::Vector2f());
-                
-                meshes.back().v.back() = knu::math::Vector3f(model_data->vertices[f.v_index].x, model_data->vertices[f.v_index].y,
-                                                             model_data->vertices[f.v_index].z);
-                meshes.back().t.back() = knu::math::Vector2f(model_data->tex_coords[f.t_index].x, model_data->tex_coords[f.t_index].y);
-            }
-            
+            meshlets.push_back(source.meshlets[m]);
+            meshlets.back().first_index += std::uint32_t(first);
         }
-
         
-    }else if ((!model_data->normals.empty()) && model_data->tex_coords.empty())
-    {
-        // normals are present, but no tex coords
-        model_format = ObjFormat::Ver_Nor;
-		model_format_size = sizeof(knu::math::Vector3f) + sizeof(knu::math::Vector3f);
-        
-        for(auto &m : model_data->meshes)
-        {
-            meshes.push_back(Mesh());
-            meshes.back().material = m.mat_name;
-            
-            for (auto &f : m.faces)
-            {
-                meshes.back().v.push_back(knu::math::Vector3f());
-                meshes.back().n.push_back(knu::math::Vector3f());
-                
-                meshes.back().v.back() = knu::math::Vector3f(model_data->vertices[f.v_index].x, model_data->vertices[f.v_index].y,
-                                                             model_data->vertices[f.v_index].z);
-                meshes.back().n.back() = knu::math::Vector3f(model_data->normals[f.n_index].x, model_data->normals[f.n_index].y,
-                                                             model_data->normals[f.n_index].z);
-            }
-        }
-
+        if(materialRanges.empty() || materialRanges.back().material != source.material)
+            materialRanges.push_back(MaterialRange{source.material, NO_MATERIAL, submeshes.size(), 0});
+        ++materialRanges.back().submeshCount;
+        if(i == 0)
+            firstMaterial = materialRanges.size() - 1;
         
-    }else if (model_data->normals.empty() && model_data->tex_coords.empty())
+        submeshes.push_back(Submesh{source.material, firstVertex[i], source.vertexCount, {LodRange{first, indices.size() - first, 0.0f}}});
+    }
+    indicesCount = indices.size();
+    
+    // the coarser levels follow, level by level in the same order
+    lodCount = 1;
+    for(bool more = true; more; )
     {
-        // no normals or tex coords
-        model_format = ObjFormat::Ver;
-        model_format_size = sizeof(knu::math::Vector3f);
-
-        for(auto &m : model_data->meshes)
+        more = false;
+        for(size_t k = 0; k < order.size(); ++k)
         {
-            meshes.push_back(Mesh());
-            meshes.back().material = m.mat_name;
+            const auto &lods = sources[order[k]].lods;
+            if(lods.size() < lodCount)
+                continue;
             
-            meshes.back().v.reserve(m.faces.size());
-            for (auto &f : m.faces)
-            {
-                meshes.back().v.push_back(knu::math::Vector3f());
-                meshes.back().v.back() = knu::math::Vector3f(model_data->vertices[f.v_index].x, model_data->vertices[f.v_index].y,
-                                                             model_data->vertices[f.v_index].z);
-            }
+            const auto &lod = lods[lodCount - 1];
+            submeshes[k].lodRanges.push_back(LodRange{indices.size(), lod.count, lod.error});
+            append_indices(indices, lod.indices, lod.count, lod.indexSize, firstVertex[order[k]]);
+            more = true;
         }
-
+        if(more)
+            ++lodCount;
     }
-}
-
-void Obj::make_mat()
-{
-    for (auto &m : model_data->materials)
+    
+    if(verticesCount <= 65536)
     {
-		str_mat_map[m.mat_name] = m;
+        std::vector<std::uint16_t> narrow(indices.begin(), indices.end());
+        fill_index_buffer(narrow.data(), narrow.size(), sizeof(std::uint16_t));
     }
+    else
+        fill_index_buffer(indices.data(), indices.size(), sizeof(std::uint32_t));
 }
 
-void Obj::load_obj(std::string material_name, std::string obj_name)
-{
-    auto mat_path = get_path(material_name);
-    auto obj_path = get_path(obj_name);
-    make_obj(mat_path, obj_path);
-    make_mat();
-	model_data.reset();
-}
-
-#ifndef DO_NOT_INCLUDE_MODEL_PORTION
-#ifdef __APPLE__
-#include <OpenGL/gl3.h>
-#endif
-
-#ifdef WIN32
-#include <GL/glew.h>
-#endif
-
-Model_Obj::Model_Obj():
-modelBuffer(0), modelVao(0), verticesCount(0), vSize(0), nSize(0), tSize(0)
-{
-    
-}
-
-Model_Obj::Model_Obj(std::string modelName, std::string pathOfTextures)
-{
-    load_model(modelName, pathOfTextures);
-}
-
-Model_Obj::~Model_Obj()
-{
-    destory_model();
-}
-
-void Model_Obj::load_model(std::string modelName, std::string pathOTextures)
-{
-    Obj o(modelName + ".mtl", modelName + ".obj");
-    retrieve_vertices_information(o);
-    fill_buffer(o);
-    setup_vao(o);
-    setup_materials(o);
-}
-
-void Model_Obj::retrieve_vertices_information(const knu::Obj &o)
+void Model_Obj::retrieve_vertices_information(ObjFormat format, size_t vertex_count)
 {
-    if(o.model_format == ObjFormat::Ver)
+    if(format == ObjFormat::Ver)
     {
         // only vertex information
-        verticesCount = o.get_vertex_data().size();
+        verticesCount = vertex_count;
         vertexInfo = VertexInfo::vertex;
         nSize = sizeof(knu::math::Vector3f) * verticesCount;
         bufferSize = nSize;
         
     }else
-        if(o.model_format == ObjFormat::Ver_Nor)
+        if(format == ObjFormat::Ver_Nor)
         {
             // model specifies vertex normal
-            verticesCount = o.get_vertex_data().size();
+            verticesCount = vertex_count;
             vertexInfo = VertexInfo::vertex_normal;
             vSize = verticesCount * sizeof(knu::math::Vector3f);
             nSize = vSize;
@@ -582,10 +1928,10 @@ void Model_Obj::retrieve_vertices_information(const knu::Obj &o)
             
         }
         else
-            if(o.model_format == ObjFormat::Ver_Tex)
+            if(format == ObjFormat::Ver_Tex)
             {
                 // model specifies vertex texcoord information
-                verticesCount = o.get_vertex_data().size();
+                verticesCount = vertex_count;
                 vertexInfo = VertexInfo::vertex_texture;
                 vSize = verticesCount * sizeof(knu::math::Vector3f);
                 tSize = verticesCount * sizeof(knu::math::Vector2f);
@@ -594,10 +1940,10 @@ void Model_Obj::retrieve_vertices_information(const knu::Obj &o)
                 
             }
             else
-                if(o.model_format == ObjFormat::Ver_Tex_Nor)
+                if(format == ObjFormat::Ver_Tex_Nor)
                 {
                     // model specifies vertex texcoord normal information
-                    verticesCount = o.get_vertex_data().size();
+                    verticesCount = vertex_count;
                     vertexInfo = VertexInfo::vertex_texture_normal;
                     vSize = verticesCount * sizeof(knu::math::Vector3f);
                     tSize = verticesCount * sizeof(knu::math::Vector2f);
@@ -612,100 +1958,106 @@ void Model_Obj::retrieve_vertices_information(const knu::Obj &o)
                 }
 }
 
-void Model_Obj::fill_buffer(const knu::Obj &o)
+// Makes buffer hold size bytes of data. A resident buffer is read back and compared block
+// by block, and only the runs of blocks that differ are sent; it is reallocated only when
+// data no longer fits. The read back waits for the GPU, which is fine for a reload.
+void Model_Obj::update_buffer(unsigned int &buffer, size_t &capacity, size_t &bytes, const void *data, size_t size)
 {
+    if(!buffer)
+        glGenBuffers(1, &buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
     
-    if(o.model_format == ObjFormat::Ver)
+    auto src = static_cast<const char *>(data);
+    if(size > capacity)
     {
-        // only vertex information
-        glGenBuffers(1, &modelBuffer);
-        glBindBuffer(GL_ARRAY_BUFFER, modelBuffer);
-        std::vector<knu::math::Vector3f> v = o.get_vertex_data();
-        vSize = sizeof(knu::math::Vector3f) * v.size();
-        glBufferData(GL_ARRAY_BUFFER, vSize, v.data(), GL_STATIC_DRAW);
+        glBufferData(GL_COPY_WRITE_BUFFER, size, src, GL_STATIC_DRAW);
+        capacity = bytes = size;
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        return;
     }
     
-    if(o.model_format == ObjFormat::Ver_Nor)
-    {
-        glGenBuffers(1, &modelBuffer);
-        glBindBuffer(GL_ARRAY_BUFFER, modelBuffer);
-        std::vector<knu::math::Vector3f> v = o.get_vertex_data();
-        std::vector<knu::math::Vector3f> n = o.get_normal_data();
-        vSize = sizeof(knu::math::Vector3f) * v.size();
-        nSize = sizeof(knu::math::Vector3f) * n.size();
-        glBufferData(GL_ARRAY_BUFFER, vSize + nSize, nullptr, GL_STATIC_DRAW);
-        glBufferSubData(GL_ARRAY_BUFFER, 0, vSize, v.data());
-        glBufferSubData(GL_ARRAY_BUFFER, vSize, nSize, n.data());
-    }
+    size_t resident = std::min(bytes, size);
+    std::vector<char> old(resident);
+    if(resident)
+        glGetBufferSubData(GL_COPY_WRITE_BUFFER, 0, resident, old.data());
     
-    if(o.model_format == ObjFormat::Ver_Tex)
+    const size_t block = 4096;
+    auto differs = [&](size_t at)
     {
-        glGenBuffers(1, &modelBuffer);
-        glBindBuffer(GL_ARRAY_BUFFER, modelBuffer);
-        std::vector<knu::math::Vector3f> v = o.get_vertex_data();
-        std::vector<knu::math::Vector2f> t = o.get_tex_coord_data();
-        vSize = sizeof(knu::math::Vector3f) * v.size();
-        tSize = sizeof(knu::math::Vector2f) * t.size();
-        glBufferData(GL_ARRAY_BUFFER, vSize + tSize, nullptr, GL_STATIC_DRAW);
-        glBufferSubData(GL_ARRAY_BUFFER, 0, vSize, v.data());
-        glBufferSubData(GL_ARRAY_BUFFER, vSize, tSize, t.data());
-    }
+        size_t n = std::min(block, size - at);
+        return at + n > resident || std::memcmp(old.data() + at, src + at, n) != 0;
+    };
     
-    if(o.model_format == ObjFormat::Ver_Tex_Nor)
+    for(size_t first = 0; first < size; first += block)
     {
-        glGenBuffers(1, &modelBuffer);
-        glBindBuffer(GL_ARRAY_BUFFER, modelBuffer);
-        std::vector<knu::math::Vector3f> v = o.get_vertex_data();
-        std::vector<knu::math::Vector2f> t = o.get_tex_coord_data();
-        std::vector<knu::math::Vector3f> n = o.get_normal_data();
-        vSize = sizeof(knu::math::Vector3f) * v.size();
-        tSize = sizeof(knu::math::Vector2f) * t.size();
-        nSize = sizeof(knu::math::Vector3f) * n.size();
-        glBufferData(GL_ARRAY_BUFFER, vSize + tSize + nSize, nullptr, GL_STATIC_DRAW);
-        glBufferSubData(GL_ARRAY_BUFFER, 0, vSize, v.data());
-        glBufferSubData(GL_ARRAY_BUFFER, vSize, tSize, t.data());
-        glBufferSubData(GL_ARRAY_BUFFER, vSize + tSize, nSize, n.data());
+        if(!differs(first))
+            continue;
+        
+        size_t last = first + block;
+        while(last < size && differs(last))
+            last += block;
+        last = std::min(last, size);
+        
+        glBufferSubData(GL_COPY_WRITE_BUFFER, first, last - first, src + first);
+        first = last;
     }
+    
+    bytes = size;
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+void Model_Obj::fill_index_buffer(const void *indices, size_t count, size_t index_size)
+{
+    indexType = index_size == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+    if(count || indexBuffer)
+        update_buffer(indexBuffer, indexCapacity, indexBytes, indices, count * index_size);
 }
 
-void Model_Obj::setup_vao(const knu::Obj &o)
+void Model_Obj::setup_vao(ObjFormat format)
 {
-    glGenVertexArrays(1, &modelVao);
+    // a reload reuses the vao; the attributes of the previous format are switched off
+    if(!modelVao)
+        glGenVertexArrays(1, &modelVao);
     glBindVertexArray(modelVao);
+    glDisableVertexAttribArray((int)AttributeLocations::posAttrib);
+    glDisableVertexAttribArray((int)AttributeLocations::texcAttrib);
+    glDisableVertexAttribArray((int)AttributeLocations::normAttrib);
     glBindBuffer(GL_ARRAY_BUFFER, modelBuffer);
+    if(indexBuffer)
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);     // recorded in the vao
     
-    if(o.model_format == ObjFormat::Ver)
+    if(format == ObjFormat::Ver)
     {
         // only vertex information
-        glVertexAttribPointer((int)AttributeLocations::posAttrib, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+        glVertexAttribPointer((int)AttributeLocations::posAttrib, 3, GL_FLOAT, GL_FALSE, (GLsizei)vertexLayout.position.stride, (GLvoid*)vertexLayout.position.offset);
         glEnableVertexAttribArray((int)AttributeLocations::posAttrib);
 
     }else
-        if(o.model_format == ObjFormat::Ver_Nor)
+        if(format == ObjFormat::Ver_Nor)
         {
             // model specifies vertex normal
-            glVertexAttribPointer((int)AttributeLocations::posAttrib, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
-            glVertexAttribPointer((int)AttributeLocations::normAttrib, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)vSize);
+            glVertexAttribPointer((int)AttributeLocations::posAttrib, 3, GL_FLOAT, GL_FALSE, (GLsizei)vertexLayout.position.stride, (GLvoid*)vertexLayout.position.offset);
+            glVertexAttribPointer((int)AttributeLocations::normAttrib, 3, GL_FLOAT, GL_FALSE, (GLsizei)vertexLayout.normal.stride, (GLvoid*)vertexLayout.normal.offset);
             glEnableVertexAttribArray((int)AttributeLocations::posAttrib);
             glEnableVertexAttribArray((int)AttributeLocations::normAttrib);
         }
         else
-            if(o.model_format == ObjFormat::Ver_Tex)
+            if(format == ObjFormat::Ver_Tex)
             {
                 // model specifies vertex texcoord information
-                glVertexAttribPointer((int)AttributeLocations::posAttrib, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
-                glVertexAttribPointer((int)AttributeLocations::texcAttrib, 2, GL_FLOAT, GL_FALSE, 0, (GLvoid*)vSize);
+                glVertexAttribPointer((int)AttributeLocations::posAttrib, 3, GL_FLOAT, GL_FALSE, (GLsizei)vertexLayout.position.stride, (GLvoid*)vertexLayout.position.offset);
+                glVertexAttribPointer((int)AttributeLocations::texcAttrib, 2, GL_FLOAT, GL_FALSE, (GLsizei)vertexLayout.tex_coord.stride, (GLvoid*)vertexLayout.tex_coord.offset);
                 glEnableVertexAttribArray((int)AttributeLocations::posAttrib);
                 glEnableVertexAttribArray((int)AttributeLocations::texcAttrib);
 
             }
             else
-                if(o.model_format == ObjFormat::Ver_Tex_Nor)
+                if(format == ObjFormat::Ver_Tex_Nor)
                 {
                     // model specifies vertex texcoord normal information
-                    glVertexAttribPointer((int)AttributeLocations::posAttrib, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
-                    glVertexAttribPointer((int)AttributeLocations::texcAttrib, 2, GL_FLOAT, GL_FALSE, 0, (GLvoid*)vSize);
-                    glVertexAttribPointer((int)AttributeLocations::normAttrib, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)(vSize + tSize));
+                    glVertexAttribPointer((int)AttributeLocations::posAttrib, 3, GL_FLOAT, GL_FALSE, (GLsizei)vertexLayout.position.stride, (GLvoid*)vertexLayout.position.offset);
+                    glVertexAttribPointer((int)AttributeLocations::texcAttrib, 2, GL_FLOAT, GL_FALSE, (GLsizei)vertexLayout.tex_coord.stride, (GLvoid*)vertexLayout.tex_coord.offset);
+                    glVertexAttribPointer((int)AttributeLocations::normAttrib, 3, GL_FLOAT, GL_FALSE, (GLsizei)vertexLayout.normal.stride, (GLvoid*)vertexLayout.normal.offset);
                     glEnableVertexAttribArray((int)AttributeLocations::posAttrib);
                     glEnableVertexAttribArray((int)AttributeLocations::texcAttrib);
                     glEnableVertexAttribArray((int)AttributeLocations::normAttrib);
@@ -721,16 +2073,54 @@ void Model_Obj::setup_vao(const knu::Obj &o)
     glBindVertexArray(0);
 }
 
-void Model_Obj::setup_materials(const knu::Obj &o)
+// The groups refer to the shared materials by id instead of keeping copies
+void Model_Obj::setup_materials(const std::string &material_path)
+{
+    auto ids = Material_Library::shared().load(material_path);
+    for(auto &range : materialRanges)
+    {
+        auto it = ids.find(range.material);
+        range.id = it != ids.end() ? it->second : NO_MATERIAL;
+    }
+}
+
+void Model_Obj::watch(File_Watch &watch) const
+{
+    if(modelName.empty())
+        throw std::runtime_error("watch() - the model was not loaded from a file");
+    
+    watch.add(modelName + ".obj");
+    watch.add(modelName + ".mtl");
+}
+
+bool Model_Obj::reload(const std::vector<std::string> &changed_paths)
 {
+    auto changed = [&changed_paths](const std::string &path)
+    {
+        return std::find(changed_paths.begin(), changed_paths.end(), path) != changed_paths.end();
+    };
     
-    str_mat_map = o.str_mat_map;
-    meshMaterialName = o.meshes.front().material;
-    auto it = str_mat_map.find(meshMaterialName);
-    meshMaterial = it->second;
+    if(modelName.empty())
+        return false;
     
+    bool obj_changed = changed(modelName + ".obj"), mtl_changed = changed(modelName + ".mtl");
+    
+    // read again even if the stamp looks the same; the material ids do not change
+    if(mtl_changed)
+        Material_Library::shared().load(modelName + ".mtl", true);
+    
+    // a file that does not parse throws before anything resident is touched
+    if(obj_changed)
+    {
+        Obj o(modelName + ".mtl", modelName + ".obj", load_options(lodRatios));
+        upload(o);
+    }
+    else if(mtl_changed)
+        setup_materials(modelName + ".mtl");
     
+    return obj_changed || mtl_changed;
 }
+
 void Model_Obj::destory_model()
 {
     if(modelBuffer)
@@ -739,16 +2129,25 @@ void Model_Obj::destory_model()
         glDeleteBuffers(1, &modelBuffer);
     }
     
+    if(indexBuffer)
+    {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        glDeleteBuffers(1, &indexBuffer);
+    }
+    
     if(modelVao)
     {
         glBindVertexArray(0);
         glDeleteVertexArrays(1, &modelVao);
     }
+    
+    modelBuffer = indexBuffer = modelVao = 0;
+    vertexCapacity = vertexBytes = indexCapacity = indexBytes = 0;
 }
 
 Obj_Material Model_Obj::get_obj_material() const
 {
-    return meshMaterial;
+    return get_material(firstMaterial);
 }
 
 size_t Model_Obj::get_vertices_count() const
@@ -756,10 +2155,160 @@ size_t Model_Obj::get_vertices_count() const
     return verticesCount;
 }
 
+size_t Model_Obj::get_lod_count() const
+{
+    return lodCount;
+}
+
+size_t Model_Obj::get_submesh_count() const
+{
+    return submeshes.size();
+}
+
+size_t Model_Obj::get_material_count() const
+{
+    return materialRanges.size();
+}
+
+Obj_Material Model_Obj::get_material(size_t group) const
+{
+    auto id = get_material_id(group);
+    return id != NO_MATERIAL ? Material_Library::shared().material(id) : Obj_Material();
+}
+
+Material_Id Model_Obj::get_material_id(size_t group) const
+{
+    return group < materialRanges.size() ? materialRanges[group].id : NO_MATERIAL;
+}
+
+size_t Model_Obj::select_lod(float screen_size, float pixel_error) const
+{
+    size_t level = 0;
+    for(size_t l = 1; l < lodCount; ++l)
+    {
+        float error = 0.0f;
+        for(const auto &submesh : submeshes)
+            error = std::max(error, submesh.lodRanges[std::min(l, submesh.lodRanges.size() - 1)].error);
+        
+        if(error * screen_size > pixel_error)
+            break;
+        level = l;
+    }
+    return level;
+}
+
+// Queues the index ranges of the submeshes at the level, joining the ones that touch
+void Model_Obj::add_draws(size_t firstSubmesh, size_t submeshCount, size_t level)
+{
+    size_t index_size = indexType == GL_UNSIGNED_SHORT ? sizeof(std::uint16_t) : sizeof(std::uint32_t);
+    for(size_t i = firstSubmesh; i < firstSubmesh + submeshCount; ++i)
+    {
+        const auto &ranges = submeshes[i].lodRanges;
+        const auto &range = ranges[std::min(level, ranges.size() - 1)];
+        if(!range.count)
+            continue;
+        
+        if(!drawCounts.empty() && reinterpret_cast<size_t>(drawOffsets.back()) + drawCounts.back() * index_size == range.first * index_size)
+            drawCounts.back() += (int)range.count;
+        else
+        {
+            drawCounts.push_back((int)range.count);
+            drawOffsets.push_back((const void *)(range.first * index_size));
+        }
+    }
+}
+
+void Model_Obj::multi_draw()
+{
+    if(drawCounts.size() == 1)
+        glDrawElements(GL_TRIANGLES, (GLsizei)drawCounts[0], indexType, drawOffsets[0]);
+    else if(!drawCounts.empty())
+        glMultiDrawElements(GL_TRIANGLES, (const GLsizei *)drawCounts.data(), indexType, drawOffsets.data(), (GLsizei)drawCounts.size());
+}
+
 void Model_Obj::draw()
 {
+    draw_lod(0);
+}
+
+void Model_Obj::draw(float screen_size, float pixel_error)
+{
+    draw_lod(select_lod(screen_size, pixel_error));
+}
+
+void Model_Obj::draw_lod(size_t level)
+{
+    if(!indexBuffer)
+        return;
+    
+    drawCounts.clear();
+    drawOffsets.clear();
+    add_draws(0, submeshes.size(), level);
+    
+    glBindVertexArray(modelVao);
+    multi_draw();
+    glBindVertexArray(0);
+}
+
+void Model_Obj::draw_material(size_t group, size_t level)
+{
+    if(!indexBuffer || group >= materialRanges.size())
+        return;
+    
+    drawCounts.clear();
+    drawOffsets.clear();
+    add_draws(materialRanges[group].firstSubmesh, materialRanges[group].submeshCount, level);
+    
+    glBindVertexArray(modelVao);
+    multi_draw();
+    glBindVertexArray(0);
+}
+
+void Model_Obj::draw_materials(const std::function<void(const Obj_Material &)> &bind_material, size_t level)
+{
+    if(!indexBuffer)
+        return;
+    
+    const auto &library = Material_Library::shared();
+    const Obj_Material none = Obj_Material();
+    
+    glBindVertexArray(modelVao);
+    for(size_t group = 0; group < materialRanges.size(); ++group)
+    {
+        auto id = materialRanges[group].id;
+        bind_material(id != NO_MATERIAL ? library.material(id) : none);
+        
+        drawCounts.clear();
+        drawOffsets.clear();
+        add_draws(materialRanges[group].firstSubmesh, materialRanges[group].submeshCount, level);
+        multi_draw();
+    }
+    glBindVertexArray(0);
+}
+
+void Model_Obj::draw_culled(const knu::math::m4f &model_view_proj, const knu::math::v3f &camera_position)
+{
+    if(meshlets.empty() || !indexBuffer)
+    {
+        draw();
+        return;
+    }
+    
+    cull_meshlets(meshlets, Meshlet_Frustum(model_view_proj, camera_position), meshletDraws);
+    if(meshletDraws.empty())
+        return;
+    
+    size_t index_size = indexType == GL_UNSIGNED_SHORT ? sizeof(std::uint16_t) : sizeof(std::uint32_t);
+    drawCounts.resize(meshletDraws.size());
+    drawOffsets.resize(meshletDraws.size());
+    for(size_t i = 0; i < meshletDraws.size(); ++i)
+    {
+        drawCounts[i] = (int)meshletDraws[i].index_count;
+        drawOffsets[i] = (const void *)(meshletDraws[i].first_index * index_size);
+    }
+    
     glBindVertexArray(modelVao);
-    glDrawArrays(GL_TRIANGLES, 0, (GLsizei)verticesCount);
+    glMultiDrawElements(GL_TRIANGLES, (const GLsizei *)drawCounts.data(), indexType, drawOffsets.data(), (GLsizei)drawCounts.size());
     glBindVertexArray(0);
 }
 #endif  // DO_NOT_INCLUDE_MODEL_PORTION
@@ -12,13 +12,28 @@
 #include <memory>
 #include <vector>
 #include <fstream>
-#include <regex>
+#include <string>
 #include <unordered_map>
+#include <functional>
+#include <future>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <cstddef>
+#include <cstdint>
 #include <knu/mathlibrary5.hpp>
+#include <knu/buffer_pool.hpp>
 
 
 namespace knu
 {
+    // Interned material and texture names (material_library.hpp)
+    typedef std::uint32_t Material_Id;
+    typedef std::uint32_t Texture_Id;
+    
+    const Material_Id NO_MATERIAL = 0xFFFFFFFF;
+    const Texture_Id NO_TEXTURE = 0xFFFFFFFF;
+    
     struct Obj_Material
     {
         std::string mat_name;
@@ -42,104 +57,392 @@ namespace knu
         v_index(v_index_), t_index(t_index_), n_index(n_index_) {}
     };
     
-    struct Obj_Mesh
+    // One index per face corner. Entries are 16 bit while every index of the stream fits,
+    // with all bits set marking a corner that has no such index.
+    class Obj_Index_Stream
     {
-        std::string obj_name;
-        std::string mat_name;
-        std::vector<Obj_Face> faces;
-    };
-    
+        Pool_Vector<std::uint16_t> indices16;
+        Pool_Vector<std::uint32_t> indices32;
+        bool wide = false;
+        
+        void check(int index) const
+        {
+            if(index < -1 || (!wide && index >= 0xFFFF))
+                throw std::runtime_error("Obj_Index_Stream - index out of range for the stream");
+        }
     
-    class Obj_Reader 
-    {
+    public:
+        // Picks the width for indices below count; the stream must be empty
+        void set_range(size_t count)
+        {
+            wide = count > 0xFFFF;
+        }
         
-        typedef void (Obj_Reader::* Parser)(std::string line);
-        typedef std::unordered_map<std::string, Parser>::value_type String_Parser_Map;
+        bool is_wide() const
+        {
+            return wide;
+        }
+        
+        size_t size() const
+        {
+            return wide ? indices32.size() : indices16.size();
+        }
+        
+        bool empty() const
+        {
+            return size() == 0;
+        }
+        
+        size_t capacity() const
+        {
+            return wide ? indices32.capacity() : indices16.capacity();
+        }
+        
+        void reserve(size_t count)
+        {
+            if(wide)
+                indices32.reserve(count);
+            else
+                indices16.reserve(count);
+        }
         
-        struct Mat_Compare_With_Line
+        // New entries have no index
+        void resize(size_t count)
         {
-            Mat_Compare_With_Line(std::string line_):
-            line(line_)
+            if(wide)
+                indices32.resize(count, 0xFFFFFFFFu);
+            else
+                indices16.resize(count, 0xFFFF);
+        }
+        
+        // -1 when the corner has no index
+        int operator[](size_t i) const
+        {
+            if(wide)
+                return indices32[i] == 0xFFFFFFFFu ? -1 : int(indices32[i]);
+            return indices16[i] == 0xFFFF ? -1 : int(indices16[i]);
+        }
+        
+        // -1 for no index; indices the width cannot hold throw std::runtime_error
+        void set(size_t i, int index)
+        {
+            check(index);
+            if(wide)
+                indices32[i] = std::uint32_t(index);
+            else
+                indices16[i] = std::uint16_t(index);
+        }
+        
+        void push_back(int index)
+        {
+            check(index);
+            if(wide)
+                indices32.push_back(std::uint32_t(index));
+            else
+                indices16.push_back(std::uint16_t(index));
+        }
+        
+        // Entries [first, last) of s
+        void append(const Obj_Index_Stream &s, size_t first, size_t last)
+        {
+            if(wide == s.wide)
             {
-                
+                if(wide)
+                    indices32.insert(indices32.end(), s.indices32.begin() + first, s.indices32.begin() + last);
+                else
+                    indices16.insert(indices16.end(), s.indices16.begin() + first, s.indices16.begin() + last);
+                return;
             }
             
-            bool operator()(const String_Parser_Map &p)
+            for(size_t i = first; i < last; ++i)
+                push_back(s[i]);
+        }
+    };
+    
+    // The corners of a mesh's triangles, three per triangle, as separate v/vt/vn index
+    // streams. The texture coordinate and normal streams stay empty until a corner has
+    // such an index, so meshes without them store positions alone.
+    struct Obj_Faces
+    {
+        Obj_Index_Stream v_indices;
+        Obj_Index_Stream t_indices;
+        Obj_Index_Stream n_indices;
+        
+        class const_iterator
+        {
+            const Obj_Faces *faces;
+            size_t i;
+        
+        public:
+            const_iterator(const Obj_Faces *faces_, size_t i_):faces(faces_), i(i_) {}
+            Obj_Face operator*() const { return (*faces)[i]; }
+            const_iterator &operator++() { ++i; return *this; }
+            bool operator!=(const const_iterator &other) const { return i != other.i; }
+        };
+        
+        // Index widths for a file with these many v/vt/vn elements; only while empty
+        void set_ranges(size_t vertex_count, size_t tex_coord_count, size_t normal_count)
+        {
+            v_indices.set_range(vertex_count);
+            t_indices.set_range(tex_coord_count);
+            n_indices.set_range(normal_count);
+        }
+        
+        size_t size() const
+        {
+            return v_indices.size();
+        }
+        
+        bool empty() const
+        {
+            return v_indices.empty();
+        }
+        
+        void reserve(size_t count)
+        {
+            v_indices.reserve(count);
+        }
+        
+        Obj_Face operator[](size_t i) const
+        {
+            return Obj_Face(v_indices[i], t_indices.empty() ? -1 : t_indices[i], n_indices.empty() ? -1 : n_indices[i]);
+        }
+        
+        const_iterator begin() const { return const_iterator(this, 0); }
+        const_iterator end() const { return const_iterator(this, size()); }
+        
+        void push_back(const Obj_Face &f)
+        {
+            push_index(t_indices, f.t_index);
+            push_index(n_indices, f.n_index);
+            v_indices.push_back(f.v_index);
+        }
+        
+        // Corners [first, last) of f
+        void append(const Obj_Faces &f, size_t first, size_t last)
+        {
+            append_stream(t_indices, f.t_indices, first, last);
+            append_stream(n_indices, f.n_indices, first, last);
+            v_indices.append(f.v_indices, first, last);
+        }
+    
+    private:
+        // Streams are filled up to the corners before the first index they get
+        void start_stream(Obj_Index_Stream &s)
+        {
+            s.reserve(v_indices.capacity() > size() ? v_indices.capacity() : size() + 1);
+            s.resize(size());
+        }
+        
+        void push_index(Obj_Index_Stream &s, int index)
+        {
+            if(index >= 0 && s.empty())
+                start_stream(s);
+            if(index >= 0 || !s.empty())
+                s.push_back(index);
+        }
+        
+        void append_stream(Obj_Index_Stream &s, const Obj_Index_Stream &from, size_t first, size_t last)
+        {
+            if(from.empty())
             {
-                std::regex r (p.first);
-                return (regex_search(line, r)) || (line.find(p.first) != std::string::npos);
+                if(!s.empty())
+                    s.resize(s.size() + last - first);
+                return;
             }
             
-            std::string line;
+            if(s.empty())
+                start_stream(s);
+            s.append(from, first, last);
+        }
+    };
+    
+    struct Obj_Mesh
+    {
+        std::string obj_name;
+        std::string mat_name;
+        Obj_Faces faces;
+    };
+    
+    
+    enum class ObjFormat
+    {
+        Ver = 1,    // vertex only
+        Ver_Tex,    // vertex texture
+        Ver_Nor,    // vertex normal
+        Ver_Tex_Nor // vertex texture normal
+    };
+    
+    // Where the attributes of vertex i are written in a vertex buffer: offset + i * stride
+    // bytes. Attributes with a negative offset are left out.
+    struct Vertex_Layout
+    {
+        struct Attribute
+        {
+            std::ptrdiff_t offset;
+            size_t stride;
         };
         
-        struct Obj_Compare_With_Line
+        Attribute position, tex_coord, normal;
+        size_t size;        // bytes for all the vertices
+        
+        // position, texture coordinate, normal next to each other for every vertex
+        static Vertex_Layout interleaved(ObjFormat format, size_t vertex_count)
         {
-            Obj_Compare_With_Line(std::string line_):
-            line(line_)
-            {
-                
-            }
+            bool has_t = format == ObjFormat::Ver_Tex || format == ObjFormat::Ver_Tex_Nor;
+            bool has_n = format == ObjFormat::Ver_Nor || format == ObjFormat::Ver_Tex_Nor;
+            size_t stride = 12 + (has_t ? 8 : 0) + (has_n ? 12 : 0);
             
-            bool operator()(const String_Parser_Map &p)
-            {
-                std::regex r(p.first);
-                return (std::regex_search(line, r)) || (line.find(p.first) != std::string::npos);
-            }
+            Vertex_Layout l;
+            l.position = Attribute{0, stride};
+            l.tex_coord = Attribute{has_t ? 12 : -1, stride};
+            l.normal = Attribute{has_n ? (has_t ? 20 : 12) : -1, stride};
+            l.size = stride * vertex_count;
+            return l;
+        }
+        
+        // all positions, then all texture coordinates, then all normals
+        static Vertex_Layout planar(ObjFormat format, size_t vertex_count)
+        {
+            bool has_t = format == ObjFormat::Ver_Tex || format == ObjFormat::Ver_Tex_Nor;
+            bool has_n = format == ObjFormat::Ver_Nor || format == ObjFormat::Ver_Tex_Nor;
+            std::ptrdiff_t v_size = 12 * vertex_count, t_size = has_t ? 8 * vertex_count : 0;
             
-            std::string line;
-        };
+            Vertex_Layout l;
+            l.position = Attribute{0, 12};
+            l.tex_coord = Attribute{has_t ? v_size : -1, 8};
+            l.normal = Attribute{has_n ? v_size + t_size : -1, 12};
+            l.size = v_size + t_size + (has_n ? 12 * vertex_count : 0);
+            return l;
+        }
+    };
+    
+    // Called once per mesh while the Obj is built. Returns the memory to write the mesh's
+    // vertex_count vertices to, or nullptr to keep them in Mesh::v/t/n. layout arrives as
+    // Vertex_Layout::interleaved and may be changed to any layout that fits the memory.
+    typedef std::function<void *(size_t mesh, ObjFormat format, size_t vertex_count, Vertex_Layout &layout)> Vertex_Target;
+    
+    // Shared between a load and the thread watching it
+    struct Obj_Load_Progress
+    {
+        std::atomic<std::uint64_t> bytes_parsed{0};
+        std::atomic<std::uint64_t> bytes_total{0};
+        std::atomic<bool> cancelled{false};
+    };
+    
+    // Thrown out of a load whose Obj_Load_Progress was cancelled
+    struct Obj_Load_Cancelled : std::runtime_error
+    {
+        Obj_Load_Cancelled():std::runtime_error("load cancelled") {}
+    };
+    
+    // Wall clock seconds spent in each phase of a load. The .mtl is read while the .obj is
+    // parsed, so materials overlaps the .obj phases.
+    struct Obj_Load_Timings
+    {
+        double read = 0.0;          // mapping the .obj and counting its lines, the first touch of every page
+        double tokenize = 0.0;      // parsing lines into values and face corners
+        double faces = 0.0;         // gathering each mesh's faces from the parsed chunks
+        double flatten = 0.0;       // building the meshes: welding, optimizing, LODs, normals
+        double materials = 0.0;     // reading the .mtl and building the material table
+    };
+    
+    struct Obj_Options
+    {
+        // Split the .obj file at line boundaries and tokenize the pieces on worker threads.
+        // The result is identical to the serial parse.
+        bool parallel_parse = false;
+        size_t min_chunk_bytes = 1 << 20;
         
-        void register_handlers();
+        // Weld identical v/vt/vn corners and index them instead of repeating every corner.
+        bool indexed = false;
         
-        std::string read_next_line(std::ifstream &file);
-        void read_material_file(std::string material_path);
-        void read_obj_file(std::string obj_path);
-        void dispatch_to_mat_parser(std::string line);
-        void dispatch_to_obj_parser(std::string line);
+        // With indexed: reorder triangles and vertices for the GPU caches (mesh_optimizer.hpp)
+        bool optimize = false;
         
+        // With indexed: extra index lists at these fractions of the triangle count, e.g.
+        // {0.5f, 0.25f} (mesh_simplifier.hpp)
+        std::vector<float> lod_ratios;
         
-        void mat_count_handler(std::string line);
-        void mat_name_handler(std::string line);
-        void mat_ambient_handler(std::string line);
-        void mat_diffuse_handler(std::string line);
-        void mat_specular_handler(std::string line);
-        void mat_specular_exponent_handler(std::string line);
-        void mat_opacity_handler(std::string line);
-        void mat_diffuse_texture_handler(std::string line);
-        void mat_ambient_texture_handler(std::string line);
+        // Files without vn get smooth normals, kept apart across edges where faces meet at
+        // more than crease_angle degrees (mesh_normals.hpp)
+        bool generate_normals = false;
+        float crease_angle = 180.0f;
         
-        void obj_new_mesh_handler(std::string line);
-        void obj_vertex_handler(std::string line);
-        void obj_texture_handler(std::string line);
-        void obj_normal_handler(std::string line);
-        void obj_add_mat_to_mesh_handler(std::string line);
-        void obj_face_handler(std::string line);
+        // Mesh::tangents for meshes with texture coordinates and normals kept in memory
+        bool generate_tangents = false;
         
-        inline bool check_eof(std::ifstream &file) 
-        {
-            return file.eof();
-        }
+        // With indexed: reorder each mesh's triangles into meshlets (mesh_meshlets.hpp)
+        bool meshlets = false;
         
-        std::unordered_map<std::string, Parser> obj_matches;
-        std::unordered_map<std::string, Parser> mat_matches; 
+        // Load from / write a binary cache beside the .obj (mesh_cache.hpp)
+        bool use_cache = true;
+
+        // With use_cache: keep the cache compressed (mesh_codec.hpp), for copies on slow or
+        // network storage. Positions are rounded to a 16 bit grid over each mesh's bounds and
+        // normals to 16 bit octahedral coordinates.
+        bool compress_cache = false;
+
+        // Receives the vertices of each mesh directly, e.g. in a mapped GL buffer
+        Vertex_Target vertex_target;
+        
+        // Parsed .obj bytes are counted here, and the load stops at the next chunk or
+        // submesh once cancelled is set
+        std::shared_ptr<Obj_Load_Progress> progress;
+        
+        // Filled in by the load when set (obj_benchmark.hpp)
+        std::shared_ptr<Obj_Load_Timings> timings;
+    };
+    
+    struct Obj_Chunk;
+    
+    // Parses an .mtl/.obj pair. Both files are memory mapped and tokenized in place:
+    // lines are dispatched on their first token and numbers are parsed straight out of the
+    // mapping, so no per line strings are built. Files that cannot be read or parsed throw
+    // std::runtime_error.
+    class Obj_Reader 
+    {
+        Obj_Options options;
+        
+        void read_material_file(std::string material_path);
+        void read_obj_file(std::string obj_path);
+        void merge_chunks(std::vector<Obj_Chunk> &chunks);
+        
+        Obj_Mesh &current_mesh();
         
     public:
-        Obj_Reader(std::string material_path, std::string obj_path);
-        std::vector<knu::math::Vector3f> vertices;
-        std::vector<knu::math::Vector2f> tex_coords;
-        std::vector<knu::math::Vector3f> normals;
+        Obj_Reader(std::string material_path, std::string obj_path, Obj_Options options_ = Obj_Options());
+        // transient, so drawn from Buffer_Pool
+        Pool_Vector<knu::math::Vector3f> vertices;
+        Pool_Vector<knu::math::Vector2f> tex_coords;
+        Pool_Vector<knu::math::Vector3f> normals;
         std::vector<Obj_Material> materials;
         std::vector<Obj_Mesh> meshes;
         
     };
 
-    enum class ObjFormat
+    // A simplified index list over the same vertices as the full mesh
+    struct Mesh_Lod
     {
-        Ver = 1,    // vertex only
-        Ver_Tex,    // vertex texture
-        Ver_Nor,    // vertex normal
-        Ver_Tex_Nor // vertex texture normal
+        std::vector<std::uint32_t> indices;
+        float error;        // relative to the bounding box diagonal
+    };
+    
+    // A cluster of at most 64 vertices and 124 triangles: indices [first_index,
+    // first_index + index_count) of its mesh
+    struct Meshlet
+    {
+        std::uint32_t first_index, index_count;
+        std::uint32_t vertex_count, reserved;
+        float center[3], radius;            // bounding sphere
+        float cone_apex[3], cone_cutoff;    // faces away from cameras with dot(normalize(apex - camera), axis) >= cutoff
+        float cone_axis[3], padding;
+    };
+    
+    // Range of indices to draw, e.g. one entry of a multi-draw
+    struct Meshlet_Draw
+    {
+        std::uint32_t first_index, index_count;
     };
     
     struct Mesh
@@ -148,69 +451,311 @@ namespace knu
         std::vector<knu::math::Vector3f> v;
         std::vector<knu::math::Vector2f> t;
         std::vector<knu::math::Vector3f> n;
+        
+        // Only filled when loaded with Obj_Options::indexed. v/t/n then hold every distinct
+        // corner once and three indices make a triangle; 16 bit indices are used while the
+        // mesh has no more than 65536 vertices.
+        std::vector<std::uint16_t> indices16;
+        std::vector<std::uint32_t> indices32;
+        
+        // Clusters covering the index list in order (Obj_Options::meshlets)
+        std::vector<Meshlet> meshlets;
+        
+        // Tangent per vertex, w is the bitangent sign (Obj_Options::generate_tangents)
+        std::vector<knu::math::Vector4f> tangents;
+        
+        // Coarser levels, finest first, when loaded with Obj_Options::lod_ratios
+        std::vector<Mesh_Lod> lods;
+        
+        // Vertices written to Obj_Options::vertex_target; v/t/n are empty then
+        size_t target_vertices = 0;
+        
+        size_t vertex_count() const
+        {
+            return target_vertices ? target_vertices : v.size();
+        }
+        
+        bool indexed() const
+        {
+            return !indices16.empty() || !indices32.empty();
+        }
+        
+        size_t index_count() const
+        {
+            return indices16.empty() ? indices32.size() : indices16.size();
+        }
+        
+        unsigned int index(size_t i) const
+        {
+            return indices16.empty() ? indices32[i] : indices16[i];
+        }
+        
+        // Triangle corners, whether indexed or not
+        size_t corner_count() const
+        {
+            return indexed() ? index_count() : v.size();
+        }
+        
+        // One attribute value per triangle corner, for code that wants a triangle soup
+        template<typename T>
+        std::vector<T> expand(const std::vector<T> &attribute) const
+        {
+            if(!indexed() || attribute.empty())
+                return attribute;
+            
+            std::vector<T> corners(index_count());
+            for(size_t i = 0; i < corners.size(); ++i)
+                corners[i] = attribute[index(i)];
+            return corners;
+        }
     };
     
+    class Obj_Bvh;
+    class Mesh_Cache;
+    class File_Watch;
+    
     class Obj
     {
         std::shared_ptr<knu::Obj_Reader> model_data;
+        std::vector<Obj_Faces> welded;     // distinct corners per mesh while loading indexed
         
     private:
-        void make_obj(std::string mat_path, std::string obj_path);
+        void make_obj(std::string mat_path, std::string obj_path, Obj_Options options);
+        void make_meshes(const Obj_Options &options);
+        void make_indexed_obj(const Obj_Options &options);
+        void make_targeted_obj(const Vertex_Target &target);
+        void emit_mesh(size_t index, const Obj_Faces &corners, const Vertex_Target &target);
+        void target_cached_meshes(const Vertex_Target &target);
+        void set_format();
         void make_mat();
         std::string get_path(std::string file_name);
         
     public:
         Obj();
-        Obj(std::string material_name, std::string obj_name);
-        void load_obj(std::string material_name, std::string obj_name);
+        Obj(std::string material_name, std::string obj_name, Obj_Options options = Obj_Options());
+        void load_obj(std::string material_name, std::string obj_name, Obj_Options options = Obj_Options());
+        
+        // Reads only the material file again; the meshes are left as they are
+        void load_materials(std::string material_name);
         ObjFormat model_format;
 		unsigned int model_format_size;
         std::vector<Mesh> meshes;
+        std::string material_path;      // the .mtl, whose materials Material_Library shares
         std::unordered_map<std::string, knu::Obj_Material> str_mat_map;
+        mutable std::shared_ptr<const knu::Obj_Bvh> bvh;     // picking hierarchy, built on demand (mesh_bvh.hpp)
+        
+        // Writes mesh index's vertices in the given layout. Meshes handed to a vertex target
+        // can only be written while loading; afterwards this throws std::runtime_error.
+        void write_mesh_vertices(size_t index, char *dst, const Vertex_Layout &layout) const;
         
-        std::vector<knu::math::Vector3f> get_vertex_data() const
+        const std::vector<knu::math::Vector3f> &get_vertex_data() const
         {
             return meshes.front().v;
         }
         
-        std::vector<knu::math::Vector2f> get_tex_coord_data() const
+        const std::vector<knu::math::Vector2f> &get_tex_coord_data() const
         {
             return meshes.front().t;
         }
         
-        std::vector<knu::math::Vector3f> get_normal_data() const
+        const std::vector<knu::math::Vector3f> &get_normal_data() const
         {
             return meshes.front().n;
         }
         
     };
     
+    enum class Obj_Load_Status
+    {
+        pending,
+        done,
+        cancelled,
+        failed
+    };
+    
+    struct Obj_Load_Result
+    {
+        Obj_Load_Status status;
+        std::shared_ptr<Obj> obj;       // set when done
+        std::string error;              // set when failed
+    };
+    
+    // A load running on a worker thread. Copies share the load.
+    class Obj_Load_Handle
+    {
+        std::shared_future<Obj_Load_Result> result;
+        std::shared_ptr<Obj_Load_Progress> state;
+        
+    public:
+        Obj_Load_Handle() {}
+        Obj_Load_Handle(std::shared_future<Obj_Load_Result> result_, std::shared_ptr<Obj_Load_Progress> state_):
+        result(result_), state(state_) {}
+        
+        bool valid() const { return result.valid(); }
+        
+        bool ready() const
+        {
+            return result.valid() && result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }
+        
+        // pending until the load has finished one way or another
+        Obj_Load_Status status() const
+        {
+            return ready() ? result.get().status : Obj_Load_Status::pending;
+        }
+        
+        // Parsed share of the .obj file, 0 to 1
+        float progress() const
+        {
+            if(!state)
+                return 0.0f;
+            std::uint64_t total = state->bytes_total;
+            return total ? float(double(state->bytes_parsed) / double(total)) : (ready() ? 1.0f : 0.0f);
+        }
+        
+        std::uint64_t bytes_parsed() const { return state ? std::uint64_t(state->bytes_parsed) : 0; }
+        
+        void cancel()
+        {
+            if(state)
+                state->cancelled = true;
+        }
+        
+        // Blocks until the load has finished
+        const Obj_Load_Result &wait() const
+        {
+            return result.get();
+        }
+    };
+    
+    // Loads an .mtl/.obj pair on a worker thread, like Obj(material_name, obj_name, options).
+    // Loads share a few loader threads and queue behind each other; dropping every handle
+    // neither waits for nor stops the load. Exceptions never escape; failures and
+    // cancellation come back in the result. Vertex targets run on the worker, so they must
+    // not touch a GL context.
+    Obj_Load_Handle load_obj_async(std::string material_name, std::string obj_name, Obj_Options options = Obj_Options());
+    
+    // The materials of an .mtl file by name
+    std::unordered_map<std::string, Obj_Material> read_obj_materials(std::string material_path);
+    
+    // One piece of a streamed model: welded vertices and indices for part or all of one
+    // object/material run
+    struct Obj_Stream_Block
+    {
+        std::string obj_name;
+        Mesh mesh;          // material name, vertices and 16 or 32 bit indices
+        bool mesh_end;      // last block of the run
+    };
+    
+    struct Obj_Stream_Options
+    {
+        size_t memory_ceiling = size_t(1) << 30;    // bytes the loader may hold at once
+        size_t max_block_vertices = 65536;
+    };
+    
+    // Parses an .mtl/.obj pair without building the whole model. Blocks of at most
+    // max_block_vertices vertices go to on_block as soon as they are complete, and the
+    // callback may move their contents out. Only the raw v/vt/vn values, which later faces
+    // can refer back to, and the block being filled are kept; std::runtime_error is thrown
+    // if they outgrow the memory ceiling. Returns the materials.
+    std::unordered_map<std::string, Obj_Material> stream_obj(std::string material_path, std::string obj_path,
+                                                             const std::function<void(Obj_Stream_Block &)> &on_block,
+                                                             Obj_Stream_Options options = Obj_Stream_Options());
+    
 #ifndef DO_NOT_INCLUDE_MODEL_PORTION
     
     class Model_Obj
     {
         enum class VertexInfo {vertex, vertex_texture, vertex_normal, vertex_texture_normal};
-        unsigned int modelBuffer, modelVao;
-        size_t bufferSize, verticesCount, vSize, tSize, nSize;
+        struct LodRange {size_t first, count; float error;};   // in the index buffer, level 0 first
+        
+        // Every submesh of the model shares one vertex and one index buffer. Submeshes are
+        // ordered by material, and the full detail index lists come first and back to back,
+        // so a material, or the whole model, is a single range at level 0.
+        struct Submesh {std::string material; size_t firstVertex, vertexCount; std::vector<LodRange> lodRanges;};
+        struct MaterialRange {std::string material; Material_Id id; size_t firstSubmesh, submeshCount;};
+        struct SubmeshSource;
+        
+        unsigned int modelBuffer, modelVao, indexBuffer, indexType;
+        Vertex_Layout vertexLayout;
+        size_t bufferSize, verticesCount, indicesCount, vSize, tSize, nSize;
+        size_t vertexCapacity, vertexBytes, indexCapacity, indexBytes;     // allocated and in use
+        std::string modelName;
         VertexInfo vertexInfo;
-        std::unordered_map<std::string, knu::Obj_Material> str_mat_map;
-        std::string meshMaterialName;
-        Obj_Material meshMaterial;
+        std::vector<Submesh> submeshes;
+        std::vector<MaterialRange> materialRanges;
+        size_t firstMaterial;       // group of the file's first submesh
+        size_t lodCount;
+        std::vector<float> lodRatios;
+        std::vector<Meshlet> meshlets;
+        std::vector<Meshlet_Draw> meshletDraws;
+        std::vector<int> drawCounts;
+        std::vector<const void *> drawOffsets;
         
     private:
-        void fill_buffer(const Obj &o);
-        void setup_vao(const Obj &o);
-        void retrieve_vertices_information(const Obj &o);
-        void setup_materials(const Obj &o);
+        void update_buffer(unsigned int &buffer, size_t &capacity, size_t &bytes, const void *data, size_t size);
+        void fill_index_buffer(const void *indices, size_t count, size_t index_size);
+        void setup_submeshes(const std::vector<SubmeshSource> &sources);
+        void load_cached(const Mesh_Cache &cache);
+        void setup_model(const Obj &o);
+        void add_draws(size_t firstSubmesh, size_t submeshCount, size_t level);
+        void multi_draw();
+        void setup_vao(ObjFormat format);
+        void retrieve_vertices_information(ObjFormat format, size_t vertex_count);
+        void setup_materials(const std::string &material_path);
         void destory_model();
     public:
         Model_Obj();
         Model_Obj(std::string modelname, std::string pathOfTextures);
         ~Model_Obj();
         void load_model(std::string modelname, std::string pathOfTextures);
+        
+        // Levels of detail built by load_model and reload, e.g. {0.5f, 0.25f}; none by default.
+        // Simplifying costs several times the rest of a load, so they are best built once
+        // and kept in the mesh cache.
+        void set_lod_ratios(std::vector<float> ratios);
+        
+        // Loading in the background: parse with load_model_async on any thread, then upload
+        // the finished Obj on the thread that owns the GL context.
+        static Obj_Options load_options(std::vector<float> lod_ratios = std::vector<float>());
+        static Obj_Load_Handle load_model_async(std::string modelname, std::vector<float> lod_ratios = std::vector<float>());
+        void upload(const Obj &o, std::string modelname = std::string());
+        
+        // Hot reload: add the model's .obj and .mtl to a File_Watch, then hand reload what
+        // it reports. A changed .mtl only replaces the materials. New geometry is compared
+        // with the resident buffers and only the ranges that differ are sent; the buffers
+        // are reallocated only when they have to grow. Returns whether anything changed.
+        void watch(File_Watch &watch) const;
+        bool reload(const std::vector<std::string> &changed_paths);
+        
+        // Material of the file's first submesh
         Obj_Material get_obj_material() const;
         size_t get_vertices_count() const;
+        size_t get_lod_count() const;
+        size_t get_submesh_count() const;
+        
+        // Submeshes grouped by material, in drawing order. The materials are shared through
+        // Material_Library; their ids are the same for every model using the same .mtl.
+        size_t get_material_count() const;
+        Obj_Material get_material(size_t group) const;
+        Material_Id get_material_id(size_t group) const;
+        
+        // Coarsest level whose error covers at most pixel_error pixels when the model is
+        // screen_size pixels across (lod_screen_size in mesh_simplifier.hpp). Submeshes
+        // with fewer levels use their coarsest one.
+        size_t select_lod(float screen_size, float pixel_error = 1.0f) const;
         void draw();
+        void draw(float screen_size, float pixel_error = 1.0f);
+        void draw_lod(size_t level);
+        
+        // One group of submeshes sharing a material, and every group in turn with
+        // bind_material called before each; the vao is bound once
+        void draw_material(size_t group, size_t level = 0);
+        void draw_materials(const std::function<void(const Obj_Material &)> &bind_material, size_t level = 0);
+        
+        // Full detail, skipping the meshlets outside the frustum or facing away. Both are
+        // in model space: clip = v * model_view_proj.
+        void draw_culled(const knu::math::m4f &model_view_proj, const knu::math::v3f &camera_position);
         
     };
 #endif  // DO_NOT_INCLUDE_MODEL_PORTION
@@ -0,0 +1,656 @@
+#ifndef KNU_OBJ_BENCHMARK
+#define KNU_OBJ_BENCHMARK
+
+// Reproducible measurements of the Obj loader. Procedurally generated .obj/.mtl files in
+// each of the five face layouts are loaded a few times, and the fastest load is reported
+// phase by phase (Obj_Load_Timings), together with the preparation of the interleaved
+// vertices Model_Obj uploads, throughput and peak resident memory, as JSON. Optional
+// sections load the files over and over through Buffer_Pool, and compare plain and packed
+// binary caches (mesh_cache.hpp).
+// A benchmark executable is a one line main calling obj_benchmark_main.
+
+#include <knu/obj.hpp>
+#include <knu/buffer_pool.hpp>
+#include <knu/mesh_cache.hpp>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <limits>
+
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace knu
+{
+    // The face layouts OBJ files come in
+    enum class Obj_Face_Pattern
+    {
+        vertex_triangles,           // f 1 2 3
+        vertex_quads,               // f 1 2 3 4
+        vertex_texture_normal,      // f 1/1/1 2/2/2 3/3/3
+        vertex_normal,              // f 1//1 2//2 3//3
+        vertex_texture              // f 1/1 2/2 3/3
+    };
+
+    inline const char *obj_face_pattern_name(Obj_Face_Pattern pattern)
+    {
+        switch(pattern)
+        {
+            case Obj_Face_Pattern::vertex_triangles: return "v_triangles";
+            case Obj_Face_Pattern::vertex_quads: return "v_quads";
+            case Obj_Face_Pattern::vertex_texture_normal: return "v_vt_vn";
+            case Obj_Face_Pattern::vertex_normal: return "v_vn";
+            case Obj_Face_Pattern::vertex_texture: return "v_vt";
+        }
+        return "unknown";
+    }
+
+    // Writes face_count faces over a rolling grid, in horizontal bands of material_count
+    // materials, half of them textured. The same arguments always give the same files.
+    inline void generate_benchmark_obj(const std::string &obj_path, const std::string &mtl_path, Obj_Face_Pattern pattern,
+                                       size_t face_count, size_t material_count = 4)
+    {
+        material_count = std::max<size_t>(material_count, 1);
+        bool quads = pattern == Obj_Face_Pattern::vertex_quads;
+        bool has_t = pattern == Obj_Face_Pattern::vertex_texture_normal || pattern == Obj_Face_Pattern::vertex_texture;
+        bool has_n = pattern == Obj_Face_Pattern::vertex_texture_normal || pattern == Obj_Face_Pattern::vertex_normal;
+
+        {
+            std::ofstream mtl(mtl_path);
+            if(!mtl)
+                throw std::runtime_error("generate_benchmark_obj() - unable to write " + mtl_path);
+            for(size_t m = 0; m < material_count; ++m)
+            {
+                float c = float(m + 1) / float(material_count);
+                mtl << "newmtl bench" << m << "\nNs 32.0\nKa 0 0 0\nKd " << c << " 0.5 " << 1.0f - c << "\nKs 0.5 0.5 0.5\nd 1.0\n";
+                if(m % 2 == 0)
+                    mtl << "map_Kd textures/bench" << m / 2 << ".png\n";
+                mtl << "\n";
+            }
+        }
+
+        size_t cells = quads ? face_count : (face_count + 1) / 2;
+        size_t w = std::max<size_t>(1, size_t(std::ceil(std::sqrt(double(cells)))));
+        size_t h = std::max<size_t>(1, (cells + w - 1) / w);
+
+        std::FILE *f = std::fopen(obj_path.c_str(), "wb");
+        if(!f)
+            throw std::runtime_error("generate_benchmark_obj() - unable to write " + obj_path);
+        std::vector<char> buffer(1 << 20);
+        std::setvbuf(f, buffer.data(), _IOFBF, buffer.size());
+
+        std::string mtl_name = mtl_path.substr(mtl_path.find_last_of("/\\") == std::string::npos ? 0 : mtl_path.find_last_of("/\\") + 1);
+        std::fprintf(f, "# knu benchmark: %s, %zu faces\nmtllib %s\no bench\n", obj_face_pattern_name(pattern), face_count, mtl_name.c_str());
+
+        for(size_t j = 0; j <= h; ++j)
+        {
+            for(size_t i = 0; i <= w; ++i)
+            {
+                float x = float(i) / float(w), y = float(j) / float(h);
+                float z = 0.05f * std::sin(x * 12.0f) * std::cos(y * 9.0f);
+                std::fprintf(f, "v %.6f %.6f %.6f\n", x * 2.0f - 1.0f, y * 2.0f - 1.0f, z);
+                if(has_t)
+                    std::fprintf(f, "vt %.6f %.6f\n", x, y);
+                if(has_n)
+                {
+                    float nx = -0.6f * std::cos(x * 12.0f) * std::cos(y * 9.0f), ny = 0.45f * std::sin(x * 12.0f) * std::sin(y * 9.0f);
+                    float len = std::sqrt(nx * nx + ny * ny + 1.0f);
+                    std::fprintf(f, "vn %.6f %.6f %.6f\n", nx / len, ny / len, 1.0f / len);
+                }
+            }
+        }
+
+        auto corner = [&](size_t k)
+        {
+            switch(pattern)
+            {
+                case Obj_Face_Pattern::vertex_texture_normal: std::fprintf(f, " %zu/%zu/%zu", k, k, k); break;
+                case Obj_Face_Pattern::vertex_normal: std::fprintf(f, " %zu//%zu", k, k); break;
+                case Obj_Face_Pattern::vertex_texture: std::fprintf(f, " %zu/%zu", k, k); break;
+                default: std::fprintf(f, " %zu", k); break;
+            }
+        };
+
+        size_t written = 0, band = std::max<size_t>(1, (h + material_count - 1) / material_count);
+        for(size_t j = 0; j < h && written < face_count; ++j)
+        {
+            if(j % band == 0)
+                std::fprintf(f, "usemtl bench%zu\n", j / band);
+
+            for(size_t i = 0; i < w && written < face_count; ++i)
+            {
+                size_t a = j * (w + 1) + i + 1, b = a + 1, c = a + w + 2, d = a + w + 1;
+                if(quads)
+                {
+                    std::fputc('f', f); corner(a); corner(b); corner(c); corner(d); std::fputc('\n', f);
+                    ++written;
+                    continue;
+                }
+
+                std::fputc('f', f); corner(a); corner(b); corner(c); std::fputc('\n', f);
+                if(++written == face_count)
+                    break;
+                std::fputc('f', f); corner(a); corner(c); corner(d); std::fputc('\n', f);
+                ++written;
+            }
+        }
+        std::fclose(f);
+    }
+
+    // Highest resident set size since the last reset, in bytes; 0 where unknown. Linux can
+    // reset it per measurement, elsewhere it is the peak of the whole process.
+    inline size_t peak_rss_bytes(bool reset = false)
+    {
+#if defined(__linux__)
+        if(reset)
+        {
+            std::ofstream clear("/proc/self/clear_refs");
+            clear << "5";
+            return 0;
+        }
+
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while(std::getline(status, line))
+        {
+            if(line.compare(0, 6, "VmHWM:") == 0)
+                return size_t(std::strtoull(line.c_str() + 6, nullptr, 10)) * 1024;
+        }
+        return 0;
+#elif defined(WIN32)
+        (void)reset;
+        return 0;
+#else
+        (void)reset;
+        struct rusage usage;
+        if(getrusage(RUSAGE_SELF, &usage) != 0)
+            return 0;
+#ifdef __APPLE__
+        return size_t(usage.ru_maxrss);
+#else
+        return size_t(usage.ru_maxrss) * 1024;
+#endif
+#endif
+    }
+
+    struct Obj_Benchmark_Options
+    {
+        std::string directory = ".";        // where the generated files are kept
+        std::vector<size_t> face_counts = {100000, 1000000};
+        std::vector<Obj_Face_Pattern> patterns = {Obj_Face_Pattern::vertex_triangles, Obj_Face_Pattern::vertex_quads,
+                                                  Obj_Face_Pattern::vertex_texture_normal, Obj_Face_Pattern::vertex_normal,
+                                                  Obj_Face_Pattern::vertex_texture};
+        size_t material_count = 4;
+        size_t repeats = 3;
+        bool parallel_parse = true;
+        bool indexed = false;
+        bool regenerate = false;            // write the files even if they exist
+
+        // Bulk loading: every file loaded in turn this many times, with and without
+        // Buffer_Pool; 0 skips it
+        size_t bulk_rounds = 0;
+
+        // Loads through plain and packed binary caches, warm and with the cache file dropped
+        // from the page cache
+        bool cache = false;
+    };
+
+    struct Obj_Benchmark_Result
+    {
+        Obj_Face_Pattern pattern;
+        size_t faces, obj_bytes;
+        Obj_Load_Timings timings;           // of the fastest run
+        double upload;                      // writing every mesh interleaved, as Model_Obj::upload does
+        double total;                       // load and upload
+        size_t peak_rss;                    // bytes, highest over the runs
+
+        // .obj bytes per second over read, tokenize and faces; faces per second over the total
+        double mb_per_second() const
+        {
+            double parse = timings.read + timings.tokenize + timings.faces;
+            return parse > 0.0 ? double(obj_bytes) / parse / 1e6 : 0.0;
+        }
+
+        double faces_per_second() const
+        {
+            return total > 0.0 ? double(faces) / total : 0.0;
+        }
+    };
+
+    struct Obj_Bulk_Result
+    {
+        bool pooled;
+        size_t loads;
+        double seconds;
+        Buffer_Pool_Stats pool;             // counted over the run; retained_bytes at its end
+        size_t peak_rss;
+    };
+
+    struct Obj_Cache_Result
+    {
+        Obj_Face_Pattern pattern;
+        size_t faces;
+        bool packed;
+        size_t cache_bytes;
+        double warm, cold;                  // seconds of the fastest load
+        double decode_gb_per_second;        // decoded vertex and index bytes, packed caches only
+    };
+
+    // Drops the file from the page cache where the system allows it, so the next read goes to
+    // the disk; elsewhere nothing happens and cold loads are warm ones
+    inline void evict_file_cache(const std::string &path)
+    {
+#ifdef __linux__
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0)
+            return;
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        ::close(fd);
+#else
+        (void)path;
+#endif
+    }
+
+    // Path of the generated .obj for a pattern and face count, written if needed; the .mtl
+    // sits beside it
+    inline std::string benchmark_obj_path(const Obj_Benchmark_Options &options, Obj_Face_Pattern pattern, size_t faces)
+    {
+        std::string base = options.directory + "/knu_bench_" + obj_face_pattern_name(pattern) + "_" + std::to_string(faces);
+        std::ifstream existing(base + ".obj");
+        if(options.regenerate || !existing)
+            generate_benchmark_obj(base + ".obj", base + ".mtl", pattern, faces, options.material_count);
+        return base + ".obj";
+    }
+
+    inline std::vector<Obj_Benchmark_Result> run_obj_benchmark(const Obj_Benchmark_Options &options)
+    {
+        typedef std::chrono::steady_clock clock;
+        std::vector<Obj_Benchmark_Result> results;
+
+        for(auto pattern : options.patterns)
+        {
+            for(auto faces : options.face_counts)
+            {
+                std::string obj_path = benchmark_obj_path(options, pattern, faces);
+                std::string mtl_path = obj_path.substr(0, obj_path.size() - 4) + ".mtl";
+
+                Obj_Benchmark_Result result = {};
+                result.pattern = pattern;
+                result.faces = faces;
+                {
+                    std::ifstream size(obj_path, std::ios::binary | std::ios::ate);
+                    result.obj_bytes = size_t(size.tellg());
+                }
+
+                for(size_t r = 0; r < std::max<size_t>(options.repeats, 1); ++r)
+                {
+                    Obj_Options load;
+                    load.parallel_parse = options.parallel_parse;
+                    load.indexed = options.indexed;
+                    load.use_cache = false;
+                    load.timings = std::make_shared<Obj_Load_Timings>();
+
+                    peak_rss_bytes(true);
+                    auto start = clock::now();
+
+                    Obj o(mtl_path, obj_path, load);
+                    auto loaded = clock::now();
+
+                    size_t total = 0;
+                    for(const auto &mesh : o.meshes)
+                        total += mesh.vertex_count();
+                    std::vector<char> vertices(Vertex_Layout::interleaved(o.model_format, total).size);
+                    for(size_t i = 0, first = 0; i < o.meshes.size(); ++i)
+                    {
+                        auto layout = Vertex_Layout::interleaved(o.model_format, o.meshes[i].vertex_count());
+                        o.write_mesh_vertices(i, vertices.data() + first, layout);
+                        first += layout.size;
+                    }
+                    auto end = clock::now();
+
+                    double seconds = std::chrono::duration<double>(end - start).count();
+                    result.peak_rss = std::max(result.peak_rss, peak_rss_bytes());
+                    if(r == 0 || seconds < result.total)
+                    {
+                        result.timings = *load.timings;
+                        result.upload = std::chrono::duration<double>(end - loaded).count();
+                        result.total = seconds;
+                    }
+                }
+                results.push_back(result);
+            }
+        }
+        return results;
+    }
+
+    // The corpus loaded bulk_rounds times over, as a scene loader would, first with the pool
+    // turned off and then with it retaining blocks
+    inline std::vector<Obj_Bulk_Result> run_obj_bulk_benchmark(const Obj_Benchmark_Options &options)
+    {
+        std::vector<Obj_Bulk_Result> results;
+        if(!options.bulk_rounds)
+            return results;
+
+        std::vector<std::string> paths;
+        for(auto pattern : options.patterns)
+            for(auto faces : options.face_counts)
+                paths.push_back(benchmark_obj_path(options, pattern, faces));
+
+        auto &pool = Buffer_Pool::shared();
+        const size_t pool_limit = size_t(512) << 20;
+        for(int pooled = 0; pooled < 2; ++pooled)
+        {
+            pool.set_limit(pooled ? pool_limit : 0);
+            pool.trim();
+
+            Obj_Bulk_Result result = {};
+            result.pooled = pooled != 0;
+            auto before = pool.stats();
+            peak_rss_bytes(true);
+            auto start = std::chrono::steady_clock::now();
+
+            for(size_t round = 0; round < options.bulk_rounds; ++round)
+            {
+                for(const auto &path : paths)
+                {
+                    Obj_Options load;
+                    load.parallel_parse = options.parallel_parse;
+                    load.indexed = options.indexed;
+                    load.use_cache = false;
+                    Obj o(path.substr(0, path.size() - 4) + ".mtl", path, load);
+                    ++result.loads;
+                }
+            }
+
+            result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            result.peak_rss = peak_rss_bytes();
+            auto after = pool.stats();
+            result.pool = Buffer_Pool_Stats{after.system_allocations - before.system_allocations, after.reuses - before.reuses,
+                                            after.system_frees - before.system_frees, after.retained_bytes};
+            results.push_back(result);
+        }
+        pool.set_limit(pool_limit);
+        return results;
+    }
+
+    // Time spent in unpack_mesh_vertices and unpack_mesh_indices over o's meshes, fastest of repeats
+    inline double obj_decode_seconds(const Obj &o, size_t repeats, size_t &decoded_bytes)
+    {
+        struct Stream
+        {
+            std::vector<unsigned char> vertices, indices;
+            size_t count, index_count, index_size;
+            float lo[3], hi[3];
+        };
+
+        std::vector<Stream> streams;
+        std::vector<char> block;
+        for(size_t i = 0; i < o.meshes.size(); ++i)
+        {
+            const auto &m = o.meshes[i];
+            Stream s = {};
+            s.count = m.vertex_count();
+            auto layout = Vertex_Layout::planar(o.model_format, s.count);
+            block.resize(layout.size);
+            o.write_mesh_vertices(i, block.data(), layout);
+            for(int k = 0; k < 3; ++k)
+            {
+                s.lo[k] = s.count ? std::numeric_limits<float>::max() : 0.0f;
+                s.hi[k] = s.count ? -std::numeric_limits<float>::max() : 0.0f;
+            }
+            for(const auto &v : m.v)
+            {
+                const float c[3] = {v.x, v.y, v.z};
+                for(int k = 0; k < 3; ++k)
+                {
+                    s.lo[k] = std::min(s.lo[k], c[k]);
+                    s.hi[k] = std::max(s.hi[k], c[k]);
+                }
+            }
+            if(!mesh_vertices_packable(s.lo, s.hi))
+                continue;
+            s.vertices = pack_mesh_vertices(o.model_format, block.data(), s.count, s.lo, s.hi);
+            s.index_count = m.index_count();
+            s.index_size = m.indices16.empty() ? 4 : 2;
+            if(!m.indices16.empty())
+                s.indices = pack_mesh_indices(m.indices16.data(), m.indices16.size());
+            else if(!m.indices32.empty())
+                s.indices = pack_mesh_indices(m.indices32.data(), m.indices32.size());
+            streams.push_back(std::move(s));
+        }
+
+        decoded_bytes = 0;
+        for(const auto &s : streams)
+            decoded_bytes += s.count * o.model_format_size + (s.indices.empty() ? 0 : s.index_count * s.index_size);
+
+        double best = 0.0;
+        std::vector<char> out;
+        for(size_t r = 0; r < std::max<size_t>(repeats, 1); ++r)
+        {
+            auto start = std::chrono::steady_clock::now();
+            for(const auto &s : streams)
+            {
+                out.resize(std::max(s.count * o.model_format_size, s.index_count * s.index_size) + 1);
+                if(!unpack_mesh_vertices(o.model_format, s.vertices.data(), s.vertices.size(), s.count, s.lo, s.hi, out.data()) ||
+                   (!s.indices.empty() && !unpack_mesh_indices(s.indices.data(), s.indices.size(), s.index_count, s.index_size, out.data())))
+                    throw std::runtime_error("obj_decode_seconds() - packed streams did not decode");
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if(r == 0 || seconds < best)
+                best = seconds;
+        }
+        return best;
+    }
+
+    // Every file loaded through a plain and a packed cache, each written by a first load
+    inline std::vector<Obj_Cache_Result> run_obj_cache_benchmark(const Obj_Benchmark_Options &options)
+    {
+        typedef std::chrono::steady_clock clock;
+        std::vector<Obj_Cache_Result> results;
+        if(!options.cache)
+            return results;
+
+        for(auto pattern : options.patterns)
+        {
+            for(auto faces : options.face_counts)
+            {
+                std::string obj_path = benchmark_obj_path(options, pattern, faces);
+                std::string mtl_path = obj_path.substr(0, obj_path.size() - 4) + ".mtl";
+
+                for(int packed = 0; packed < 2; ++packed)
+                {
+                    Obj_Options load;
+                    load.parallel_parse = options.parallel_parse;
+                    load.indexed = options.indexed;
+                    load.compress_cache = packed != 0;
+                    Mesh_Cache_Source source(obj_path, mtl_path, load);
+                    auto cache_path = mesh_cache_path(source);
+                    std::remove(cache_path.c_str());
+                    {
+                        Obj first(mtl_path, obj_path, load);
+                    }
+
+                    Obj_Cache_Result result = {};
+                    result.pattern = pattern;
+                    result.faces = faces;
+                    result.packed = packed != 0;
+                    {
+                        std::ifstream size(cache_path, std::ios::binary | std::ios::ate);
+                        if(!size)
+                            throw std::runtime_error("run_obj_cache_benchmark() - no cache written for " + obj_path);
+                        result.cache_bytes = size_t(size.tellg());
+                    }
+
+                    for(int cold = 0; cold < 2; ++cold)
+                    {
+                        double &best = cold ? result.cold : result.warm;
+                        for(size_t r = 0; r < std::max<size_t>(options.repeats, 1); ++r)
+                        {
+                            if(cold)
+                                evict_file_cache(cache_path);
+                            auto start = clock::now();
+                            Obj o(mtl_path, obj_path, load);
+                            double seconds = std::chrono::duration<double>(clock::now() - start).count();
+                            if(r == 0 || seconds < best)
+                                best = seconds;
+
+                            if(packed && !cold && r == 0)
+                            {
+                                size_t decoded = 0;
+                                double decode = obj_decode_seconds(o, options.repeats, decoded);
+                                result.decode_gb_per_second = decode > 0.0 ? double(decoded) / decode / 1e9 : 0.0;
+                            }
+                        }
+                    }
+                    results.push_back(result);
+                }
+            }
+        }
+        return results;
+    }
+
+    inline std::string obj_benchmark_json(const std::vector<Obj_Benchmark_Result> &results, const Obj_Benchmark_Options &options,
+                                          const std::vector<Obj_Bulk_Result> &bulk = std::vector<Obj_Bulk_Result>(),
+                                          const std::vector<Obj_Cache_Result> &cache = std::vector<Obj_Cache_Result>())
+    {
+        std::ostringstream out;
+        char number[64];
+        auto seconds = [&number](double s) -> const char *
+        {
+            std::snprintf(number, sizeof(number), "%.6f", s);
+            return number;
+        };
+
+        out << "{\n  \"benchmark\": \"obj_load\",\n";
+        out << "  \"parallel_parse\": " << (options.parallel_parse ? "true" : "false") << ",\n";
+        out << "  \"indexed\": " << (options.indexed ? "true" : "false") << ",\n";
+        out << "  \"repeats\": " << options.repeats << ",\n";
+        out << "  \"results\": [";
+        for(size_t i = 0; i < results.size(); ++i)
+        {
+            const auto &r = results[i];
+            out << (i ? ",\n" : "\n") << "    {\"pattern\": \"" << obj_face_pattern_name(r.pattern) << "\", \"faces\": " << r.faces
+                << ", \"obj_bytes\": " << r.obj_bytes << ",\n     \"seconds\": {";
+            out << "\"read\": " << seconds(r.timings.read);
+            out << ", \"tokenize\": " << seconds(r.timings.tokenize);
+            out << ", \"faces\": " << seconds(r.timings.faces);
+            out << ", \"flatten\": " << seconds(r.timings.flatten);
+            out << ", \"materials\": " << seconds(r.timings.materials);
+            out << ", \"upload\": " << seconds(r.upload);
+            out << ", \"total\": " << seconds(r.total) << "},\n";
+            std::snprintf(number, sizeof(number), "%.2f", r.mb_per_second());
+            out << "     \"mb_per_second\": " << number;
+            std::snprintf(number, sizeof(number), "%.0f", r.faces_per_second());
+            out << ", \"faces_per_second\": " << number << ", \"peak_rss_bytes\": " << r.peak_rss << "}";
+        }
+        out << "\n  ]";
+
+        if(!bulk.empty())
+        {
+            out << ",\n  \"bulk\": [";
+            for(size_t i = 0; i < bulk.size(); ++i)
+            {
+                const auto &b = bulk[i];
+                out << (i ? ",\n" : "\n") << "    {\"pooled\": " << (b.pooled ? "true" : "false") << ", \"loads\": " << b.loads
+                    << ", \"seconds\": " << seconds(b.seconds) << ", \"system_allocations\": " << b.pool.system_allocations
+                    << ", \"reuses\": " << b.pool.reuses << ", \"system_frees\": " << b.pool.system_frees
+                    << ", \"retained_bytes\": " << b.pool.retained_bytes << ", \"peak_rss_bytes\": " << b.peak_rss << "}";
+            }
+            out << "\n  ]";
+        }
+
+        if(!cache.empty())
+        {
+            out << ",\n  \"cache\": [";
+            for(size_t i = 0; i < cache.size(); ++i)
+            {
+                const auto &c = cache[i];
+                out << (i ? ",\n" : "\n") << "    {\"pattern\": \"" << obj_face_pattern_name(c.pattern) << "\", \"faces\": " << c.faces
+                    << ", \"packed\": " << (c.packed ? "true" : "false") << ", \"cache_bytes\": " << c.cache_bytes
+                    << ", \"warm_seconds\": " << seconds(c.warm);
+                out << ", \"cold_seconds\": " << seconds(c.cold);
+                std::snprintf(number, sizeof(number), "%.2f", c.decode_gb_per_second);
+                out << ", \"decode_gb_per_second\": " << number << "}";
+            }
+            out << "\n  ]";
+        }
+        out << "\n}\n";
+        return out.str();
+    }
+
+    // Command line: --dir path, --faces n[,n...], --repeats n, --materials n, --serial,
+    // --indexed, --regenerate, --bulk rounds, --cache. Prints the JSON report; returns a process
+    // exit code.
+    inline int obj_benchmark_main(int argc, char **argv)
+    {
+        Obj_Benchmark_Options options;
+        try
+        {
+            for(int i = 1; i < argc; ++i)
+            {
+                std::string arg = argv[i];
+                auto value = [&]() -> std::string
+                {
+                    if(i + 1 >= argc)
+                        throw std::runtime_error("missing value for " + arg);
+                    return argv[++i];
+                };
+
+                if(arg == "--dir")
+                    options.directory = value();
+                else if(arg == "--faces")
+                {
+                    options.face_counts.clear();
+                    std::stringstream list(value());
+                    std::string count;
+                    while(std::getline(list, count, ','))
+                        options.face_counts.push_back(size_t(std::stoull(count)));
+                }
+                else if(arg == "--repeats")
+                    options.repeats = size_t(std::stoull(value()));
+                else if(arg == "--materials")
+                    options.material_count = size_t(std::stoull(value()));
+                else if(arg == "--serial")
+                    options.parallel_parse = false;
+                else if(arg == "--indexed")
+                    options.indexed = true;
+                else if(arg == "--regenerate")
+                    options.regenerate = true;
+                else if(arg == "--bulk")
+                    options.bulk_rounds = size_t(std::stoull(value()));
+                else if(arg == "--cache")
+                    options.cache = true;
+                else
+                    throw std::runtime_error("unknown argument " + arg);
+            }
+
+            auto results = run_obj_benchmark(options);
+            auto bulk = run_obj_bulk_benchmark(options);
+            auto cache = run_obj_cache_benchmark(options);
+            std::fputs(obj_benchmark_json(results, options, bulk, cache).c_str(), stdout);
+        }catch(std::exception &ex)
+        {
+            std::fprintf(stderr, "obj benchmark: %s\n", ex.what());
+            return 1;
+        }
+        return 0;
+    }
+}
+
+#endif  // KNU_OBJ_BENCHMARK
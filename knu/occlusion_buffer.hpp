@@ -0,0 +1,235 @@
+#ifndef KNU_OCCLUSION_BUFFER
+#define KNU_OCCLUSION_BUFFER
+
+// Low resolution CPU depth buffer for occlusion culling.
+// Occluder meshes are rasterized with software_rasterizer, then a depth pyramid is built
+// where every texel holds the farthest depth of the 2x2 block below it. A bound is occluded
+// when its nearest depth is behind every pyramid texel its screen rectangle touches, so the
+// test never culls anything visible.
+
+#include <knu/software_rasterizer.hpp>
+#include <knu/geometrics.hpp>
+#include <knu/parallel.hpp>
+#include <vector>
+#include <cmath>
+#include <limits>
+
+namespace knu
+{
+    namespace graphics
+    {
+        class occlusion_buffer
+        {
+            struct level
+            {
+                int w, h;
+                std::vector<float> depth;
+            };
+
+            software_rasterizer raster;
+            std::vector<level> pyramid;
+            knu::math::m4f view_proj;
+            bool built;
+
+        private:
+            void build_pyramid()
+            {
+                const auto &src = raster.depth_buffer();
+                int pitch = raster.depth_pitch();
+
+                auto &base = pyramid[0];
+                for(int y = 0; y < base.h; ++y)
+                    std::copy(&src[(size_t)y * pitch], &src[(size_t)y * pitch] + base.w, &base.depth[(size_t)y * base.w]);
+
+                for(size_t l = 1; l < pyramid.size(); ++l)
+                {
+                    const auto &fine = pyramid[l - 1];
+                    auto &coarse = pyramid[l];
+
+                    parallel_for_ranges(coarse.h, [&](size_t begin, size_t end)
+                    {
+                        for(size_t y = begin; y < end; ++y)
+                        {
+                            int y0 = std::min((int)y * 2, fine.h - 1), y1 = std::min((int)y * 2 + 1, fine.h - 1);
+                            for(int x = 0; x < coarse.w; ++x)
+                            {
+                                int x0 = std::min(x * 2, fine.w - 1), x1 = std::min(x * 2 + 1, fine.w - 1);
+                                coarse.depth[y * coarse.w + x] = std::max(
+                                    std::max(fine.depth[y0 * fine.w + x0], fine.depth[y0 * fine.w + x1]),
+                                    std::max(fine.depth[y1 * fine.w + x0], fine.depth[y1 * fine.w + x1]));
+                            }
+                        }
+                    }, 16);
+                }
+
+                built = true;
+            }
+
+            // Screen rectangle and nearest depth of a world space box; false when it crosses the near plane
+            bool project_box(const knu::math::v3f &lo, const knu::math::v3f &hi, float rect[4], float &nearest) const
+            {
+                rect[0] = rect[1] = std::numeric_limits<float>::max();
+                rect[2] = rect[3] = -std::numeric_limits<float>::max();
+                nearest = std::numeric_limits<float>::max();
+
+                for(int i = 0; i < 8; ++i)
+                {
+                    knu::math::v4f corner((i & 1) ? hi.x : lo.x, (i & 2) ? hi.y : lo.y, (i & 4) ? hi.z : lo.z, 1.0f);
+                    auto c = corner * view_proj;
+
+                    if(c.w <= 1e-5f || c.z < -c.w)
+                        return false;
+
+                    float inv_w = 1.0f / c.w;
+                    float sx = (c.x * inv_w * 0.5f + 0.5f) * pyramid[0].w;
+                    float sy = (0.5f - c.y * inv_w * 0.5f) * pyramid[0].h;
+                    float sz = c.z * inv_w * 0.5f + 0.5f;
+
+                    rect[0] = std::min(rect[0], sx);
+                    rect[1] = std::min(rect[1], sy);
+                    rect[2] = std::max(rect[2], sx);
+                    rect[3] = std::max(rect[3], sy);
+                    nearest = std::min(nearest, sz);
+                }
+
+                return true;
+            }
+
+        public:
+            occlusion_buffer(int width = 256, int height = 128):
+            raster(width, height, 32), pyramid(), view_proj(), built(false)
+            {
+                raster.set_cull_back_faces(true);
+
+                int w = width, h = height;
+                while(true)
+                {
+                    level l;
+                    l.w = w;
+                    l.h = h;
+                    l.depth.assign((size_t)w * h, 1.0f);
+                    pyramid.push_back(std::move(l));
+
+                    if(w == 1 && h == 1)
+                        break;
+
+                    w = std::max(1, (w + 1) / 2);
+                    h = std::max(1, (h + 1) / 2);
+                }
+            }
+
+            // Starts a frame; occluders and tests both use this view projection
+            void begin(const knu::math::m4f &view_projection)
+            {
+                view_proj = view_projection;
+                raster.clear(knu::math::v4f(0.0f, 0.0f, 0.0f, 0.0f));
+                built = false;
+            }
+
+            void add_occluder(const float *positions, size_t stride, size_t vertex_count, const knu::math::m4f &model)
+            {
+                raster.draw(positions, stride, nullptr, 0, vertex_count, model * view_proj, model, knu::math::v4f());
+                built = false;
+            }
+
+            void add_occluder(const Obj &o, const knu::math::m4f &model)
+            {
+                for(const auto &m : o.meshes)
+                {
+                    if(m.v.empty())
+                        continue;
+                    
+                    if(m.indexed())
+                    {
+                        auto v = m.expand(m.v);
+                        add_occluder(&v[0].x, 3, v.size(), model);
+                    }
+                    else
+                        add_occluder(&m.v[0].x, 3, m.v.size(), model);
+                }
+            }
+
+            // Rasterizes the occluders on worker threads and builds the depth pyramid
+            void finish()
+            {
+                raster.flush();
+                build_pyramid();
+            }
+
+            bool is_visible(const knu::math::v3f &lo, const knu::math::v3f &hi) const
+            {
+                if(!built)
+                    return true;
+
+                float rect[4], nearest;
+                if(!project_box(lo, hi, rect, nearest))
+                    return true;
+
+                const auto &base = pyramid[0];
+                if(rect[2] < 0.0f || rect[3] < 0.0f || rect[0] >= base.w || rect[1] >= base.h)
+                    return false;       // entirely off screen
+
+                int x0 = std::max(0, (int)std::floor(rect[0]));
+                int y0 = std::max(0, (int)std::floor(rect[1]));
+                int x1 = std::min(base.w - 1, (int)std::floor(rect[2]));
+                int y1 = std::min(base.h - 1, (int)std::floor(rect[3]));
+
+                // pick the level where the rectangle covers at most a few texels
+                size_t l = 0;
+                while(l + 1 < pyramid.size() && ((x1 - x0) > 3 || (y1 - y0) > 3))
+                {
+                    x0 >>= 1; y0 >>= 1; x1 >>= 1; y1 >>= 1;
+                    ++l;
+                }
+
+                const auto &lv = pyramid[l];
+                for(int y = y0; y <= y1; ++y)
+                {
+                    for(int x = x0; x <= x1; ++x)
+                    {
+                        if(nearest <= lv.depth[y * lv.w + x])
+                            return true;
+                    }
+                }
+
+                return false;
+            }
+
+            bool is_visible(const Aabb &box) const
+            {
+                return is_visible(box.min_point(), box.max_point());
+            }
+
+            bool is_visible(const Sphere &s) const
+            {
+                knu::math::v3f r(s.radius(), s.radius(), s.radius());
+                return is_visible(s.center() - r, s.center() + r);
+            }
+
+            // Batch tests; visible[i] is 1 for bounds that may be seen
+            void test(const std::vector<Sphere> &bounds, std::vector<unsigned char> &visible) const
+            {
+                visible.resize(bounds.size());
+                parallel_for_ranges(bounds.size(), [&](size_t begin, size_t end)
+                {
+                    for(size_t i = begin; i < end; ++i)
+                        visible[i] = is_visible(bounds[i]) ? 1 : 0;
+                }, 256);
+            }
+
+            void test(const std::vector<Aabb> &bounds, std::vector<unsigned char> &visible) const
+            {
+                visible.resize(bounds.size());
+                parallel_for_ranges(bounds.size(), [&](size_t begin, size_t end)
+                {
+                    for(size_t i = begin; i < end; ++i)
+                        visible[i] = is_visible(bounds[i]) ? 1 : 0;
+                }, 256);
+            }
+
+            const raster_stats &statistics() const { return raster.statistics(); }
+        };
+    }
+}
+
+#endif  // KNU_OCCLUSION_BUFFER
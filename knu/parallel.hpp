@@ -0,0 +1,65 @@
+#ifndef KNU_PARALLEL
+#define KNU_PARALLEL
+
+// Small helpers for spreading independent work across cores with std::async.
+// Exceptions thrown by a task are rethrown on the calling thread.
+
+#include <future>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+namespace knu
+{
+    inline unsigned int worker_count()
+    {
+        unsigned int n = std::thread::hardware_concurrency();
+        return n ? n : 1;
+    }
+
+    // Calls fn(begin, end) on contiguous ranges covering [0, count).
+    // Ranges are never smaller than min_per_task, so small jobs stay on the calling thread.
+    template<typename Fn>
+    void parallel_for_ranges(size_t count, Fn fn, size_t min_per_task = 1)
+    {
+        if(count == 0)
+            return;
+
+        size_t tasks = std::min<size_t>(worker_count(), (count + min_per_task - 1) / std::max<size_t>(min_per_task, 1));
+
+        if(tasks <= 1)
+        {
+            fn(size_t(0), count);
+            return;
+        }
+
+        size_t per_task = (count + tasks - 1) / tasks;
+        std::vector<std::future<void>> futures;
+        futures.reserve(tasks);
+
+        for(size_t begin = per_task; begin < count; begin += per_task)
+        {
+            size_t end = std::min(begin + per_task, count);
+            futures.push_back(std::async(std::launch::async, [&fn, begin, end]() { fn(begin, end); }));
+        }
+
+        // the calling thread takes the first range
+        fn(size_t(0), std::min(per_task, count));
+
+        for(auto &f : futures)
+            f.get();
+    }
+
+    // Calls fn(i) for every i in [0, count)
+    template<typename Fn>
+    void parallel_for(size_t count, Fn fn, size_t min_per_task = 1)
+    {
+        parallel_for_ranges(count, [&fn](size_t begin, size_t end)
+        {
+            for(size_t i = begin; i < end; ++i)
+                fn(i);
+        }, min_per_task);
+    }
+}
+
+#endif  // KNU_PARALLEL
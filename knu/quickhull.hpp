@@ -0,0 +1,404 @@
+#ifndef KNU_QUICKHULL
+#define KNU_QUICKHULL
+
+// 3D quickhull for building convex collision proxies from point clouds or loaded Obj meshes.
+
+#include <knu/mathlibrary5.hpp>
+#include <knu/obj.hpp>
+#include <knu/parallel.hpp>
+#include <vector>
+#include <queue>
+#include <unordered_map>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+
+namespace knu
+{
+    struct Convex_Hull
+    {
+        std::vector<knu::math::v3f> vertices;   // only the points on the hull
+        std::vector<unsigned int> indices;      // 3 per face into vertices, counter clockwise seen from outside
+        std::vector<knu::math::v4f> planes;     // outward normal in xyz, plane offset in w, one per face
+
+        // Farthest hull vertex along dir, for GJK/EPA style queries
+        knu::math::v3f support(const knu::math::v3f &dir) const
+        {
+            size_t best = 0;
+            float best_dot = -std::numeric_limits<float>::max();
+
+            for(size_t i = 0; i < vertices.size(); ++i)
+            {
+                float d = vertices[i].dot(dir);
+                if(d > best_dot)
+                {
+                    best_dot = d;
+                    best = i;
+                }
+            }
+
+            return vertices.empty() ? knu::math::v3f() : vertices[best];
+        }
+
+        bool contains(const knu::math::v3f &p) const
+        {
+            for(const auto &pl : planes)
+            {
+                if(pl.x * p.x + pl.y * p.y + pl.z * p.z > pl.w)
+                    return false;
+            }
+
+            return !planes.empty();
+        }
+    };
+
+    namespace detail
+    {
+        class Quickhull_Builder
+        {
+            struct Face
+            {
+                unsigned int v[3];
+                knu::math::v3d n;     // planes in double so slivers near the horizon keep their orientation
+                double d;
+                std::vector<unsigned int> outside;
+                unsigned int eye;       // farthest outside point
+                float eye_distance;
+                bool alive;
+            };
+
+            typedef std::pair<float, unsigned int> Candidate;   // eye distance, face
+
+            const std::vector<knu::math::v3f> &points;
+            std::vector<Face> faces;
+            std::unordered_map<std::uint64_t, unsigned int> edge_face;  // directed edge -> owning face
+            std::vector<bool> on_hull;
+            float eps;
+
+            static std::uint64_t edge_key(unsigned int a, unsigned int b)
+            {
+                return (std::uint64_t(a) << 32) | b;
+            }
+
+            float distance(const Face &f, unsigned int p) const
+            {
+                return float(f.n.dot(knu::math::v3d(points[p])) - f.d);
+            }
+
+            unsigned int add_face(unsigned int a, unsigned int b, unsigned int c)
+            {
+                Face f;
+                f.v[0] = a; f.v[1] = b; f.v[2] = c;
+                knu::math::v3d pa(points[a]), pb(points[b]), pc(points[c]);
+                f.n = (pb - pa).cross(pc - pa);
+                f.n.normalize();
+                f.d = f.n.dot(pa);
+                f.alive = true;
+
+                auto index = (unsigned int)faces.size();
+                f.eye = 0;
+                f.eye_distance = 0.0f;
+                faces.push_back(std::move(f));
+                edge_face[edge_key(a, b)] = index;
+                edge_face[edge_key(b, c)] = index;
+                edge_face[edge_key(c, a)] = index;
+                return index;
+            }
+
+            void assign(const std::vector<unsigned int> &candidates, const std::vector<unsigned int> &targets)
+            {
+                for(auto p : candidates)
+                {
+                    if(on_hull[p])
+                        continue;
+
+                    for(auto fi : targets)
+                    {
+                        if(distance(faces[fi], p) > eps)
+                        {
+                            faces[fi].outside.push_back(p);
+                            break;
+                        }
+                    }
+                }
+            }
+
+            // Finds the farthest outside point of each target and queues the faces that have one
+            void queue_eyes(const std::vector<unsigned int> &targets, std::priority_queue<Candidate> &queue)
+            {
+                for(auto fi : targets)
+                {
+                    auto &f = faces[fi];
+                    if(f.outside.empty())
+                        continue;
+
+                    f.eye = f.outside.front();
+                    f.eye_distance = distance(f, f.eye);
+                    for(auto p : f.outside)
+                    {
+                        float d = distance(f, p);
+                        if(d > f.eye_distance)
+                        {
+                            f.eye_distance = d;
+                            f.eye = p;
+                        }
+                    }
+                    queue.push(Candidate(f.eye_distance, fi));
+                }
+            }
+
+            bool initial_simplex(unsigned int s[4])
+            {
+                // extremes along the axes, then the pair farthest apart
+                unsigned int ext[6] = {0, 0, 0, 0, 0, 0};
+                for(unsigned int i = 0; i < points.size(); ++i)
+                {
+                    const auto &p = points[i];
+                    if(p.x < points[ext[0]].x) ext[0] = i;
+                    if(p.x > points[ext[1]].x) ext[1] = i;
+                    if(p.y < points[ext[2]].y) ext[2] = i;
+                    if(p.y > points[ext[3]].y) ext[3] = i;
+                    if(p.z < points[ext[4]].z) ext[4] = i;
+                    if(p.z > points[ext[5]].z) ext[5] = i;
+                }
+
+                float best = -1.0f;
+                for(int i = 0; i < 6; ++i)
+                {
+                    for(int j = i + 1; j < 6; ++j)
+                    {
+                        float d = (points[ext[i]] - points[ext[j]]).length_squared();
+                        if(d > best)
+                        {
+                            best = d;
+                            s[0] = ext[i];
+                            s[1] = ext[j];
+                        }
+                    }
+                }
+
+                if(best <= eps * eps)
+                    return false;
+
+                // farthest from the line
+                auto dir = points[s[1]] - points[s[0]];
+                dir.normalize();
+                best = -1.0f;
+                for(unsigned int i = 0; i < points.size(); ++i)
+                {
+                    auto w = points[i] - points[s[0]];
+                    float d = (w - dir * w.dot(dir)).length_squared();
+                    if(d > best)
+                    {
+                        best = d;
+                        s[2] = i;
+                    }
+                }
+
+                if(best <= eps * eps)
+                    return false;
+
+                // farthest from the plane
+                auto n = (points[s[1]] - points[s[0]]).cross(points[s[2]] - points[s[0]]);
+                n.normalize();
+                best = -1.0f;
+                for(unsigned int i = 0; i < points.size(); ++i)
+                {
+                    float d = std::fabs(n.dot(points[i] - points[s[0]]));
+                    if(d > best)
+                    {
+                        best = d;
+                        s[3] = i;
+                    }
+                }
+
+                return best > eps;
+            }
+
+        public:
+            Quickhull_Builder(const std::vector<knu::math::v3f> &pts):
+            points(pts), faces(), edge_face(), on_hull(pts.size(), false), eps(0.0f)
+            {
+                float extent = 0.0f;
+                for(const auto &p : points)
+                    extent = std::max({extent, std::fabs(p.x), std::fabs(p.y), std::fabs(p.z)});
+
+                eps = 3.0f * std::numeric_limits<float>::epsilon() * std::max(extent, 1.0f) * 16.0f;
+            }
+
+            Convex_Hull build(size_t max_vertices)
+            {
+                Convex_Hull hull;
+                unsigned int s[4];
+
+                if(points.size() < 4 || !initial_simplex(s))
+                {
+                    // flat or degenerate input: keep the points so support() still works
+                    hull.vertices = points;
+                    return hull;
+                }
+
+                // orient the tetrahedron so every face points away from the fourth vertex
+                auto n = (points[s[1]] - points[s[0]]).cross(points[s[2]] - points[s[0]]);
+                if(n.dot(points[s[3]] - points[s[0]]) > 0.0f)
+                    std::swap(s[1], s[2]);
+
+                std::vector<unsigned int> initial;
+                initial.push_back(add_face(s[0], s[1], s[2]));
+                initial.push_back(add_face(s[0], s[3], s[1]));
+                initial.push_back(add_face(s[1], s[3], s[2]));
+                initial.push_back(add_face(s[2], s[3], s[0]));
+
+                size_t hull_vertices = 4;
+                for(int i = 0; i < 4; ++i)
+                    on_hull[s[i]] = true;
+
+                std::vector<unsigned int> all(points.size());
+                for(unsigned int i = 0; i < all.size(); ++i)
+                    all[i] = i;
+                assign(all, initial);
+
+                // the point farthest outside any face becomes the next hull vertex, so a hull
+                // stopped at max_vertices has its most distant points
+                std::priority_queue<Candidate> queue;
+                queue_eyes(initial, queue);
+                std::vector<unsigned int> visible, new_faces, orphans;
+                std::vector<std::pair<unsigned int, unsigned int>> horizon;
+
+                while(!queue.empty())
+                {
+                    if(max_vertices && hull_vertices >= max_vertices)
+                        break;
+
+                    auto fi = queue.top().second;
+                    queue.pop();
+
+                    if(!faces[fi].alive || faces[fi].outside.empty())
+                        continue;
+
+                    unsigned int eye = faces[fi].eye;
+
+                    // flood out over every face the eye can see
+                    visible.clear();
+                    visible.push_back(fi);
+                    faces[fi].alive = false;
+
+                    for(size_t i = 0; i < visible.size(); ++i)
+                    {
+                        const auto &f = faces[visible[i]];
+                        for(int e = 0; e < 3; ++e)
+                        {
+                            auto it = edge_face.find(edge_key(f.v[(e + 1) % 3], f.v[e]));
+                            if(it == edge_face.end())
+                                continue;
+
+                            // no tolerance here: a nearly coplanar neighbour left in place
+                            // would fold the new face over it
+                            auto &adj = faces[it->second];
+                            if(adj.alive && adj.n.dot(knu::math::v3d(points[eye])) - adj.d > 0.0)
+                            {
+                                adj.alive = false;
+                                visible.push_back(it->second);
+                            }
+                        }
+                    }
+
+                    // horizon edges are visible-face edges whose twin belongs to a hidden face
+                    horizon.clear();
+                    orphans.clear();
+                    for(auto vi : visible)
+                    {
+                        const auto &f = faces[vi];
+                        for(int e = 0; e < 3; ++e)
+                        {
+                            unsigned int a = f.v[e], b = f.v[(e + 1) % 3];
+                            auto it = edge_face.find(edge_key(b, a));
+                            if(it != edge_face.end() && faces[it->second].alive)
+                                horizon.push_back(std::make_pair(a, b));
+                        }
+
+                        orphans.insert(orphans.end(), f.outside.begin(), f.outside.end());
+                    }
+
+                    for(auto vi : visible)
+                    {
+                        const auto &f = faces[vi];
+                        for(int e = 0; e < 3; ++e)
+                        {
+                            auto it = edge_face.find(edge_key(f.v[e], f.v[(e + 1) % 3]));
+                            if(it != edge_face.end() && it->second == vi)
+                                edge_face.erase(it);
+                        }
+                        faces[vi].outside.clear();
+                        faces[vi].outside.shrink_to_fit();
+                    }
+
+                    on_hull[eye] = true;
+                    ++hull_vertices;
+
+                    new_faces.clear();
+                    for(const auto &e : horizon)
+                        new_faces.push_back(add_face(e.first, e.second, eye));
+
+                    assign(orphans, new_faces);
+                    queue_eyes(new_faces, queue);
+                }
+
+                // compact to only the vertices that are still referenced
+                std::vector<int> remap(points.size(), -1);
+                for(const auto &f : faces)
+                {
+                    if(!f.alive)
+                        continue;
+
+                    for(int e = 0; e < 3; ++e)
+                    {
+                        if(remap[f.v[e]] < 0)
+                        {
+                            remap[f.v[e]] = (int)hull.vertices.size();
+                            hull.vertices.push_back(points[f.v[e]]);
+                        }
+                        hull.indices.push_back((unsigned int)remap[f.v[e]]);
+                    }
+
+                    hull.planes.push_back(knu::math::v4f(knu::math::v3f(f.n), float(f.d)));
+                }
+
+                return hull;
+            }
+        };
+    }
+
+    // Convex hull of a point cloud. A non zero max_vertices stops refinement once the
+    // hull has that many vertices; the point farthest outside the hull so far is always
+    // added next.
+    inline Convex_Hull make_convex_hull(const std::vector<knu::math::v3f> &points, size_t max_vertices = 0)
+    {
+        detail::Quickhull_Builder builder(points);
+        return builder.build(max_vertices);
+    }
+
+    // Hulls of independent point clouds, built in parallel
+    inline std::vector<Convex_Hull> make_convex_hulls(const std::vector<std::vector<knu::math::v3f>> &clouds, size_t max_vertices = 0)
+    {
+        std::vector<Convex_Hull> hulls(clouds.size());
+        parallel_for(clouds.size(), [&](size_t i)
+        {
+            hulls[i] = make_convex_hull(clouds[i], max_vertices);
+        });
+        return hulls;
+    }
+
+    // One hull per mesh of a loaded Obj, built in parallel
+    inline std::vector<Convex_Hull> make_convex_hulls(const Obj &o, size_t max_vertices = 0)
+    {
+        std::vector<Convex_Hull> hulls(o.meshes.size());
+        parallel_for(o.meshes.size(), [&](size_t i)
+        {
+            hulls[i] = make_convex_hull(o.meshes[i].v, max_vertices);
+        });
+        return hulls;
+    }
+}
+
+#endif  // KNU_QUICKHULL
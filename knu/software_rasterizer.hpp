@@ -0,0 +1,490 @@
+#ifndef KNU_SOFTWARE_RASTERIZER
+#define KNU_SOFTWARE_RASTERIZER
+
+// CPU rasterizer for headless rendering of Obj/Model_Obj content.
+// Triangles are transformed and set up at draw time, binned into screen tiles, then the
+// tiles are rasterized in parallel with 4-wide edge functions against a float depth buffer.
+
+#include <knu/mathlibrary5.hpp>
+#include <knu/obj.hpp>
+#include <knu/parallel.hpp>
+#include <knu/timings.hpp>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include <cstdint>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define KNU_RASTER_SSE2
+#endif
+
+namespace knu
+{
+    namespace graphics
+    {
+        struct raster_stats
+        {
+            size_t triangles_submitted;
+            size_t triangles_rasterized;    // after clipping and culling
+            size_t pixels_written;          // samples that passed the depth test
+            std::chrono::nanoseconds setup_time;
+            std::chrono::nanoseconds raster_time;
+
+            double triangles_per_second() const
+            {
+                auto s = std::chrono::duration<double>(setup_time + raster_time).count();
+                return s > 0.0 ? triangles_rasterized / s : 0.0;
+            }
+
+            double pixels_per_second() const
+            {
+                auto s = std::chrono::duration<double>(raster_time).count();
+                return s > 0.0 ? pixels_written / s : 0.0;
+            }
+        };
+
+        class software_rasterizer
+        {
+            struct triangle_setup
+            {
+                float e_a[3], e_b[3], e_c[3];   // edge functions, positive inside
+                float z_a, z_b, z_c;            // depth plane z = z_a * x + z_b * y + z_c
+                int min_x, min_y, max_x, max_y; // inclusive pixel bounds
+                std::uint32_t color;
+            };
+
+            int w, h, pitch, tile;
+            int tiles_x, tiles_y;
+            std::vector<float> depth;
+            std::vector<std::uint32_t> color;
+            std::vector<triangle_setup> setups;
+            std::vector<std::vector<unsigned int>> bins;
+            knu::math::v3f light_dir;
+            bool cull_back_faces;
+            raster_stats stats;
+
+        private:
+            static std::uint32_t pack_color(knu::math::v4f c)
+            {
+                auto to_byte = [](float f) -> std::uint32_t
+                {
+                    return (std::uint32_t)(knu::math::utility::clamp(f, 0.0f, 1.0f) * 255.0f + 0.5f);
+                };
+                return to_byte(c.x) | (to_byte(c.y) << 8) | (to_byte(c.z) << 16) | (to_byte(c.w) << 24);
+            }
+
+            // Clip a triangle against the near plane (z >= -w) in clip space
+            static int clip_near(const knu::math::v4f in[3], knu::math::v4f out[4])
+            {
+                int count = 0;
+                for(int i = 0; i < 3; ++i)
+                {
+                    const auto &a = in[i];
+                    const auto &b = in[(i + 1) % 3];
+                    float da = a.z + a.w;
+                    float db = b.z + b.w;
+
+                    if(da >= 0.0f)
+                        out[count++] = a;
+
+                    if((da >= 0.0f) != (db >= 0.0f))
+                    {
+                        float t = da / (da - db);
+                        out[count++] = a + (b - a) * t;
+                    }
+                }
+                return count;
+            }
+
+            void setup_triangle(const knu::math::v4f clip[3], std::uint32_t c)
+            {
+                knu::math::v3f s[3];
+                for(int i = 0; i < 3; ++i)
+                {
+                    float inv_w = 1.0f / clip[i].w;
+                    s[i].x = (clip[i].x * inv_w * 0.5f + 0.5f) * w;
+                    s[i].y = (0.5f - clip[i].y * inv_w * 0.5f) * h;      // image rows run top down
+                    s[i].z = clip[i].z * inv_w * 0.5f + 0.5f;
+                }
+
+                // twice the signed area; y is flipped so counter clockwise triangles come out negative
+                float area = (s[1].x - s[0].x) * (s[2].y - s[0].y) - (s[2].x - s[0].x) * (s[1].y - s[0].y);
+
+                if(std::fabs(area) < 1e-8f)
+                    return;
+
+                if(area > 0.0f)
+                {
+                    if(cull_back_faces)
+                        return;
+                    std::swap(s[1], s[2]);
+                    area = -area;
+                }
+
+                float min_xf = std::min({s[0].x, s[1].x, s[2].x});
+                float max_xf = std::max({s[0].x, s[1].x, s[2].x});
+                float min_yf = std::min({s[0].y, s[1].y, s[2].y});
+                float max_yf = std::max({s[0].y, s[1].y, s[2].y});
+
+                triangle_setup t;
+                t.min_x = std::max(0, (int)std::floor(min_xf));
+                t.min_y = std::max(0, (int)std::floor(min_yf));
+                t.max_x = std::min(w - 1, (int)std::ceil(max_xf));
+                t.max_y = std::min(h - 1, (int)std::ceil(max_yf));
+
+                if(t.min_x > t.max_x || t.min_y > t.max_y)
+                    return;
+
+                // edge i is opposite vertex i; evaluated at pixel centers
+                float inv_area = -1.0f / area;
+                for(int i = 0; i < 3; ++i)
+                {
+                    const auto &a = s[(i + 1) % 3];
+                    const auto &b = s[(i + 2) % 3];
+                    t.e_a[i] = (b.y - a.y);
+                    t.e_b[i] = (a.x - b.x);
+                    t.e_c[i] = (b.x * a.y - a.x * b.y) + (t.e_a[i] + t.e_b[i]) * 0.5f;
+                }
+
+                // depth from barycentrics, folded into one plane equation
+                t.z_a = (t.e_a[0] * s[0].z + t.e_a[1] * s[1].z + t.e_a[2] * s[2].z) * inv_area;
+                t.z_b = (t.e_b[0] * s[0].z + t.e_b[1] * s[1].z + t.e_b[2] * s[2].z) * inv_area;
+                t.z_c = (t.e_c[0] * s[0].z + t.e_c[1] * s[1].z + t.e_c[2] * s[2].z) * inv_area;
+                t.color = c;
+
+                setups.push_back(t);
+            }
+
+            size_t raster_tile(int tx, int ty)
+            {
+                int x0 = tx * tile, y0 = ty * tile;
+                int x1 = std::min(x0 + tile, pitch) - 1, y1 = std::min(y0 + tile, h) - 1;
+                size_t written = 0;
+
+                for(auto index : bins[ty * tiles_x + tx])
+                {
+                    const auto &t = setups[index];
+                    int bx0 = std::max(t.min_x, x0) & ~3;
+                    int bx1 = std::min(t.max_x, x1);
+                    int by0 = std::max(t.min_y, y0);
+                    int by1 = std::min(t.max_y, y1);
+
+                    for(int y = by0; y <= by1; ++y)
+                    {
+                        float *drow = &depth[(size_t)y * pitch];
+                        std::uint32_t *crow = &color[(size_t)y * pitch];
+#ifdef KNU_RASTER_SSE2
+                        const __m128 step = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+                        const __m128 zero = _mm_setzero_ps();
+                        const __m128i c = _mm_set1_epi32((int)t.color);
+                        __m128 fy = _mm_set1_ps((float)y);
+
+                        for(int x = bx0; x <= bx1; x += 4)
+                        {
+                            __m128 fx = _mm_add_ps(_mm_set1_ps((float)x), step);
+                            __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+                            for(int e = 0; e < 3; ++e)
+                            {
+                                __m128 ev = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.e_a[e]), fx),
+                                    _mm_mul_ps(_mm_set1_ps(t.e_b[e]), fy)), _mm_set1_ps(t.e_c[e]));
+                                mask = _mm_and_ps(mask, _mm_cmpge_ps(ev, zero));
+                            }
+
+                            // the row pitch is padded to 4 pixels; keep the padding untouched
+                            if(x + 4 > w)
+                                mask = _mm_and_ps(mask, _mm_cmplt_ps(fx, _mm_set1_ps((float)w)));
+
+                            if(!_mm_movemask_ps(mask))
+                                continue;
+
+                            __m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.z_a), fx),
+                                _mm_mul_ps(_mm_set1_ps(t.z_b), fy)), _mm_set1_ps(t.z_c));
+                            __m128 old_z = _mm_loadu_ps(drow + x);
+                            mask = _mm_and_ps(mask, _mm_cmplt_ps(z, old_z));
+
+                            int bits = _mm_movemask_ps(mask);
+                            if(!bits)
+                                continue;
+
+                            _mm_storeu_ps(drow + x, _mm_or_ps(_mm_and_ps(mask, z), _mm_andnot_ps(mask, old_z)));
+                            __m128i old_c = _mm_loadu_si128((const __m128i *)(crow + x));
+                            __m128i mi = _mm_castps_si128(mask);
+                            _mm_storeu_si128((__m128i *)(crow + x), _mm_or_si128(_mm_and_si128(mi, c), _mm_andnot_si128(mi, old_c)));
+
+                            written += (bits & 1) + ((bits >> 1) & 1) + ((bits >> 2) & 1) + ((bits >> 3) & 1);
+                        }
+#else
+                        for(int x = bx0; x <= bx1; ++x)
+                        {
+                            float fx = (float)x, fy = (float)y;
+                            if(t.e_a[0] * fx + t.e_b[0] * fy + t.e_c[0] < 0.0f) continue;
+                            if(t.e_a[1] * fx + t.e_b[1] * fy + t.e_c[1] < 0.0f) continue;
+                            if(t.e_a[2] * fx + t.e_b[2] * fy + t.e_c[2] < 0.0f) continue;
+
+                            float z = t.z_a * fx + t.z_b * fy + t.z_c;
+                            if(z < drow[x])
+                            {
+                                drow[x] = z;
+                                crow[x] = t.color;
+                                ++written;
+                            }
+                        }
+#endif
+                    }
+                }
+
+                return written;
+            }
+
+        public:
+            // tile must be a multiple of 4 so the 4-wide spans never straddle tiles
+            software_rasterizer(int width, int height, int tile_size = 64):
+            w(width), h(height), pitch((width + 3) & ~3), tile(std::max(4, tile_size & ~3)),
+            tiles_x(0), tiles_y(0), depth(), color(), setups(), bins(),
+            light_dir(0.3f, 0.5f, 0.8f), cull_back_faces(true), stats()
+            {
+                if(width <= 0 || height <= 0)
+                    throw std::runtime_error("software_rasterizer - invalid image size");
+
+                tiles_x = (pitch + tile - 1) / tile;
+                tiles_y = (h + tile - 1) / tile;
+                depth.resize((size_t)pitch * h);
+                color.resize((size_t)pitch * h);
+                bins.resize((size_t)tiles_x * tiles_y);
+                light_dir.normalize();
+                clear(knu::math::v4f(0.0f, 0.0f, 0.0f, 1.0f));
+            }
+
+            int width() const { return w; }
+            int height() const { return h; }
+
+            void set_light_direction(knu::math::v3f dir) { light_dir = dir.normalize(); }
+            void set_cull_back_faces(bool cull) { cull_back_faces = cull; }
+
+            void clear(knu::math::v4f clear_color, float clear_depth = 1.0f)
+            {
+                std::fill(std::begin(depth), std::end(depth), clear_depth);
+                std::fill(std::begin(color), std::end(color), pack_color(clear_color));
+                setups.clear();
+                stats = raster_stats();
+            }
+
+            // Vertex block described by a Vertex_Layout, such as the interleaved vertices Model_Obj
+            // uploads or what Obj::write_mesh_vertices writes. Offsets and strides must be whole floats.
+            void draw(const void *data, const Vertex_Layout &layout, size_t vertex_count, const knu::math::m4f &mvp,
+                      const knu::math::m4f &model, knu::math::v4f base_color)
+            {
+                auto whole = [](const Vertex_Layout::Attribute &a)
+                {
+                    return a.offset % sizeof(float) == 0 && a.stride % sizeof(float) == 0;
+                };
+                bool has_n = layout.normal.offset >= 0;
+                if(!whole(layout.position) || (has_n && !whole(layout.normal)))
+                    throw std::runtime_error("software_rasterizer - vertex layout is not float aligned");
+
+                auto bytes = static_cast<const char *>(data);
+                auto positions = reinterpret_cast<const float *>(bytes + layout.position.offset);
+                auto normals = has_n ? reinterpret_cast<const float *>(bytes + layout.normal.offset) : nullptr;
+
+                draw(positions, layout.position.stride / sizeof(float), normals, has_n ? layout.normal.stride / sizeof(float) : 0,
+                     vertex_count, mvp, model, base_color);
+            }
+
+            // Non indexed triangle list with strided positions and optional normals (strides in floats).
+            // Faces are flat shaded with a directional light; without normals the face normal is used.
+            void draw(const float *positions, size_t position_stride, const float *normals, size_t normal_stride,
+                      size_t vertex_count, const knu::math::m4f &mvp, const knu::math::m4f &model, knu::math::v4f base_color)
+            {
+                knu::Time::Timings timer;
+                timer.time_stamp_1();
+
+                size_t tri_count = vertex_count / 3;
+                std::vector<knu::math::v4f> clip(tri_count * 3);
+
+                parallel_for_ranges(vertex_count - vertex_count % 3, [&](size_t begin, size_t end)
+                {
+                    for(size_t i = begin; i < end; ++i)
+                    {
+                        const float *p = positions + i * position_stride;
+                        clip[i] = knu::math::v4f(p[0], p[1], p[2], 1.0f) * mvp;
+                    }
+                }, 4096);
+
+                setups.reserve(setups.size() + tri_count);
+                knu::math::v4f clipped[4], tri[3];
+
+                for(size_t i = 0; i < tri_count; ++i)
+                {
+                    knu::math::v3f n;
+                    if(normals)
+                    {
+                        for(int k = 0; k < 3; ++k)
+                        {
+                            const float *np = normals + (i * 3 + k) * normal_stride;
+                            n += knu::math::v3f(np[0], np[1], np[2]);
+                        }
+                    }
+                    else
+                    {
+                        const float *a = positions + (i * 3) * position_stride;
+                        const float *b = positions + (i * 3 + 1) * position_stride;
+                        const float *c = positions + (i * 3 + 2) * position_stride;
+                        knu::math::v3f pa(a[0], a[1], a[2]), pb(b[0], b[1], b[2]), pc(c[0], c[1], c[2]);
+                        n = (pb - pa).cross(pc - pa);
+                    }
+
+                    n = (knu::math::v4f(n, 0.0f) * model).get_vec3();
+                    n.normalize();
+                    float lambert = 0.2f + 0.8f * knu::math::utility::maximum(0.0f, n.dot(light_dir));
+                    auto c = pack_color(knu::math::v4f(base_color.x * lambert, base_color.y * lambert, base_color.z * lambert, base_color.w));
+
+                    for(int k = 0; k < 3; ++k)
+                        tri[k] = clip[i * 3 + k];
+
+                    int count = clip_near(tri, clipped);
+                    for(int k = 1; k + 1 < count; ++k)
+                    {
+                        knu::math::v4f fan[3] = {clipped[0], clipped[k], clipped[k + 1]};
+                        setup_triangle(fan, c);
+                    }
+                }
+
+                stats.triangles_submitted += tri_count;
+                timer.time_stamp_2();
+                stats.setup_time += timer.diff_nano();
+            }
+
+            void draw(const Obj &o, const knu::math::m4f &mvp, const knu::math::m4f &model, knu::math::v4f base_color)
+            {
+                for(const auto &m : o.meshes)
+                {
+                    if(m.v.empty())
+                        continue;
+                    
+                    if(m.indexed())
+                    {
+                        auto v = m.expand(m.v);
+                        auto n = m.expand(m.n);
+                        draw(&v[0].x, 3, n.empty() ? nullptr : &n[0].x, 3, v.size(), mvp, model, base_color);
+                    }
+                    else
+                        draw(&m.v[0].x, 3, m.n.empty() ? nullptr : &m.n[0].x, 3, m.v.size(), mvp, model, base_color);
+                }
+            }
+
+            // Bins every triangle drawn since the last clear/flush and rasterizes the tiles in parallel
+            void flush()
+            {
+                knu::Time::Timings timer;
+                timer.time_stamp_1();
+
+                for(auto &b : bins)
+                    b.clear();
+
+                for(unsigned int i = 0; i < setups.size(); ++i)
+                {
+                    const auto &t = setups[i];
+                    for(int ty = t.min_y / tile; ty <= t.max_y / tile; ++ty)
+                        for(int tx = t.min_x / tile; tx <= t.max_x / tile; ++tx)
+                            bins[ty * tiles_x + tx].push_back(i);
+                }
+
+                std::vector<size_t> written(bins.size(), 0);
+                parallel_for(bins.size(), [&](size_t i)
+                {
+                    written[i] = raster_tile(int(i % tiles_x), int(i / tiles_x));
+                });
+
+                for(auto n : written)
+                    stats.pixels_written += n;
+
+                stats.triangles_rasterized += setups.size();
+                setups.clear();
+
+                timer.time_stamp_2();
+                stats.raster_time += timer.diff_nano();
+            }
+
+            const raster_stats &statistics() const { return stats; }
+
+            // Tightly packed RGBA8 rows, top row first
+            std::vector<std::uint8_t> rgba() const
+            {
+                std::vector<std::uint8_t> out((size_t)w * h * 4);
+                for(int y = 0; y < h; ++y)
+                {
+                    for(int x = 0; x < w; ++x)
+                    {
+                        auto c = color[(size_t)y * pitch + x];
+                        auto *p = &out[((size_t)y * w + x) * 4];
+                        p[0] = c & 0xff; p[1] = (c >> 8) & 0xff; p[2] = (c >> 16) & 0xff; p[3] = (c >> 24) & 0xff;
+                    }
+                }
+                return out;
+            }
+
+            const std::vector<float> &depth_buffer() const { return depth; }
+            int depth_pitch() const { return pitch; }
+
+            // Uncompressed 32 bit truecolor tga
+            void write_tga(const std::string &file_name) const
+            {
+                std::ofstream file(file_name, std::ios::binary);
+                if(!file)
+                    throw std::runtime_error("Unable to open " + file_name);
+
+                unsigned char header[18] = {};
+                header[2] = 2;
+                header[12] = w & 0xff; header[13] = (w >> 8) & 0xff;
+                header[14] = h & 0xff; header[15] = (h >> 8) & 0xff;
+                header[16] = 32;
+                header[17] = 0x28;      // 8 alpha bits, top left origin
+                file.write((const char *)header, sizeof(header));
+
+                std::vector<unsigned char> row((size_t)w * 4);
+                for(int y = 0; y < h; ++y)
+                {
+                    for(int x = 0; x < w; ++x)
+                    {
+                        auto c = color[(size_t)y * pitch + x];
+                        row[x * 4 + 0] = (c >> 16) & 0xff;
+                        row[x * 4 + 1] = (c >> 8) & 0xff;
+                        row[x * 4 + 2] = c & 0xff;
+                        row[x * 4 + 3] = (c >> 24) & 0xff;
+                    }
+                    file.write((const char *)row.data(), row.size());
+                }
+            }
+        };
+
+        // Renders a vertex block `frames` times and returns the accumulated throughput
+        inline raster_stats benchmark_rasterizer(software_rasterizer &r, const std::vector<knu::math::v3f> &positions,
+                                                 const knu::math::m4f &mvp, int frames)
+        {
+            raster_stats total = raster_stats();
+            knu::math::m4f identity;
+
+            for(int i = 0; i < frames; ++i)
+            {
+                r.clear(knu::math::v4f(0.0f, 0.0f, 0.0f, 1.0f));
+                r.draw(&positions[0].x, 3, nullptr, 0, positions.size(), mvp, identity, knu::math::v4f(1.0f, 1.0f, 1.0f, 1.0f));
+                r.flush();
+
+                const auto &s = r.statistics();
+                total.triangles_submitted += s.triangles_submitted;
+                total.triangles_rasterized += s.triangles_rasterized;
+                total.pixels_written += s.pixels_written;
+                total.setup_time += s.setup_time;
+                total.raster_time += s.raster_time;
+            }
+
+            return total;
+        }
+    }
+}
+
+#endif  // KNU_SOFTWARE_RASTERIZER